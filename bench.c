@@ -0,0 +1,617 @@
+#include "common.h"
+
+#include <getopt.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+// loopback benchmark of the whole data path on top of the debug peer pair
+// both peers use a tunnel backend fed from the process (rings or socketpairs): udp packets of a given
+// size mix are written where the client reads its tunnel and collected where the server writes its own
+// every packet carries a sequence number and the time it was written to measure the latency
+
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_SCHEDULE 1024 // sum of the weights of the mix
+#define BENCH_MAGIC 0x424E4348 // "BNCH"
+#define BENCH_CONNECT_TIMEOUT 5000 // ms
+#define BENCH_DRAIN_TIME 200 // ms to wait for the packets still in flight
+#define BENCH_DEFAULT_MIX "64:7,576:4,1400:1" // simple imix
+
+// udp payload of every packet, the rest is filler
+typedef struct {
+    uint32_t magic;
+    uint32_t size; // of the whole ip packet
+    uint64_t sequence;
+    uint64_t time; // latency_now() when written
+} BenchStamp;
+
+#define BENCH_HEADERS (20 + 8) // ipv4 and udp
+#define BENCH_MIN_SIZE (BENCH_HEADERS + sizeof(BenchStamp))
+
+typedef struct {
+    uint32_t size;
+    uint32_t weight;
+    uint8_t* packet; // template with the headers already filled
+} BenchSize;
+
+typedef enum {
+    BP_Connecting = 0,
+    BP_Warmup,
+    BP_Measure,
+    BP_Drain,
+    BP_Done
+} BenchPhase;
+
+typedef struct {
+    // configuration
+    StartupOptions vpn;
+    char mix[128];
+    BenchSize sizes[BENCH_MAX_SIZES];
+    uint32_t size_count;
+    uint8_t schedule[BENCH_MAX_SCHEDULE]; // order in which the sizes are sent
+    uint32_t schedule_length;
+    uint32_t rate; // packets per second, zero for as fast as possible
+    uint32_t duration; // ms
+    uint32_t warmup; // ms
+    bool json;
+    uint32_t max_size; // largest packet the tunnels take
+
+    // every queue of both peers
+    Tunnel* client_tunnels[PEER_MAX_QUEUES];
+    uint32_t client_count;
+    Tunnel* server_tunnels[PEER_MAX_QUEUES];
+    uint32_t server_count;
+
+    uint32_t phase;
+    uint32_t seen; // set by the collector once the first packet arrives
+    uint64_t measure_start; // packets written in [start, end) are measured
+    uint64_t measure_end;
+
+    // generator, written by the main thread
+    uint64_t sent;
+    uint64_t sent_bytes;
+
+    // collector
+    uint64_t received;
+    uint64_t received_bytes;
+    uint64_t corrupted;
+    uint64_t max_latency;
+    LatencyHistogram latency;
+} Bench;
+
+bool bench_parse_mix(Bench* bench, const char* mix)
+{
+    strncpy(bench->mix, mix, sizeof(bench->mix) - 1);
+
+    char text[128];
+    strncpy(text, mix, sizeof(text) - 1);
+    text[sizeof(text) - 1] = '\0';
+
+    uint32_t total = 0;
+    bench->size_count = 0;
+    for (char* token = strtok(text, ","); token; token = strtok(NULL, ","))
+    {
+        if (bench->size_count == BENCH_MAX_SIZES)
+            return false;
+
+        char* end = NULL;
+        const unsigned long size = strtoul(token, &end, 10);
+        unsigned long weight = 1;
+        if (*end == ':')
+            weight = strtoul(end + 1, &end, 10);
+        if (*end != '\0' || size < BENCH_MIN_SIZE || size > 65535 || weight == 0)
+            return false;
+
+        total += weight;
+        if (total > BENCH_MAX_SCHEDULE)
+            return false;
+
+        BenchSize* entry = &bench->sizes[bench->size_count++];
+        entry->size = (uint32_t)size;
+        entry->weight = (uint32_t)weight;
+    }
+    if (bench->size_count == 0)
+        return false;
+
+    // smooth weighted round robin spreads the sizes instead of sending them in runs
+    int32_t current[BENCH_MAX_SIZES];
+    memset(current, 0, sizeof(current));
+    bench->schedule_length = total;
+    for (uint32_t i = 0; i < total; i++)
+    {
+        uint32_t best = 0;
+        for (uint32_t s = 0; s < bench->size_count; s++)
+        {
+            current[s] += bench->sizes[s].weight;
+            if (current[s] > current[best])
+                best = s;
+        }
+        current[best] -= total;
+        bench->schedule[i] = (uint8_t)best;
+    }
+    return true;
+}
+
+// ipv4/udp from the client tunnel address to the server one, filled with noise so compression has little to do
+bool bench_build_packets(Bench* bench, const struct sockaddr_storage* source, const struct sockaddr_storage* destination)
+{
+    if (source->ss_family != AF_INET || destination->ss_family != AF_INET)
+    {
+        printf("%s: only ipv4 tunnels are supported\n", __func__);
+        return false;
+    }
+
+    uint32_t seed = 0x2545F491;
+    for (uint32_t s = 0; s < bench->size_count; s++)
+    {
+        BenchSize* entry = &bench->sizes[s];
+        entry->packet = (uint8_t*)malloc(entry->size);
+        if (!entry->packet)
+            return false;
+
+        uint8_t* packet = entry->packet;
+        for (uint32_t i = 0; i < entry->size; i++)
+        {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            packet[i] = (uint8_t)seed;
+        }
+
+        memset(packet, 0, BENCH_HEADERS);
+        packet[0] = 0x45;
+        packet[2] = entry->size >> 8;
+        packet[3] = entry->size & 0xFF;
+        packet[8] = 64; // ttl
+        packet[9] = IPPROTO_UDP;
+        memcpy(packet + 12, &((const struct sockaddr_in*)source)->sin_addr, 4);
+        memcpy(packet + 16, &((const struct sockaddr_in*)destination)->sin_addr, 4);
+        const uint16_t check = htons(~checksum_fold(checksum_add(0, packet, 20)));
+        memcpy(packet + 10, &check, sizeof(check));
+
+        // discard port both ways, no udp checksum
+        packet[21] = 9;
+        packet[23] = 9;
+        const uint32_t udp_length = entry->size - 20;
+        packet[24] = udp_length >> 8;
+        packet[25] = udp_length & 0xFF;
+    }
+    return true;
+}
+
+uint32_t bench_list_tunnels(Peer* peer, Tunnel** tunnels)
+{
+    for (uint32_t i = 0; i <= peer->worker_count; i++)
+        tunnels[i] = (i == 0) ? &peer->tunnel : &peer->workers[i - 1]->tunnel;
+    return peer->worker_count + 1;
+}
+
+void bench_receive(Bench* bench, const uint8_t* packet, const uint32_t length)
+{
+    const uint64_t now = latency_now();
+    if (length < BENCH_MIN_SIZE)
+        return;
+
+    BenchStamp stamp;
+    memcpy(&stamp, packet + BENCH_HEADERS, sizeof(stamp));
+    if (stamp.magic != BENCH_MAGIC)
+        return; // something the vpn wrote on its own
+
+    __atomic_store_n(&bench->seen, 1, __ATOMIC_RELEASE);
+    if (stamp.size != length)
+    {
+        bench->corrupted++;
+        return;
+    }
+
+    // only what was written during the measurement counts, even if it arrives afterwards
+    const uint64_t start = __atomic_load_n(&bench->measure_start, __ATOMIC_ACQUIRE);
+    const uint64_t end = __atomic_load_n(&bench->measure_end, __ATOMIC_ACQUIRE);
+    if (start == 0 || stamp.time < start || (end != 0 && stamp.time >= end))
+        return;
+
+    const uint64_t latency = now - stamp.time;
+    latency_record(&bench->latency, latency);
+    if (latency > bench->max_latency)
+        bench->max_latency = latency;
+    bench->received++;
+    bench->received_bytes += length;
+}
+
+void* bench_collect(void* argument)
+{
+    Bench* bench = (Bench*)argument;
+
+    struct pollfd fds[PEER_MAX_QUEUES];
+    for (uint32_t i = 0; i < bench->server_count; i++)
+    {
+        Tunnel* tunnel = bench->server_tunnels[i];
+        fds[i].fd = tunnel->ring ? tunnel_ring_collect_fd(tunnel) : tunnel->outside;
+        fds[i].events = POLLIN;
+    }
+
+    uint8_t buffer[65536];
+    while(__atomic_load_n(&bench->phase, __ATOMIC_RELAXED) != BP_Done)
+    {
+        if (poll(fds, bench->server_count, 10) <= 0)
+            continue;
+
+        for (uint32_t i = 0; i < bench->server_count; i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+
+            Tunnel* tunnel = bench->server_tunnels[i];
+            if (tunnel->ring)
+            {
+                uint32_t length = sizeof(buffer);
+                while(tunnel_ring_collect(tunnel, buffer, &length))
+                {
+                    bench_receive(bench, buffer, length);
+                    length = sizeof(buffer);
+                }
+                continue;
+            }
+
+            ssize_t count;
+            while((count = read(fds[i].fd, buffer, sizeof(buffer))) > 0)
+                bench_receive(bench, buffer, (uint32_t)count);
+        }
+    }
+    return NULL;
+}
+
+void* bench_run_pair(void* argument)
+{
+    debug_pair_run((DebugPair*)argument);
+    return NULL;
+}
+
+uint64_t bench_milliseconds(const uint64_t ticks)
+{
+    return ticks * 1000 / latency_ticks_per_second();
+}
+
+// writes the next packet of the mix to one of the client queues, false if it had to wait
+bool bench_send(Bench* bench, const uint64_t sequence)
+{
+    BenchSize* entry = &bench->sizes[bench->schedule[sequence % bench->schedule_length]];
+    Tunnel* tunnel = bench->client_tunnels[sequence % bench->client_count];
+
+    BenchStamp stamp;
+    stamp.magic = BENCH_MAGIC;
+    stamp.size = entry->size;
+    stamp.sequence = sequence;
+    stamp.time = latency_now();
+    memcpy(entry->packet + BENCH_HEADERS, &stamp, sizeof(stamp));
+
+    if (tunnel->ring)
+    {
+        // the client is behind, there's nothing to wait on but let it run
+        if (!tunnel_ring_inject(tunnel, entry->packet, entry->size))
+        {
+            sched_yield();
+            return false;
+        }
+    }
+    else if (write(tunnel->outside, entry->packet, entry->size) == -1)
+    {
+        if (errno != EAGAIN)
+            print_errno(__func__, "error writing to the client tunnel", errno);
+
+        // the client is behind, wait for it instead of spinning
+        struct pollfd pending = { tunnel->outside, POLLOUT, 0 };
+        poll(&pending, 1, 10);
+        return false;
+    }
+
+    const uint32_t phase = __atomic_load_n(&bench->phase, __ATOMIC_RELAXED);
+    if (phase == BP_Measure)
+    {
+        bench->sent++;
+        bench->sent_bytes += entry->size;
+    }
+    return true;
+}
+
+double bench_cpu_seconds(const clockid_t clock)
+{
+    struct timespec spec;
+    if (clock_gettime(clock, &spec) == -1)
+        return 0;
+    return spec.tv_sec + spec.tv_nsec / 1e9;
+}
+
+double bench_process_cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// generates the traffic in this thread, connecting, warming up and measuring
+bool bench_generate(Bench* bench, const clockid_t collector_clock, double* vpn_cpu)
+{
+    const uint64_t ticks_per_second = latency_ticks_per_second();
+    uint64_t sequence = 0;
+
+    // send a packet now and then until one goes through
+    const uint64_t connect_start = latency_now();
+    while(!__atomic_load_n(&bench->seen, __ATOMIC_ACQUIRE))
+    {
+        if (bench_milliseconds(latency_now() - connect_start) > BENCH_CONNECT_TIMEOUT)
+        {
+            printf("%s: the peers didn't connect\n", __func__);
+            return false;
+        }
+        bench_send(bench, sequence++);
+        usleep(10 * 1000);
+    }
+
+    __atomic_store_n(&bench->phase, BP_Warmup, __ATOMIC_RELAXED);
+    const uint64_t interval = bench->rate > 0 ? ticks_per_second / bench->rate : 0;
+    const uint64_t warmup_end = latency_now() + bench->warmup * ticks_per_second / 1000;
+    uint64_t measure_end = 0;
+    uint64_t next = latency_now();
+
+    double cpu_start = 0, own_start = 0, collector_start = 0;
+    while(true)
+    {
+        const uint64_t now = latency_now();
+        const uint32_t phase = __atomic_load_n(&bench->phase, __ATOMIC_RELAXED);
+        if (phase == BP_Warmup && now >= warmup_end)
+        {
+            cpu_start = bench_process_cpu_seconds();
+            own_start = bench_cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+            collector_start = bench_cpu_seconds(collector_clock);
+            measure_end = now + bench->duration * ticks_per_second / 1000;
+            __atomic_store_n(&bench->measure_start, now, __ATOMIC_RELEASE);
+            __atomic_store_n(&bench->phase, BP_Measure, __ATOMIC_RELAXED);
+        }
+        else if (phase == BP_Measure && now >= measure_end)
+        {
+            __atomic_store_n(&bench->measure_end, now, __ATOMIC_RELEASE);
+            break;
+        }
+
+        if (interval > 0)
+        {
+            if (now < next)
+            {
+                // sleep only when far enough ahead, otherwise let the vpn threads run meanwhile
+                const uint64_t ahead = (next - now) * 1000000 / ticks_per_second;
+                if (ahead > 100)
+                    usleep(ahead - 50);
+                else
+                    sched_yield();
+                continue;
+            }
+            next += interval;
+        }
+
+        while(!bench_send(bench, sequence))
+        {
+            if (__atomic_load_n(&bench->phase, __ATOMIC_RELAXED) == BP_Measure && latency_now() >= measure_end)
+                break;
+        }
+        sequence++;
+    }
+
+    // the packets still in flight may arrive yet
+    __atomic_store_n(&bench->phase, BP_Drain, __ATOMIC_RELAXED);
+    const double own_end = bench_cpu_seconds(CLOCK_THREAD_CPUTIME_ID);
+    usleep(BENCH_DRAIN_TIME * 1000);
+    const double cpu_end = bench_process_cpu_seconds();
+    const double collector_end = bench_cpu_seconds(collector_clock);
+
+    // what the vpn threads used, without the generator and the collector
+    *vpn_cpu = (cpu_end - cpu_start) - (own_end - own_start) - (collector_end - collector_start);
+    if (*vpn_cpu < 0)
+        *vpn_cpu = 0;
+    return true;
+}
+
+// the buckets give their highest value, never more than the real maximum
+uint64_t bench_percentile(const Bench* bench, const double fraction)
+{
+    const uint64_t value = latency_percentile(bench->latency.buckets, bench->latency.count, fraction);
+    return value < bench->max_latency ? value : bench->max_latency;
+}
+
+void bench_report(const Bench* bench, const double vpn_cpu)
+{
+    const double ticks_to_ns = 1e9 / latency_ticks_per_second();
+    const double max = bench->max_latency * ticks_to_ns / 1000;
+    const double seconds = (bench->measure_end - bench->measure_start) * ticks_to_ns / 1e9;
+    const double pps = seconds > 0 ? bench->received / seconds : 0;
+    const double gbps = seconds > 0 ? bench->received_bytes * 8 / seconds / 1e9 : 0;
+    const uint64_t lost = bench->sent > bench->received ? bench->sent - bench->received : 0;
+    const double p50 = bench_percentile(bench, 0.5) * ticks_to_ns / 1000;
+    const double p99 = bench_percentile(bench, 0.99) * ticks_to_ns / 1000;
+    const double p999 = bench_percentile(bench, 0.999) * ticks_to_ns / 1000;
+    const double cpu_per_packet = bench->received > 0 ? vpn_cpu * 1e9 / bench->received : 0;
+
+    if (bench->json)
+    {
+        printf("{\"mix\":\"%s\",\"max_size\":%u,\"queues\":%u,\"threads\":%u,\"compress\":%s,\"encrypt\":%s,\"checksum\":\"%s\",\"rate\":%u,\"pacing_mbits\":%u,"
+            "\"seconds\":%.3f,\"sent\":%llu,\"received\":%llu,\"lost\":%llu,\"corrupted\":%llu,\"pps\":%.0f,\"gbps\":%.3f,"
+            "\"latency_us\":{\"p50\":%.2f,\"p99\":%.2f,\"p999\":%.2f,\"max\":%.2f},\"cpu_seconds\":%.3f,\"cpu_ns_per_packet\":%.0f}\n",
+            bench->mix, bench->max_size, bench->client_count, bench->vpn.crypto_threads,
+            bench->vpn.compress ? "true" : "false", bench->vpn.key_file[0] ? "true" : "false",
+            bench->vpn.checksum[0] ? bench->vpn.checksum : "default", bench->rate, bench->vpn.total_rate,
+            seconds, (unsigned long long)bench->sent, (unsigned long long)bench->received,
+            (unsigned long long)lost, (unsigned long long)bench->corrupted, pps, gbps,
+            p50, p99, p999, max, vpn_cpu, cpu_per_packet);
+        return;
+    }
+
+    printf("\nmix %s for %.2f s%s\n", bench->mix, seconds, bench->rate ? "" : " as fast as possible");
+    printf("    sent %llu, received %llu, lost %llu, corrupted %llu\n", (unsigned long long)bench->sent,
+        (unsigned long long)bench->received, (unsigned long long)lost, (unsigned long long)bench->corrupted);
+    printf("    %.0f pps, %.3f Gbit/s\n", pps, gbps);
+    printf("    latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", p50, p99, p999, max);
+    printf("    vpn cpu %.2f s (%.0f%% of a core), %.0f ns per packet\n", vpn_cpu, seconds > 0 ? vpn_cpu * 100 / seconds : 0, cpu_per_packet);
+}
+
+void bench_show_help(const char* executable)
+{
+    printf("\nUsage: %s [-s <size mix>] [-d <seconds>] [-w <seconds>] [-f <pps>] [-j] [-b <backend>] [-l <mtu>] [-q <queues>] [-t <threads>] [-k <checksum>] [-z] [-e <key file>] [-g <rate>] [-n <burst>]\n", executable);
+    printf("\t-s, --sizes\tip packet sizes to send with their weights, as size:weight,... (defaults to %s)\n", BENCH_DEFAULT_MIX);
+    printf("\t-d, --duration\tseconds to measure. (defaults to 5)\n");
+    printf("\t-w, --warmup\tseconds to send before measuring. (defaults to 1)\n");
+    printf("\t-f, --frequency\tpackets per second to send, 0 sends as fast as the client takes them. (defaults to 0)\n");
+    printf("\t-j, --json\tprint the results as a single json line.\n");
+    printf("\t-b, --backend\ttunnel backend of both peers: ring or socketpair. (defaults to ring)\n");
+    printf("\tthe rest are the same options of the vpn, applied to both peers.\n");
+}
+
+bool bench_parse_options(int argc, char** argv, Bench* bench)
+{
+    const struct option long_options[] =
+    {
+        {"sizes",      required_argument,   0, 's'},
+        {"duration",   required_argument,   0, 'd'},
+        {"warmup",     required_argument,   0, 'w'},
+        {"frequency",  required_argument,   0, 'f'},
+        {"json",       no_argument,         0, 'j'},
+        {"backend",    required_argument,   0, 'b'},
+        {"mtu",        required_argument,   0, 'l'},
+        {"queues",     required_argument,   0, 'q'},
+        {"threads",    required_argument,   0, 't'},
+        {"checksum",   required_argument,   0, 'k'},
+        {"compress",   no_argument,         0, 'z'},
+        {"key",        required_argument,   0, 'e'},
+        {"total-rate", required_argument,   0, 'g'},
+        {"burst",      required_argument,   0, 'n'},
+        {0, 0, 0, 0}
+    };
+
+    const char* mix = BENCH_DEFAULT_MIX;
+    TunnelBackendType backend = TB_Ring;
+    bench->duration = 5000;
+    bench->warmup = 1000;
+    opterr = 0;
+
+    int c;
+    while((c = getopt_long(argc, argv, "s:d:w:f:jb:l:q:t:k:ze:g:n:", long_options, NULL)) != -1)
+    {
+        switch(c)
+        {
+        case 's': mix = optarg; break;
+        case 'd': bench->duration = (uint32_t)(atof(optarg) * 1000); break;
+        case 'w': bench->warmup = (uint32_t)(atof(optarg) * 1000); break;
+        case 'f': bench->rate = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'j': bench->json = true; break;
+        case 'b':
+            // the tun device can't be fed from here
+            if (!tunnel_backend_from_name(optarg, &backend) || backend == TB_Tun)
+                return false;
+            break;
+        case 'l': bench->vpn.mtu = (uint16_t)atoi(optarg); break;
+        case 'q': bench->vpn.queues = (uint16_t)atoi(optarg); break;
+        case 't': bench->vpn.crypto_threads = (uint16_t)atoi(optarg); break;
+        case 'k': strncpy(bench->vpn.checksum, optarg, sizeof(bench->vpn.checksum) - 1); break;
+        case 'z': bench->vpn.compress = true; break;
+        case 'e': strncpy(bench->vpn.key_file, optarg, sizeof(bench->vpn.key_file) - 1); break;
+        case 'g': bench->vpn.total_rate = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'n': bench->vpn.burst = (uint32_t)strtoul(optarg, NULL, 10); break;
+        default: return false;
+        }
+    }
+
+    bench->vpn.backend = (uint8_t)backend;
+    if (bench->duration == 0 || bench->vpn.queues > PEER_MAX_QUEUES || bench->vpn.crypto_threads > PEER_MAX_CRYPTO_THREADS
+        || bench->vpn.total_rate > PACING_MAX_RATE || bench->vpn.burst > PACING_MAX_BURST)
+        return false;
+    if (!bench_parse_mix(bench, mix))
+    {
+        printf("invalid size mix %s\n", mix);
+        return false;
+    }
+    return true;
+}
+
+// everything between creating the peers and destroying them
+bool bench_run(Bench* bench, DebugPair* pair)
+{
+    bench->max_size = protocol_max_payload(pair->client);
+    for (uint32_t s = 0; s < bench->size_count; s++)
+    {
+        if (bench->sizes[s].size > bench->max_size)
+        {
+            printf("packets of %u bytes don't fit the mtu, the largest is %u\n", bench->sizes[s].size, bench->max_size);
+            return false;
+        }
+    }
+
+    if (!bench_build_packets(bench, &pair->client->tunnel_local_address, &pair->server->tunnel_local_address))
+        return false;
+
+    bench->client_count = bench_list_tunnels(pair->client, bench->client_tunnels);
+    bench->server_count = bench_list_tunnels(pair->server, bench->server_tunnels);
+
+    // what the server writes has to wait for the collector thread
+    for (uint32_t i = 0; i < bench->server_count; i++)
+    {
+        int size = 4 * 1024 * 1024;
+        if (bench->server_tunnels[i]->outside != -1)
+            setsockopt(bench->server_tunnels[i]->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+
+    pthread_t loop_thread, collector_thread;
+    if (pthread_create(&collector_thread, NULL, bench_collect, bench) != 0)
+        return false;
+    if (pthread_create(&loop_thread, NULL, bench_run_pair, pair) != 0)
+    {
+        __atomic_store_n(&bench->phase, BP_Done, __ATOMIC_RELAXED);
+        pthread_join(collector_thread, NULL);
+        return false;
+    }
+
+    clockid_t collector_clock;
+    pthread_getcpuclockid(collector_thread, &collector_clock);
+
+    double vpn_cpu = 0;
+    const bool ok = bench_generate(bench, collector_clock, &vpn_cpu);
+
+    __atomic_store_n(&bench->phase, BP_Done, __ATOMIC_RELAXED);
+    pthread_join(collector_thread, NULL);
+    event_loop_stop(&pair->loop);
+    pthread_join(loop_thread, NULL);
+
+    if (ok)
+        bench_report(bench, vpn_cpu);
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    checksum_initialize();
+    cipher_initialize();
+
+    Bench* bench = (Bench*)calloc(1, sizeof(Bench));
+    if (!bench)
+        return -1;
+
+    if (!bench_parse_options(argc, argv, bench))
+    {
+        bench_show_help(argv[0]);
+        free(bench);
+        return -1;
+    }
+
+    // the peers chat on stdout while connecting, the results go after
+    DebugPair pair;
+    if (!debug_pair_create(&pair, &bench->vpn))
+    {
+        free(bench);
+        return -1;
+    }
+
+    const bool ok = bench_run(bench, &pair);
+
+    debug_pair_destroy(&pair);
+    for (uint32_t s = 0; s < bench->size_count; s++)
+        free(bench->sizes[s].packet);
+    free(bench);
+    return ok ? 0 : -1;
+}
\ No newline at end of file
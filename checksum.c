@@ -0,0 +1,269 @@
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// integrity checksums for the messages exchanged between peers
+// the algorithm is negotiated during the handshake, the fastest implementation
+// available on this cpu is picked once at startup
+
+typedef enum {
+    CK_Adler32 = 0, // default, used until something else is negotiated
+    CK_CRC32C,
+    CK_None, // only sensible when the cipher already authenticates the messages
+    CK_Count
+} ChecksumType;
+
+typedef uint32_t (*ChecksumFunction)(const uint8_t* buffer, const uint32_t length);
+
+typedef struct {
+    uint32_t id; // FNV-1a of the name, sent in the handshake
+    const char* name;
+    const char* implementation;
+    ChecksumFunction compute;
+} ChecksumAlgorithm;
+
+#define ADLER32_MODULO 65521
+// max bytes that can be added before the 32 bit sums may overflow
+#define ADLER32_NMAX 5552
+#define CRC32C_POLYNOMIAL 0x82F63B78 // reversed
+
+uint32_t checksum_adler32_scalar(const uint8_t* buffer, const uint32_t length)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+    uint32_t remaining = length;
+
+    // the modulo is only needed before the sums can overflow
+    while (remaining > 0)
+    {
+        uint32_t chunk = remaining < ADLER32_NMAX ? remaining : ADLER32_NMAX;
+        remaining -= chunk;
+
+        while (chunk--)
+        {
+            a += *buffer++;
+            b += a;
+        }
+
+        a %= ADLER32_MODULO;
+        b %= ADLER32_MODULO;
+    }
+    return (b << 16) | a;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 32 bytes per iteration: the byte sums go to 'a' and the position weighted sums to 'b'
+__attribute__((target("ssse3")))
+uint32_t checksum_adler32_ssse3(const uint8_t* buffer, const uint32_t length)
+{
+    const uint32_t block_size = 32;
+    uint32_t a = 1;
+    uint32_t b = 0;
+    uint32_t blocks = length / block_size;
+    uint32_t remaining = length - blocks * block_size;
+
+    const __m128i weights1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i weights2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+
+    while (blocks > 0)
+    {
+        uint32_t n = ADLER32_NMAX / block_size;
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        // every block adds the running 'a' to 'b' once per byte
+        __m128i previous_a = _mm_set_epi32(0, 0, 0, a * n);
+        __m128i sum_a = zero;
+        __m128i sum_b = _mm_set_epi32(0, 0, 0, b);
+
+        do {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i*)buffer);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i*)(buffer + 16));
+
+            previous_a = _mm_add_epi32(previous_a, sum_a);
+
+            sum_a = _mm_add_epi32(sum_a, _mm_sad_epu8(bytes1, zero));
+            sum_b = _mm_add_epi32(sum_b, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, weights1), ones));
+            sum_a = _mm_add_epi32(sum_a, _mm_sad_epu8(bytes2, zero));
+            sum_b = _mm_add_epi32(sum_b, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, weights2), ones));
+
+            buffer += block_size;
+        } while (--n);
+
+        sum_b = _mm_add_epi32(sum_b, _mm_slli_epi32(previous_a, 5));
+
+        // horizontal sums
+        sum_a = _mm_add_epi32(sum_a, _mm_shuffle_epi32(sum_a, _MM_SHUFFLE(2, 3, 0, 1)));
+        sum_a = _mm_add_epi32(sum_a, _mm_shuffle_epi32(sum_a, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum_b = _mm_add_epi32(sum_b, _mm_shuffle_epi32(sum_b, _MM_SHUFFLE(2, 3, 0, 1)));
+        sum_b = _mm_add_epi32(sum_b, _mm_shuffle_epi32(sum_b, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        a = (a + (uint32_t)_mm_cvtsi128_si32(sum_a)) % ADLER32_MODULO;
+        b = (uint32_t)_mm_cvtsi128_si32(sum_b) % ADLER32_MODULO;
+    }
+
+    // leftovers (less than a block)
+    while (remaining--)
+    {
+        a += *buffer++;
+        b += a;
+    }
+    a %= ADLER32_MODULO;
+    b %= ADLER32_MODULO;
+
+    return (b << 16) | a;
+}
+#endif
+
+static uint32_t crc32c_table[256];
+
+void checksum_crc32c_build_table()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (uint32_t bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+        crc32c_table[i] = crc;
+    }
+}
+
+uint32_t checksum_crc32c_table(const uint8_t* buffer, const uint32_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < length; i++)
+        crc = (crc >> 8) ^ crc32c_table[(crc ^ buffer[i]) & 0xFF];
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t checksum_crc32c_sse42(const uint8_t* buffer, const uint32_t length)
+{
+    uint64_t crc = 0xFFFFFFFF;
+    uint32_t remaining = length;
+
+    while (remaining >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, buffer, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+        buffer += sizeof(word);
+        remaining -= sizeof(word);
+    }
+
+    uint32_t crc32 = (uint32_t)crc;
+    while (remaining--)
+        crc32 = _mm_crc32_u8(crc32, *buffer++);
+
+    return ~crc32;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+uint32_t checksum_crc32c_armv8(const uint8_t* buffer, const uint32_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t remaining = length;
+
+    while (remaining >= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, buffer, sizeof(word));
+        crc = __crc32cd(crc, word);
+        buffer += sizeof(word);
+        remaining -= sizeof(word);
+    }
+
+    while (remaining--)
+        crc = __crc32cb(crc, *buffer++);
+
+    return ~crc;
+}
+#endif
+
+uint32_t checksum_none(const uint8_t* buffer, const uint32_t length)
+{
+    (void)buffer; (void)length;
+    return 0;
+}
+
+// indexed by ChecksumType, the handshake lists them in this order of preference
+static ChecksumAlgorithm checksum_algorithms[CK_Count] = {
+    { 0x0B6CEF4E, "adler32", "scalar", checksum_adler32_scalar },
+    { 0xAE782D85, "crc32c", "table", checksum_crc32c_table },
+    { 0xADA7AFDB, "none", "none", checksum_none }
+};
+
+// picks the fastest implementation of every algorithm for this cpu
+void checksum_initialize()
+{
+    checksum_crc32c_build_table();
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        checksum_algorithms[CK_Adler32].compute = checksum_adler32_ssse3;
+        checksum_algorithms[CK_Adler32].implementation = "ssse3";
+    }
+#endif
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        checksum_algorithms[CK_CRC32C].compute = checksum_crc32c_sse42;
+        checksum_algorithms[CK_CRC32C].implementation = "sse4.2";
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        checksum_algorithms[CK_CRC32C].compute = checksum_crc32c_armv8;
+        checksum_algorithms[CK_CRC32C].implementation = "armv8";
+    }
+#endif
+}
+
+const ChecksumAlgorithm* checksum_get(const ChecksumType type)
+{
+    return &checksum_algorithms[type < CK_Count ? type : CK_Adler32];
+}
+
+uint32_t checksum_compute(const ChecksumType type, const uint8_t* buffer, const uint32_t length)
+{
+    return checksum_get(type)->compute(buffer, length);
+}
+
+bool checksum_from_id(const uint32_t id, ChecksumType* type)
+{
+    for (uint32_t i = 0; i < CK_Count; i++)
+    {
+        if (checksum_algorithms[i].id == id)
+        {
+            *type = (ChecksumType)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool checksum_from_name(const char* name, ChecksumType* type)
+{
+    for (uint32_t i = 0; i < CK_Count; i++)
+    {
+        if (strcmp(checksum_algorithms[i].name, name) == 0)
+        {
+            *type = (ChecksumType)i;
+            return true;
+        }
+    }
+    return false;
+}
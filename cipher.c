@@ -0,0 +1,845 @@
+#include "common.h"
+
+#include <sys/random.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// authenticated encryption of the messages exchanged between peers (ChaCha20-Poly1305, RFC 8439)
+// the keystream is generated several blocks at a time with the widest vectors of this cpu,
+// picked once at startup, and xored in place so the messages never leave their buffers
+
+typedef enum {
+    CI_None = 0, // no key configured
+    CI_ChaCha20Poly1305,
+    CI_Count
+} CipherType;
+
+// xors the keystream starting at block 'counter' into the buffer
+typedef void (*ChaChaFunction)(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter, uint8_t* buffer, uint32_t length);
+
+typedef struct {
+    uint32_t id; // FNV-1a of the name, sent in the handshake
+    const char* name;
+    const char* implementation;
+} CipherAlgorithm;
+
+#define CIPHER_KEY_SIZE 32
+#define CIPHER_NONCE_SIZE 12
+#define CIPHER_TAG_SIZE 16
+#define CIPHER_SALT_SIZE 16 // random input of each side to the session key
+#define CHACHA20_BLOCK_SIZE 64
+
+static const uint32_t chacha20_constants[4] = { 0x61707865, 0x3320646E, 0x79622D32, 0x6B206574 };
+
+uint32_t cipher_load32(const uint8_t* pointer)
+{
+    return (uint32_t)pointer[0] | ((uint32_t)pointer[1] << 8) | ((uint32_t)pointer[2] << 16) | ((uint32_t)pointer[3] << 24);
+}
+
+void cipher_store32(uint8_t* pointer, const uint32_t value)
+{
+    pointer[0] = (uint8_t)value;
+    pointer[1] = (uint8_t)(value >> 8);
+    pointer[2] = (uint8_t)(value >> 16);
+    pointer[3] = (uint8_t)(value >> 24);
+}
+
+#define CHACHA20_ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA20_QUARTER_ROUND(a, b, c, d) \
+    a += b; d ^= a; d = CHACHA20_ROTATE(d, 16); \
+    c += d; b ^= c; b = CHACHA20_ROTATE(b, 12); \
+    a += b; d ^= a; d = CHACHA20_ROTATE(d, 8); \
+    c += d; b ^= c; b = CHACHA20_ROTATE(b, 7);
+
+void chacha20_rounds(uint32_t x[16])
+{
+    for (uint32_t i = 0; i < 10; i++)
+    {
+        CHACHA20_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        CHACHA20_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        CHACHA20_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        CHACHA20_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        CHACHA20_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        CHACHA20_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        CHACHA20_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        CHACHA20_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+}
+
+void chacha20_xor_scalar(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter, uint8_t* buffer, uint32_t length)
+{
+    uint32_t state[16];
+    memcpy(state, chacha20_constants, sizeof(chacha20_constants));
+    memcpy(state + 4, key, 8 * sizeof(uint32_t));
+    memcpy(state + 13, nonce, 3 * sizeof(uint32_t));
+
+    while (length > 0)
+    {
+        state[12] = counter++;
+
+        uint32_t x[16];
+        memcpy(x, state, sizeof(x));
+        chacha20_rounds(x);
+
+        // a word at a time unless it is the last partial block
+        if (length >= CHACHA20_BLOCK_SIZE)
+        {
+            for (uint32_t i = 0; i < 16; i++)
+                cipher_store32(buffer + i * 4, cipher_load32(buffer + i * 4) ^ (x[i] + state[i]));
+
+            buffer += CHACHA20_BLOCK_SIZE;
+            length -= CHACHA20_BLOCK_SIZE;
+            continue;
+        }
+
+        uint8_t block[CHACHA20_BLOCK_SIZE];
+        for (uint32_t i = 0; i < 16; i++)
+            cipher_store32(block + i * 4, x[i] + state[i]);
+        for (uint32_t i = 0; i < length; i++)
+            buffer[i] ^= block[i];
+        length = 0;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 4 blocks per iteration, every vector holds the same state word of the 4 blocks
+#define CHACHA20_SSE2_ROTATE(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA20_SSE2_QUARTER_ROUND(a, b, c, d) \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA20_SSE2_ROTATE(d, 16); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA20_SSE2_ROTATE(b, 12); \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA20_SSE2_ROTATE(d, 8); \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA20_SSE2_ROTATE(b, 7);
+
+// transposes 4 state words of 4 blocks and xors them into the 16 bytes they cover in every block
+__attribute__((target("sse2")))
+void chacha20_sse2_xor_words(__m128i a, __m128i b, __m128i c, __m128i d, uint8_t* buffer)
+{
+    const __m128i t0 = _mm_unpacklo_epi32(a, b);
+    const __m128i t1 = _mm_unpacklo_epi32(c, d);
+    const __m128i t2 = _mm_unpackhi_epi32(a, b);
+    const __m128i t3 = _mm_unpackhi_epi32(c, d);
+
+    const __m128i blocks[4] = {
+        _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+        _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)
+    };
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        __m128i* pointer = (__m128i*)(buffer + i * CHACHA20_BLOCK_SIZE);
+        _mm_storeu_si128(pointer, _mm_xor_si128(_mm_loadu_si128(pointer), blocks[i]));
+    }
+}
+
+__attribute__((target("sse2")))
+void chacha20_xor_sse2(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter, uint8_t* buffer, uint32_t length)
+{
+    const uint32_t stride = 4 * CHACHA20_BLOCK_SIZE;
+    while (length >= stride)
+    {
+        __m128i state[16];
+        for (uint32_t i = 0; i < 4; i++)
+            state[i] = _mm_set1_epi32(chacha20_constants[i]);
+        for (uint32_t i = 0; i < 8; i++)
+            state[4 + i] = _mm_set1_epi32(key[i]);
+        state[12] = _mm_add_epi32(_mm_set1_epi32(counter), _mm_setr_epi32(0, 1, 2, 3));
+        for (uint32_t i = 0; i < 3; i++)
+            state[13 + i] = _mm_set1_epi32(nonce[i]);
+
+        __m128i x[16];
+        memcpy(x, state, sizeof(x));
+        for (uint32_t i = 0; i < 10; i++)
+        {
+            CHACHA20_SSE2_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+            CHACHA20_SSE2_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+            CHACHA20_SSE2_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+            CHACHA20_SSE2_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+            CHACHA20_SSE2_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+            CHACHA20_SSE2_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+            CHACHA20_SSE2_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+            CHACHA20_SSE2_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+        }
+
+        for (uint32_t i = 0; i < 16; i++)
+            x[i] = _mm_add_epi32(x[i], state[i]);
+
+        for (uint32_t i = 0; i < 4; i++)
+            chacha20_sse2_xor_words(x[i * 4], x[i * 4 + 1], x[i * 4 + 2], x[i * 4 + 3], buffer + i * 16);
+
+        counter += 4;
+        buffer += stride;
+        length -= stride;
+    }
+
+    // the rest goes through a whole batch too unless a narrower one is enough
+    if (length <= CHACHA20_BLOCK_SIZE)
+    {
+        chacha20_xor_scalar(key, nonce, counter, buffer, length);
+    }
+    else
+    {
+        uint8_t tail[4 * CHACHA20_BLOCK_SIZE];
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, buffer, length);
+        chacha20_xor_sse2(key, nonce, counter, tail, sizeof(tail));
+        memcpy(buffer, tail, length);
+        memset(tail, 0, sizeof(tail));
+    }
+}
+
+// 8 blocks per iteration, the low lanes hold the first 4 blocks and the high lanes the other 4
+#define CHACHA20_AVX2_ROTATE(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define CHACHA20_AVX2_QUARTER_ROUND(a, b, c, d) \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rotate16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA20_AVX2_ROTATE(b, 12); \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rotate8); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA20_AVX2_ROTATE(b, 7);
+
+// transposes 4 state words of 8 blocks, each output holds them for block i (low) and i + 4 (high)
+__attribute__((target("avx2")))
+void chacha20_avx2_transpose(__m256i* a, __m256i* b, __m256i* c, __m256i* d)
+{
+    const __m256i t0 = _mm256_unpacklo_epi32(*a, *b);
+    const __m256i t1 = _mm256_unpacklo_epi32(*c, *d);
+    const __m256i t2 = _mm256_unpackhi_epi32(*a, *b);
+    const __m256i t3 = _mm256_unpackhi_epi32(*c, *d);
+    *a = _mm256_unpacklo_epi64(t0, t1);
+    *b = _mm256_unpackhi_epi64(t0, t1);
+    *c = _mm256_unpacklo_epi64(t2, t3);
+    *d = _mm256_unpackhi_epi64(t2, t3);
+}
+
+__attribute__((target("avx2")))
+void chacha20_avx2_xor(uint8_t* buffer, const __m256i keystream)
+{
+    __m256i* pointer = (__m256i*)buffer;
+    _mm256_storeu_si256(pointer, _mm256_xor_si256(_mm256_loadu_si256(pointer), keystream));
+}
+
+__attribute__((target("avx2")))
+void chacha20_xor_avx2(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter, uint8_t* buffer, uint32_t length)
+{
+    // rotations by whole bytes are a single shuffle
+    const __m256i rotate16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rotate8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+    const uint32_t stride = 8 * CHACHA20_BLOCK_SIZE;
+    while (length >= stride)
+    {
+        __m256i state[16];
+        for (uint32_t i = 0; i < 4; i++)
+            state[i] = _mm256_set1_epi32(chacha20_constants[i]);
+        for (uint32_t i = 0; i < 8; i++)
+            state[4 + i] = _mm256_set1_epi32(key[i]);
+        state[12] = _mm256_add_epi32(_mm256_set1_epi32(counter), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        for (uint32_t i = 0; i < 3; i++)
+            state[13 + i] = _mm256_set1_epi32(nonce[i]);
+
+        __m256i x[16];
+        memcpy(x, state, sizeof(x));
+        for (uint32_t i = 0; i < 10; i++)
+        {
+            CHACHA20_AVX2_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+            CHACHA20_AVX2_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+            CHACHA20_AVX2_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+            CHACHA20_AVX2_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+            CHACHA20_AVX2_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+            CHACHA20_AVX2_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+            CHACHA20_AVX2_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+            CHACHA20_AVX2_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+        }
+
+        for (uint32_t i = 0; i < 16; i++)
+            x[i] = _mm256_add_epi32(x[i], state[i]);
+
+        for (uint32_t i = 0; i < 4; i++)
+            chacha20_avx2_transpose(&x[i * 4], &x[i * 4 + 1], &x[i * 4 + 2], &x[i * 4 + 3]);
+
+        // pair the 16 byte rows to write 32 bytes of a block at once
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            uint8_t* low = buffer + i * CHACHA20_BLOCK_SIZE;
+            uint8_t* high = buffer + (i + 4) * CHACHA20_BLOCK_SIZE;
+            chacha20_avx2_xor(low, _mm256_permute2x128_si256(x[i], x[4 + i], 0x20));
+            chacha20_avx2_xor(low + 32, _mm256_permute2x128_si256(x[8 + i], x[12 + i], 0x20));
+            chacha20_avx2_xor(high, _mm256_permute2x128_si256(x[i], x[4 + i], 0x31));
+            chacha20_avx2_xor(high + 32, _mm256_permute2x128_si256(x[8 + i], x[12 + i], 0x31));
+        }
+
+        counter += 8;
+        buffer += stride;
+        length -= stride;
+    }
+
+    // the rest goes through a whole batch too unless a narrower one is enough
+    if (length <= 4 * CHACHA20_BLOCK_SIZE)
+    {
+        chacha20_xor_sse2(key, nonce, counter, buffer, length);
+    }
+    else
+    {
+        uint8_t tail[8 * CHACHA20_BLOCK_SIZE];
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, buffer, length);
+        chacha20_xor_avx2(key, nonce, counter, tail, sizeof(tail));
+        memcpy(buffer, tail, length);
+        memset(tail, 0, sizeof(tail));
+    }
+}
+#elif defined(__aarch64__)
+// 4 blocks per iteration, every vector holds the same state word of the 4 blocks
+#define CHACHA20_NEON_ROTATE(v, n) vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - (n))
+#define CHACHA20_NEON_QUARTER_ROUND(a, b, c, d) \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(d))); \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = CHACHA20_NEON_ROTATE(b, 12); \
+    a = vaddq_u32(a, b); d = veorq_u32(d, a); d = CHACHA20_NEON_ROTATE(d, 8); \
+    c = vaddq_u32(c, d); b = veorq_u32(b, c); b = CHACHA20_NEON_ROTATE(b, 7);
+
+// transposes 4 state words of 4 blocks and xors them into the 16 bytes they cover in every block
+void chacha20_neon_xor_words(uint32x4_t a, uint32x4_t b, uint32x4_t c, uint32x4_t d, uint8_t* buffer)
+{
+    const uint32x4x2_t ab = vtrnq_u32(a, b);
+    const uint32x4x2_t cd = vtrnq_u32(c, d);
+
+    const uint32x4_t blocks[4] = {
+        vcombine_u32(vget_low_u32(ab.val[0]), vget_low_u32(cd.val[0])),
+        vcombine_u32(vget_low_u32(ab.val[1]), vget_low_u32(cd.val[1])),
+        vcombine_u32(vget_high_u32(ab.val[0]), vget_high_u32(cd.val[0])),
+        vcombine_u32(vget_high_u32(ab.val[1]), vget_high_u32(cd.val[1]))
+    };
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        uint8_t* pointer = buffer + i * CHACHA20_BLOCK_SIZE;
+        vst1q_u8(pointer, veorq_u8(vld1q_u8(pointer), vreinterpretq_u8_u32(blocks[i])));
+    }
+}
+
+void chacha20_xor_neon(const uint32_t key[8], const uint32_t nonce[3], uint32_t counter, uint8_t* buffer, uint32_t length)
+{
+    const uint32_t stride = 4 * CHACHA20_BLOCK_SIZE;
+    const uint32_t increments[4] = { 0, 1, 2, 3 };
+    while (length >= stride)
+    {
+        uint32x4_t state[16];
+        for (uint32_t i = 0; i < 4; i++)
+            state[i] = vdupq_n_u32(chacha20_constants[i]);
+        for (uint32_t i = 0; i < 8; i++)
+            state[4 + i] = vdupq_n_u32(key[i]);
+        state[12] = vaddq_u32(vdupq_n_u32(counter), vld1q_u32(increments));
+        for (uint32_t i = 0; i < 3; i++)
+            state[13 + i] = vdupq_n_u32(nonce[i]);
+
+        uint32x4_t x[16];
+        memcpy(x, state, sizeof(x));
+        for (uint32_t i = 0; i < 10; i++)
+        {
+            CHACHA20_NEON_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+            CHACHA20_NEON_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+            CHACHA20_NEON_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+            CHACHA20_NEON_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+            CHACHA20_NEON_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+            CHACHA20_NEON_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+            CHACHA20_NEON_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+            CHACHA20_NEON_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+        }
+
+        for (uint32_t i = 0; i < 16; i++)
+            x[i] = vaddq_u32(x[i], state[i]);
+
+        for (uint32_t i = 0; i < 4; i++)
+            chacha20_neon_xor_words(x[i * 4], x[i * 4 + 1], x[i * 4 + 2], x[i * 4 + 3], buffer + i * 16);
+
+        counter += 4;
+        buffer += stride;
+        length -= stride;
+    }
+
+    // the rest goes through a whole batch too unless a narrower one is enough
+    if (length <= CHACHA20_BLOCK_SIZE)
+    {
+        chacha20_xor_scalar(key, nonce, counter, buffer, length);
+    }
+    else
+    {
+        uint8_t tail[4 * CHACHA20_BLOCK_SIZE];
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, buffer, length);
+        chacha20_xor_neon(key, nonce, counter, tail, sizeof(tail));
+        memcpy(buffer, tail, length);
+        memset(tail, 0, sizeof(tail));
+    }
+}
+#endif
+
+// HChaCha20: the rounds without the final addition, used to derive keys
+void chacha20_derive(const uint8_t key[CIPHER_KEY_SIZE], const uint8_t input[16], uint8_t output[CIPHER_KEY_SIZE])
+{
+    uint32_t x[16];
+    memcpy(x, chacha20_constants, sizeof(chacha20_constants));
+    for (uint32_t i = 0; i < 8; i++)
+        x[4 + i] = cipher_load32(key + i * 4);
+    for (uint32_t i = 0; i < 4; i++)
+        x[12 + i] = cipher_load32(input + i * 4);
+
+    chacha20_rounds(x);
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        cipher_store32(output + i * 4, x[i]);
+        cipher_store32(output + 16 + i * 4, x[12 + i]);
+    }
+    memset(x, 0, sizeof(x));
+}
+
+#if defined(__SIZEOF_INT128__)
+// 44 bit limbs, three products per limb instead of five but they need 128 bits
+__extension__ typedef unsigned __int128 poly1305_wide;
+
+typedef struct {
+    uint64_t r[3];
+    uint64_t h[3];
+    uint64_t pad[2];
+} Poly1305;
+
+uint64_t cipher_load64(const uint8_t* pointer)
+{
+    return (uint64_t)cipher_load32(pointer) | ((uint64_t)cipher_load32(pointer + 4) << 32);
+}
+
+void poly1305_init(Poly1305* state, const uint8_t key[32])
+{
+    // clamped as the algorithm requires
+    const uint64_t t0 = cipher_load64(key);
+    const uint64_t t1 = cipher_load64(key + 8);
+    state->r[0] = t0 & 0xFFC0FFFFFFF;
+    state->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xFFFFFC0FFFF;
+    state->r[2] = (t1 >> 24) & 0x00FFFFFFC0F;
+    memset(state->h, 0, sizeof(state->h));
+    state->pad[0] = cipher_load64(key + 16);
+    state->pad[1] = cipher_load64(key + 24);
+}
+
+// full 16 byte blocks only, the AEAD pads everything it authenticates with zeros
+void poly1305_blocks(Poly1305* state, const uint8_t* buffer, uint32_t length)
+{
+    const uint64_t r0 = state->r[0], r1 = state->r[1], r2 = state->r[2];
+    const uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = state->h[0], h1 = state->h[1], h2 = state->h[2];
+
+    while (length >= 16)
+    {
+        const uint64_t t0 = cipher_load64(buffer);
+        const uint64_t t1 = cipher_load64(buffer + 8);
+        h0 += t0 & 0xFFFFFFFFFFF;
+        h1 += ((t0 >> 44) | (t1 << 20)) & 0xFFFFFFFFFFF;
+        h2 += ((t1 >> 24) & 0x3FFFFFFFFFF) | ((uint64_t)1 << 40);
+
+        const poly1305_wide d0 = (poly1305_wide)h0 * r0 + (poly1305_wide)h1 * s2 + (poly1305_wide)h2 * s1;
+        poly1305_wide d1 = (poly1305_wide)h0 * r1 + (poly1305_wide)h1 * r0 + (poly1305_wide)h2 * s2;
+        poly1305_wide d2 = (poly1305_wide)h0 * r2 + (poly1305_wide)h1 * r1 + (poly1305_wide)h2 * r0;
+
+        // partial carry, the limbs stay small enough for the next block
+        h0 = (uint64_t)d0 & 0xFFFFFFFFFFF;
+        d1 += (uint64_t)(d0 >> 44);
+        h1 = (uint64_t)d1 & 0xFFFFFFFFFFF;
+        d2 += (uint64_t)(d1 >> 44);
+        h2 = (uint64_t)d2 & 0x3FFFFFFFFFF;
+        h0 += (uint64_t)(d2 >> 42) * 5;
+        h1 += h0 >> 44;
+        h0 &= 0xFFFFFFFFFFF;
+
+        buffer += 16;
+        length -= 16;
+    }
+
+    state->h[0] = h0; state->h[1] = h1; state->h[2] = h2;
+}
+
+void poly1305_finish(Poly1305* state, uint8_t tag[CIPHER_TAG_SIZE])
+{
+    uint64_t h0 = state->h[0], h1 = state->h[1], h2 = state->h[2];
+
+    // full carry
+    h2 += h1 >> 44; h1 &= 0xFFFFFFFFFFF;
+    h0 += (h2 >> 42) * 5; h2 &= 0x3FFFFFFFFFF;
+    h1 += h0 >> 44; h0 &= 0xFFFFFFFFFFF;
+    h2 += h1 >> 44; h1 &= 0xFFFFFFFFFFF;
+    h0 += (h2 >> 42) * 5; h2 &= 0x3FFFFFFFFFF;
+    h1 += h0 >> 44; h0 &= 0xFFFFFFFFFFF;
+
+    // h - p, picked without branches if h was not smaller than p
+    uint64_t g0 = h0 + 5;
+    uint64_t g1 = h1 + (g0 >> 44); g0 &= 0xFFFFFFFFFFF;
+    uint64_t g2 = h2 + (g1 >> 44) - ((uint64_t)1 << 42); g1 &= 0xFFFFFFFFFFF;
+
+    const uint64_t mask = (g2 >> 63) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    // add the pad
+    const uint64_t t0 = state->pad[0];
+    const uint64_t t1 = state->pad[1];
+    h0 += t0 & 0xFFFFFFFFFFF;
+    h1 += (((t0 >> 44) | (t1 << 20)) & 0xFFFFFFFFFFF) + (h0 >> 44); h0 &= 0xFFFFFFFFFFF;
+    h2 += ((t1 >> 24) & 0x3FFFFFFFFFF) + (h1 >> 44); h1 &= 0xFFFFFFFFFFF;
+    h2 &= 0x3FFFFFFFFFF;
+
+    // back to 64 bit words
+    const uint64_t low = h0 | (h1 << 44);
+    const uint64_t high = (h1 >> 20) | (h2 << 24);
+    cipher_store32(tag, (uint32_t)low);
+    cipher_store32(tag + 4, (uint32_t)(low >> 32));
+    cipher_store32(tag + 8, (uint32_t)high);
+    cipher_store32(tag + 12, (uint32_t)(high >> 32));
+
+    memset(state, 0, sizeof(Poly1305));
+}
+#else
+// 26 bit limbs so the products fit in 64 bits
+typedef struct {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+} Poly1305;
+
+void poly1305_init(Poly1305* state, const uint8_t key[32])
+{
+    // clamped as the algorithm requires
+    state->r[0] = (cipher_load32(key + 0)) & 0x3FFFFFF;
+    state->r[1] = (cipher_load32(key + 3) >> 2) & 0x3FFFF03;
+    state->r[2] = (cipher_load32(key + 6) >> 4) & 0x3FFC0FF;
+    state->r[3] = (cipher_load32(key + 9) >> 6) & 0x3F03FFF;
+    state->r[4] = (cipher_load32(key + 12) >> 8) & 0x00FFFFF;
+    memset(state->h, 0, sizeof(state->h));
+    for (uint32_t i = 0; i < 4; i++)
+        state->pad[i] = cipher_load32(key + 16 + i * 4);
+}
+
+// full 16 byte blocks only, the AEAD pads everything it authenticates with zeros
+void poly1305_blocks(Poly1305* state, const uint8_t* buffer, uint32_t length)
+{
+    const uint32_t r0 = state->r[0], r1 = state->r[1], r2 = state->r[2], r3 = state->r[3], r4 = state->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = state->h[0], h1 = state->h[1], h2 = state->h[2], h3 = state->h[3], h4 = state->h[4];
+
+    while (length >= 16)
+    {
+        h0 += (cipher_load32(buffer + 0)) & 0x3FFFFFF;
+        h1 += (cipher_load32(buffer + 3) >> 2) & 0x3FFFFFF;
+        h2 += (cipher_load32(buffer + 6) >> 4) & 0x3FFFFFF;
+        h3 += (cipher_load32(buffer + 9) >> 6) & 0x3FFFFFF;
+        h4 += (cipher_load32(buffer + 12) >> 8) | (1 << 24);
+
+        const uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        // partial carry, the limbs stay small enough for the next block
+        h0 = (uint32_t)d0 & 0x3FFFFFF;
+        d1 += d0 >> 26;
+        h1 = (uint32_t)d1 & 0x3FFFFFF;
+        d2 += d1 >> 26;
+        h2 = (uint32_t)d2 & 0x3FFFFFF;
+        d3 += d2 >> 26;
+        h3 = (uint32_t)d3 & 0x3FFFFFF;
+        d4 += d3 >> 26;
+        h4 = (uint32_t)d4 & 0x3FFFFFF;
+        h0 += (uint32_t)(d4 >> 26) * 5;
+        h1 += h0 >> 26;
+        h0 &= 0x3FFFFFF;
+
+        buffer += 16;
+        length -= 16;
+    }
+
+    state->h[0] = h0; state->h[1] = h1; state->h[2] = h2; state->h[3] = h3; state->h[4] = h4;
+}
+
+void poly1305_finish(Poly1305* state, uint8_t tag[CIPHER_TAG_SIZE])
+{
+    uint32_t h0 = state->h[0], h1 = state->h[1], h2 = state->h[2], h3 = state->h[3], h4 = state->h[4];
+
+    // full carry
+    h2 += h1 >> 26; h1 &= 0x3FFFFFF;
+    h3 += h2 >> 26; h2 &= 0x3FFFFFF;
+    h4 += h3 >> 26; h3 &= 0x3FFFFFF;
+    h0 += (h4 >> 26) * 5; h4 &= 0x3FFFFFF;
+    h1 += h0 >> 26; h0 &= 0x3FFFFFF;
+
+    // h - p, picked without branches if h was not smaller than p
+    uint32_t g0 = h0 + 5;
+    uint32_t g1 = h1 + (g0 >> 26); g0 &= 0x3FFFFFF;
+    uint32_t g2 = h2 + (g1 >> 26); g1 &= 0x3FFFFFF;
+    uint32_t g3 = h3 + (g2 >> 26); g2 &= 0x3FFFFFF;
+    uint32_t g4 = h4 + (g3 >> 26) - (1 << 26); g3 &= 0x3FFFFFF;
+
+    const uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    // back to 32 bit words and add the pad
+    const uint32_t words[4] = {
+        h0 | (h1 << 26), (h1 >> 6) | (h2 << 20), (h2 >> 12) | (h3 << 14), (h3 >> 18) | (h4 << 8)
+    };
+    uint64_t carry = 0;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        carry += (uint64_t)words[i] + state->pad[i];
+        cipher_store32(tag + i * 4, (uint32_t)carry);
+        carry >>= 32;
+    }
+
+    memset(state, 0, sizeof(Poly1305));
+}
+#endif
+
+// zero padded up to the block size
+void poly1305_padded(Poly1305* state, const uint8_t* buffer, const uint32_t length)
+{
+    const uint32_t full = length & ~15u;
+    poly1305_blocks(state, buffer, full);
+    if (full < length)
+    {
+        uint8_t block[16];
+        memset(block, 0, sizeof(block));
+        memcpy(block, buffer + full, length - full);
+        poly1305_blocks(state, block, sizeof(block));
+    }
+}
+
+// indexed by CipherType
+static CipherAlgorithm cipher_algorithms[CI_Count] = {
+    { 0, "none", "none" },
+    { 0x18FC83F7, "chacha20-poly1305", "scalar" }
+};
+
+static ChaChaFunction chacha20_xor = chacha20_xor_scalar;
+
+// picks the widest keystream implementation for this cpu
+void cipher_initialize()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        chacha20_xor = chacha20_xor_avx2;
+        cipher_algorithms[CI_ChaCha20Poly1305].implementation = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        chacha20_xor = chacha20_xor_sse2;
+        cipher_algorithms[CI_ChaCha20Poly1305].implementation = "sse2";
+    }
+#elif defined(__aarch64__)
+    // always there on 64 bit arm
+    chacha20_xor = chacha20_xor_neon;
+    cipher_algorithms[CI_ChaCha20Poly1305].implementation = "neon";
+#endif
+}
+
+const CipherAlgorithm* cipher_get(const CipherType type)
+{
+    return &cipher_algorithms[type < CI_Count ? type : CI_None];
+}
+
+bool cipher_from_id(const uint32_t id, CipherType* type)
+{
+    for (uint32_t i = CI_None + 1; i < CI_Count; i++)
+    {
+        if (cipher_algorithms[i].id == id)
+        {
+            *type = (CipherType)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// the one-time Poly1305 key comes from block 0, the message is xored from block 1
+void cipher_authenticate(const uint32_t key[8], const uint32_t nonce[3], const uint8_t* header, const uint32_t header_length,
+    const uint8_t* buffer, const uint32_t length, uint8_t tag[CIPHER_TAG_SIZE])
+{
+    uint8_t one_time_key[CHACHA20_BLOCK_SIZE];
+    memset(one_time_key, 0, sizeof(one_time_key));
+    chacha20_xor_scalar(key, nonce, 0, one_time_key, sizeof(one_time_key));
+
+    Poly1305 state;
+    poly1305_init(&state, one_time_key);
+    poly1305_padded(&state, header, header_length);
+    poly1305_padded(&state, buffer, length);
+
+    uint8_t lengths[16];
+    cipher_store32(lengths, header_length);
+    cipher_store32(lengths + 4, 0);
+    cipher_store32(lengths + 8, length);
+    cipher_store32(lengths + 12, 0);
+    poly1305_blocks(&state, lengths, sizeof(lengths));
+    poly1305_finish(&state, tag);
+
+    memset(one_time_key, 0, sizeof(one_time_key));
+}
+
+void cipher_load_key(const uint8_t key[CIPHER_KEY_SIZE], const uint8_t nonce[CIPHER_NONCE_SIZE], uint32_t key_words[8], uint32_t nonce_words[3])
+{
+    for (uint32_t i = 0; i < 8; i++)
+        key_words[i] = cipher_load32(key + i * 4);
+    for (uint32_t i = 0; i < 3; i++)
+        nonce_words[i] = cipher_load32(nonce + i * 4);
+}
+
+// encrypts the buffer in place, the header is only authenticated
+void cipher_seal(const uint8_t key[CIPHER_KEY_SIZE], const uint8_t nonce[CIPHER_NONCE_SIZE], const uint8_t* header, const uint32_t header_length,
+    uint8_t* buffer, const uint32_t length, uint8_t tag[CIPHER_TAG_SIZE])
+{
+    uint32_t key_words[8];
+    uint32_t nonce_words[3];
+    cipher_load_key(key, nonce, key_words, nonce_words);
+
+    chacha20_xor(key_words, nonce_words, 1, buffer, length);
+    cipher_authenticate(key_words, nonce_words, header, header_length, buffer, length, tag);
+
+    memset(key_words, 0, sizeof(key_words));
+}
+
+// checks the tag before decrypting the buffer in place, false if it doesn't match
+bool cipher_open(const uint8_t key[CIPHER_KEY_SIZE], const uint8_t nonce[CIPHER_NONCE_SIZE], const uint8_t* header, const uint32_t header_length,
+    uint8_t* buffer, const uint32_t length, const uint8_t tag[CIPHER_TAG_SIZE])
+{
+    uint32_t key_words[8];
+    uint32_t nonce_words[3];
+    cipher_load_key(key, nonce, key_words, nonce_words);
+
+    uint8_t computed[CIPHER_TAG_SIZE];
+    cipher_authenticate(key_words, nonce_words, header, header_length, buffer, length, computed);
+
+    // constant time comparison
+    uint8_t difference = 0;
+    for (uint32_t i = 0; i < CIPHER_TAG_SIZE; i++)
+        difference |= computed[i] ^ tag[i];
+
+    if (difference == 0)
+        chacha20_xor(key_words, nonce_words, 1, buffer, length);
+
+    memset(key_words, 0, sizeof(key_words));
+    return difference == 0;
+}
+
+// session keys mix the pre-shared key with the salts of both sides, so every session gets its own
+void cipher_derive_key(const uint8_t shared[CIPHER_KEY_SIZE], const uint8_t client_salt[CIPHER_SALT_SIZE],
+    const uint8_t server_salt[CIPHER_SALT_SIZE], uint8_t key[CIPHER_KEY_SIZE])
+{
+    uint8_t intermediate[CIPHER_KEY_SIZE];
+    chacha20_derive(shared, client_salt, intermediate);
+    chacha20_derive(intermediate, server_salt, key);
+    memset(intermediate, 0, sizeof(intermediate));
+}
+
+// nonce counters accepted from the other side, a ring of bits behind the newest one (RFC 6479)
+// messages arrive a little out of order, anything older than the window or seen before is a replay
+#define CIPHER_REPLAY_WORDS 32 // power of two
+#define CIPHER_REPLAY_WINDOW ((CIPHER_REPLAY_WORDS - 1) * 64)
+
+typedef struct {
+    uint64_t top; // newest counter accepted plus one, zero before the first
+    uint64_t bits[CIPHER_REPLAY_WORDS];
+    bool lock; // the crypto threads open messages from the same remote at the same time
+} CipherReplay;
+
+void cipher_replay_reset(CipherReplay* replay)
+{
+    memset(replay, 0, sizeof(CipherReplay));
+}
+
+// only for counters of messages whose tag was right, or forged ones would move the window
+bool cipher_replay_accept(CipherReplay* replay, const uint64_t counter)
+{
+    while (__atomic_test_and_set(&replay->lock, __ATOMIC_ACQUIRE))
+        ;
+
+    const uint64_t word = counter / 64;
+    const uint64_t bit = 1ULL << (counter % 64);
+    bool accepted = false;
+    if (counter >= replay->top)
+    {
+        // the words the window slides over are forgotten
+        const uint64_t newest = replay->top > 0 ? (replay->top - 1) / 64 : 0;
+        for (uint64_t i = newest + 1; i <= word && i <= newest + CIPHER_REPLAY_WORDS; i++)
+            replay->bits[i % CIPHER_REPLAY_WORDS] = 0;
+        replay->top = counter + 1;
+        accepted = true;
+    }
+    else if (replay->top - counter <= CIPHER_REPLAY_WINDOW)
+        accepted = (replay->bits[word % CIPHER_REPLAY_WORDS] & bit) == 0;
+
+    if (accepted)
+        replay->bits[word % CIPHER_REPLAY_WORDS] |= bit;
+
+    __atomic_clear(&replay->lock, __ATOMIC_RELEASE);
+    return accepted;
+}
+
+bool cipher_random(uint8_t* buffer, uint32_t length)
+{
+    while (length > 0)
+    {
+        ssize_t result = getrandom(buffer, length, 0);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            print_errno(__func__, "error getting random bytes", errno);
+            return false;
+        }
+        buffer += result;
+        length -= result;
+    }
+    return true;
+}
+
+// the key file holds the pre-shared key as 64 hexadecimal characters (openssl rand -hex 32)
+bool cipher_read_key(const char* path, uint8_t key[CIPHER_KEY_SIZE])
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        print_errno(__func__, "error opening the key file", errno);
+        return false;
+    }
+
+    char text[CIPHER_KEY_SIZE * 2 + 1];
+    const size_t read = fread(text, 1, sizeof(text) - 1, file);
+    fclose(file);
+    text[read] = '\0';
+
+    bool ok = (read == CIPHER_KEY_SIZE * 2);
+    for (uint32_t i = 0; ok && i < CIPHER_KEY_SIZE * 2; i++)
+    {
+        const char c = text[i];
+        const uint8_t nibble = (c >= '0' && c <= '9') ? c - '0'
+            : (c >= 'a' && c <= 'f') ? c - 'a' + 10
+            : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : 0xFF;
+        ok = (nibble != 0xFF);
+        key[i / 2] = (i % 2) ? (key[i / 2] | nibble) : (uint8_t)(nibble << 4);
+    }
+    memset(text, 0, sizeof(text));
+
+    if (!ok)
+    {
+        printf("%s: the key file has to contain %u hexadecimal characters\n", __func__, CIPHER_KEY_SIZE * 2);
+        memset(key, 0, CIPHER_KEY_SIZE);
+    }
+    return ok;
+}
\ No newline at end of file
@@ -0,0 +1,320 @@
+#include "common.h"
+
+// flow queuing with CoDel (fq_codel) for the messages waiting to be sent
+// packets are spread over flows by the hash of their inner addresses and ports, each flow is a fifo
+// the flows take turns in a deficit round robin, the ones that just started go first so sparse
+// (interactive) flows don't wait behind the bulk ones, and every flow drops packets that stayed
+// longer than the target for a whole interval, more often while it keeps happening (CoDel)
+
+#define CODEL_FLOWS 64
+#define CODEL_CONTROL_FLOW 0 // kept for the control messages
+#define CODEL_TARGET (5 * 1000) // acceptable queue delay, microseconds
+#define CODEL_INTERVAL (100 * 1000) // how long the delay can stay above the target, microseconds
+
+typedef enum {
+    CL_None = 0,
+    CL_New,
+    CL_Old
+} CodelList;
+
+struct codel_flow_t;
+typedef struct codel_flow_t CodelFlow;
+
+struct codel_flow_t {
+    Packet* head;
+    Packet* tail;
+    CodelFlow* next; // in the new or old list
+    int32_t deficit; // bytes it can still send in its turn
+    uint16_t count;
+    uint8_t list; // CodelList
+    bool dropping;
+    uint32_t drop_count; // drops since it started dropping
+    uint32_t last_count; // drop_count when it stopped last time
+    uint64_t first_above; // when the delay went above the target plus an interval, 0 if below
+    uint64_t drop_next;
+};
+
+typedef struct {
+    CodelFlow* head;
+    CodelFlow* tail;
+} CodelFlowList;
+
+typedef struct {
+    CodelFlow flows[CODEL_FLOWS];
+    CodelFlowList new_flows;
+    CodelFlowList old_flows;
+    uint32_t count; // packets in every flow
+    uint32_t quantum; // bytes per turn
+} FlowQueue;
+
+void flowqueue_init(FlowQueue* queue, const uint32_t quantum)
+{
+    memset(queue, 0, sizeof(FlowQueue));
+    queue->quantum = quantum;
+}
+
+void codel_list_push(CodelFlowList* list, CodelFlow* flow)
+{
+    flow->next = NULL;
+    if (list->tail)
+        list->tail->next = flow;
+    else
+        list->head = flow;
+    list->tail = flow;
+}
+
+// only the first flow of a list is ever taken out
+CodelFlow* codel_list_pop(CodelFlowList* list)
+{
+    CodelFlow* flow = list->head;
+    if (!flow)
+        return NULL;
+
+    list->head = flow->next;
+    if (!list->head)
+        list->tail = NULL;
+    flow->next = NULL;
+    return flow;
+}
+
+Packet* codel_flow_take(FlowQueue* queue, CodelFlow* flow)
+{
+    Packet* packet = flow->head;
+    if (!packet)
+        return NULL;
+
+    flow->head = packet->next;
+    if (!flow->head)
+        flow->tail = NULL;
+    packet->next = NULL;
+    flow->count--;
+    queue->count--;
+    return packet;
+}
+
+// the packets stay in their flow in order, a flow that wasn't waiting joins the new ones
+void flowqueue_push(FlowQueue* queue, Packet* packet, const uint64_t now)
+{
+    assert(packet->flow < CODEL_FLOWS);
+    CodelFlow* flow = &queue->flows[packet->flow];
+
+    packet->queued = now;
+    packet->next = NULL;
+    if (flow->tail)
+        flow->tail->next = packet;
+    else
+        flow->head = packet;
+    flow->tail = packet;
+    flow->count++;
+    queue->count++;
+
+    if (flow->list == CL_None)
+    {
+        flow->list = CL_New;
+        flow->deficit = queue->quantum;
+        codel_list_push(&queue->new_flows, flow);
+    }
+}
+
+// puts back a packet taken with flowqueue_pop() that couldn't be sent, in front of its flow
+// several go back in the reverse order they were taken
+void flowqueue_unpop(FlowQueue* queue, Packet* packet)
+{
+    CodelFlow* flow = &queue->flows[packet->flow];
+
+    packet->next = flow->head;
+    flow->head = packet;
+    if (!flow->tail)
+        flow->tail = packet;
+    flow->count++;
+    queue->count++;
+    flow->deficit += packet->length;
+
+    if (flow->list == CL_None)
+    {
+        flow->list = CL_Old;
+        codel_list_push(&queue->old_flows, flow);
+    }
+}
+
+// interval / sqrt(count), the drops get closer while the delay doesn't go down
+uint64_t codel_control_law(const uint64_t time, const uint32_t count)
+{
+    // square root of count in 8.8 fixed point, bit by bit
+    uint64_t value = (uint64_t)count << 16;
+    uint64_t root = 0;
+    uint64_t bit = 1ULL << 62;
+    while (bit > value)
+        bit >>= 2;
+    while (bit > 0)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else
+            root >>= 1;
+        bit >>= 2;
+    }
+
+    return time + ((uint64_t)CODEL_INTERVAL << 8) / (root > 0 ? root : 1);
+}
+
+// the delay has been above the target for an interval, the last packet of a flow is always kept
+bool codel_should_drop(CodelFlow* flow, const Packet* packet, const uint64_t now)
+{
+    if (now - packet->queued < CODEL_TARGET || flow->count == 0)
+    {
+        flow->first_above = 0;
+        return false;
+    }
+
+    if (flow->first_above == 0)
+    {
+        flow->first_above = now + CODEL_INTERVAL;
+        return false;
+    }
+
+    return now >= flow->first_above;
+}
+
+// takes the next packet of the flow, dropping the ones CoDel decides to
+Packet* codel_flow_dequeue(FlowQueue* queue, CodelFlow* flow, const uint64_t now, PacketPool* pool, uint32_t* drops)
+{
+    Packet* packet = codel_flow_take(queue, flow);
+    if (!packet)
+    {
+        flow->dropping = false;
+        return NULL;
+    }
+
+    bool drop = codel_should_drop(flow, packet, now);
+    if (flow->dropping)
+    {
+        if (!drop)
+            flow->dropping = false;
+
+        // one drop every control law interval while it stays bad
+        while (flow->dropping && now >= flow->drop_next)
+        {
+            packet_release(pool, packet);
+            (*drops)++;
+            flow->drop_count++;
+
+            packet = codel_flow_take(queue, flow);
+            if (!packet || !codel_should_drop(flow, packet, now))
+                flow->dropping = false;
+            else
+                flow->drop_next = codel_control_law(flow->drop_next, flow->drop_count);
+        }
+    }
+    else if (drop)
+    {
+        packet_release(pool, packet);
+        (*drops)++;
+        packet = codel_flow_take(queue, flow);
+
+        // start dropping, faster if it stopped not long ago
+        flow->dropping = true;
+        const uint32_t delta = flow->drop_count - flow->last_count;
+        flow->drop_count = (delta > 1 && (int64_t)(now - flow->drop_next) < 16 * CODEL_INTERVAL) ? delta : 1;
+        flow->drop_next = codel_control_law(now, flow->drop_count);
+        flow->last_count = flow->drop_count;
+    }
+
+    return packet;
+}
+
+// next packet to send, NULL if there are none left
+// flows run out of deficit as they send and go to the back of the old ones with a new quantum
+Packet* flowqueue_pop(FlowQueue* queue, const uint64_t now, PacketPool* pool, uint32_t* drops)
+{
+    while (true)
+    {
+        CodelFlowList* list = queue->new_flows.head ? &queue->new_flows : &queue->old_flows;
+        CodelFlow* flow = list->head;
+        if (!flow)
+            return NULL;
+
+        if (flow->deficit <= 0)
+        {
+            flow->deficit += queue->quantum;
+            codel_list_pop(list);
+            flow->list = CL_Old;
+            codel_list_push(&queue->old_flows, flow);
+            continue;
+        }
+
+        Packet* packet = codel_flow_dequeue(queue, flow, now, pool, drops);
+        if (!packet)
+        {
+            // an emptied new flow goes through the old ones once so it can't starve them
+            codel_list_pop(list);
+            if (list == &queue->new_flows && queue->old_flows.head)
+            {
+                flow->list = CL_Old;
+                codel_list_push(&queue->old_flows, flow);
+            }
+            else
+                flow->list = CL_None;
+            continue;
+        }
+
+        flow->deficit -= packet->length;
+        return packet;
+    }
+}
+
+// makes room when the queue is full, from the head of the flow with most packets
+Packet* flowqueue_drop_fattest(FlowQueue* queue)
+{
+    CodelFlow* fattest = &queue->flows[0];
+    for (uint32_t i = 1; i < CODEL_FLOWS; i++)
+    {
+        if (queue->flows[i].count > fattest->count)
+            fattest = &queue->flows[i];
+    }
+
+    // emptied flows leave their list in the next flowqueue_pop()
+    return codel_flow_take(queue, fattest);
+}
+
+// releases every packet for the remote peer, returns how many
+uint32_t flowqueue_purge(FlowQueue* queue, PacketPool* pool, const struct remote_peer_t* remote)
+{
+    uint32_t purged = 0;
+    for (uint32_t i = 0; i < CODEL_FLOWS; i++)
+    {
+        CodelFlow* flow = &queue->flows[i];
+        Packet** link = &flow->head;
+        flow->tail = NULL;
+        while (*link)
+        {
+            Packet* packet = *link;
+            if (packet->remote == remote)
+            {
+                *link = packet->next;
+                packet_release(pool, packet);
+                flow->count--;
+                queue->count--;
+                purged++;
+                continue;
+            }
+            flow->tail = packet;
+            link = &packet->next;
+        }
+    }
+    return purged;
+}
+
+// releases every packet still waiting
+void flowqueue_clear(FlowQueue* queue, PacketPool* pool)
+{
+    for (uint32_t i = 0; i < CODEL_FLOWS; i++)
+    {
+        Packet* packet = NULL;
+        while ((packet = codel_flow_take(queue, &queue->flows[i])) != NULL)
+            packet_release(pool, packet);
+    }
+}
\ No newline at end of file
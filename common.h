@@ -1,14 +1,21 @@
 #pragma once
 
+// recvmmsg, sendmmsg and other linux extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -52,7 +59,62 @@ uint64_t get_current_timestamp()
    if (clock_gettime(CLOCK_MONOTONIC, &spec) == -1)
       return 0;
 
-   return spec.tv_sec * 1000 + spec.tv_nsec / 1e6;
+   return (uint64_t)spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
+}
+
+// the clock of a thread read once per batch of messages instead of once per message
+// the hot paths take the cached values, milliseconds for the timeouts and microseconds for the RTT
+typedef struct {
+   uint64_t ms;
+   uint64_t us;
+} CachedClock;
+
+void clock_refresh(CachedClock* clock)
+{
+   struct timespec spec;
+   if (clock_gettime(CLOCK_MONOTONIC, &spec) == -1)
+      return; // keeps the last reading
+
+   clock->us = (uint64_t)spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+   clock->ms = clock->us / 1000;
+}
+
+// one's complement sum of big-endian 16 bit words used by the internet checksums (RFC 1071)
+// chain calls with even lengths, only the last chunk can have an odd length
+uint64_t checksum_add(uint64_t sum, const uint8_t* data, uint32_t length)
+{
+   while (length > 1)
+   {
+      sum += (uint32_t)(data[0] << 8 | data[1]);
+      data += 2;
+      length -= 2;
+   }
+
+   // padding
+   if (length > 0)
+      sum += (uint32_t)data[0] << 8;
+
+   return sum;
+}
+
+// folds the carries back into 16 bits, the final checksum is the complement
+uint16_t checksum_fold(uint64_t sum)
+{
+   while (sum >> 16)
+      sum = (sum & 0xffff) + (sum >> 16);
+
+   return (uint16_t)sum;
+}
+
+// updates a checksum field (network order) after replacing old_data with new_data (RFC 1624)
+// HC' = ~(~HC + ~m + m') so the cost only depends on the length of the change
+void checksum_adjust(uint16_t* check, const uint8_t* old_data, const uint8_t* new_data, uint32_t length)
+{
+   // summing the complement of every old word is the same as subtracting them from 0xFFFF each
+   uint64_t sum = (uint16_t)~ntohs(*check);
+   sum += (uint64_t)0xFFFF * ((length + 1) / 2) - checksum_add(0, old_data, length);
+   sum = checksum_add(sum, new_data, length);
+   *check = htons(~checksum_fold(sum));
 }
 
 bool address_is_localhost(const struct sockaddr_storage* address)
@@ -73,6 +135,36 @@ bool address_is_localhost(const struct sockaddr_storage* address)
    return false;
 }
 
+bool address_equal_ipv4(const struct sockaddr_in* lin, const struct sockaddr_in* rin)
+{
+   if (ntohl(lin->sin_addr.s_addr) != ntohl(rin->sin_addr.s_addr))
+   {
+      //printf_debug("%s: different address", __func__);
+      return false;
+   }
+   if (ntohs(lin->sin_port) != ntohs(rin->sin_port))
+   {
+      //printf_debug("%s: different port", __func__);
+      return false;
+   }
+   return true;
+}
+
+bool address_equal_ipv6(const struct sockaddr_in6* lin6, const struct sockaddr_in6* rin6)
+{
+   int r = memcmp(lin6->sin6_addr.s6_addr, rin6->sin6_addr.s6_addr, sizeof(lin6->sin6_addr.s6_addr));
+   if (r != 0)
+      return false;
+
+   if (ntohs(lin6->sin6_port) != ntohs(rin6->sin6_port))
+      return false;
+   if (lin6->sin6_flowinfo != rin6->sin6_flowinfo)
+      return false;
+   if (lin6->sin6_scope_id != rin6->sin6_scope_id)
+      return false;
+   return true;
+}
+
 bool address_equal(struct sockaddr_storage* left, struct sockaddr_storage* right)
 {
    if (left->ss_family != right->ss_family)
@@ -82,37 +174,78 @@ bool address_equal(struct sockaddr_storage* left, struct sockaddr_storage* right
    }
 
    if (left->ss_family == AF_INET)
-   {
-      struct sockaddr_in* lin = (void*)left, *rin = (void*)right;
-      if (ntohl(lin->sin_addr.s_addr) != ntohl(rin->sin_addr.s_addr))
-      {
-         //printf_debug("%s: different address", __func__);
-         return false;
-      }
-      if (ntohs(lin->sin_port) != ntohs(rin->sin_port))
-      {
-         //printf_debug("%s: different port", __func__);
-         return false;
-      }
-   } 
+      return address_equal_ipv4((const void*)left, (const void*)right);
    else if (left->ss_family == AF_INET6)
-   {
-      struct sockaddr_in6 *lin6 = (void*)left, *rin6 = (void*)right;
-      int r = memcmp(lin6->sin6_addr.s6_addr, rin6->sin6_addr.s6_addr, sizeof(lin6->sin6_addr.s6_addr));
-      if (r != 0)
-         return false;
-
-      if (ntohs(lin6->sin6_port) != ntohs(rin6->sin6_port))
-         return false;
-      if (lin6->sin6_flowinfo != rin6->sin6_flowinfo)
-         return false;
-      if (lin6->sin6_scope_id != rin6->sin6_scope_id)
-         return false;
-   }
+      return address_equal_ipv6((const void*)left, (const void*)right);
 
    return true;
 }
 
+// IPv4 or IPv6 socket address in 28 bytes instead of the 128 of sockaddr_storage
+// it is smaller and less aligned than one, so it goes through the compact_address helpers
+// or address_expand() into a sockaddr_storage, never a cast
+typedef union {
+   sa_family_t family;
+   struct sockaddr_in ipv4;
+   struct sockaddr_in6 ipv6;
+} CompactAddress;
+
+void address_compact(CompactAddress* compact, const struct sockaddr_storage* address)
+{
+   memset(compact, 0, sizeof(CompactAddress));
+   if (address->ss_family == AF_INET)
+      compact->ipv4 = *(const struct sockaddr_in*)address;
+   else if (address->ss_family == AF_INET6)
+      compact->ipv6 = *(const struct sockaddr_in6*)address;
+}
+
+void address_expand(struct sockaddr_storage* address, const CompactAddress* compact)
+{
+   memset(address, 0, sizeof(struct sockaddr_storage));
+   memcpy(address, compact, sizeof(CompactAddress));
+}
+
+socklen_t address_length(const struct sockaddr_storage* address)
+{
+   return address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+uint64_t address_hash_ipv4(const struct sockaddr_in* in)
+{
+   uint64_t hash = ((uint64_t)AF_INET << 32) | in->sin_addr.s_addr;
+   return hash ^ ((uint64_t)in->sin_port << 48);
+}
+
+uint64_t address_hash_ipv6(const struct sockaddr_in6* in6)
+{
+   uint64_t words[2];
+   memcpy(words, in6->sin6_addr.s6_addr, sizeof(words));
+   uint64_t hash = AF_INET6;
+   hash ^= words[0] * 0x9E3779B97F4A7C15ULL;
+   return hash ^ (words[1] + ((uint64_t)in6->sin6_port << 16));
+}
+
+// final mix (murmur3 finalizer) so every bit affects the table index
+uint32_t address_hash_mix(uint64_t hash)
+{
+   hash ^= hash >> 33;
+   hash *= 0xFF51AFD7ED558CCDULL;
+   hash ^= hash >> 33;
+   hash *= 0xC4CEB9FE1A85EC53ULL;
+   hash ^= hash >> 33;
+   return (uint32_t)hash;
+}
+
+// hashes the same fields address_equal compares (family, address and port)
+uint32_t address_hash(const struct sockaddr_storage* address)
+{
+   if (address->ss_family == AF_INET)
+      return address_hash_mix(address_hash_ipv4((const void*)address));
+   else if (address->ss_family == AF_INET6)
+      return address_hash_mix(address_hash_ipv6((const void*)address));
+   return address_hash_mix(address->ss_family);
+}
+
 bool address_to_string(const struct sockaddr_storage* address, char* buffer, socklen_t length)
 {
    switch (address->ss_family)
@@ -129,6 +262,44 @@ bool address_to_string(const struct sockaddr_storage* address, char* buffer, soc
    return true;
 }
 
+// the same as the sockaddr_storage helpers above, reading the compact address as what it is
+uint32_t compact_address_hash(const CompactAddress* compact)
+{
+   if (compact->family == AF_INET)
+      return address_hash_mix(address_hash_ipv4(&compact->ipv4));
+   else if (compact->family == AF_INET6)
+      return address_hash_mix(address_hash_ipv6(&compact->ipv6));
+   return address_hash_mix(compact->family);
+}
+
+bool compact_address_equal(const CompactAddress* compact, const struct sockaddr_storage* address)
+{
+   if (compact->family != address->ss_family)
+      return false;
+
+   if (compact->family == AF_INET)
+      return address_equal_ipv4(&compact->ipv4, (const void*)address);
+   else if (compact->family == AF_INET6)
+      return address_equal_ipv6(&compact->ipv6, (const void*)address);
+   return true;
+}
+
+bool compact_address_to_string(const CompactAddress* compact, char* buffer, socklen_t length)
+{
+   switch (compact->family)
+   {
+      case AF_INET:
+         inet_ntop(AF_INET, &compact->ipv4.sin_addr, buffer, length );
+      break;
+      case AF_INET6:
+         inet_ntop(AF_INET6, &compact->ipv6.sin6_addr, buffer, length );
+      break;
+      default:
+         return false;
+   }
+   return true;
+}
+
 bool assign_address_port(struct sockaddr_storage* address, const uint16_t port)
 {
     switch (address->ss_family)
@@ -196,6 +367,9 @@ typedef enum {
    VPNMode_Client
 } VPNMode;
 
+// port used by the VPN
+const uint16_t SERVICE_PORT = 10980;
+
 // arguments passed to the program to customize the local peer
 typedef struct {
    VPNMode mode;
@@ -204,6 +378,16 @@ typedef struct {
    struct sockaddr_storage tunnel_address;
    struct sockaddr_storage tunnel_netmask;
    uint16_t mtu;
+   uint16_t queues;
+   uint16_t crypto_threads;
+   uint8_t backend; // TunnelBackendType
+   bool offload;
+   bool compress;
+   char checksum[16];
+   char key_file[256];
+   uint32_t rate; // Mbit/s to every remote peer, 0 for no limit
+   uint32_t total_rate; // Mbit/s to all of them together, 0 for no limit
+   uint32_t burst; // bytes sent at once over the rates, 0 for the default
    bool persistent;
    bool debug_mode;
 } StartupOptions;
\ No newline at end of file
@@ -5,6 +5,18 @@
 
 #include "tunnel.c"
 #include "socket.c"
+#include "checksum.c"
+#include "compress.c"
+#include "cipher.c"
+#include "pool.c"
+#include "timer.c"
+#include "codel.c"
+#include "pacing.c"
+#include "latency.c"
+#include "stats.c"
 #include "protocol.c"
 #include "peer.c"
+#include "pipeline.c"
+#include "event.c"
+#include "debug.c"
 #include "main.c"
\ No newline at end of file
@@ -1,2 +1,5 @@
 #!/bin/sh
-gcc -std=gnu99 -g -Wall -Wextra -pedantic -O2 -o vpn-poc compile.c
\ No newline at end of file
+gcc -std=gnu99 -g -Wall -Wextra -pedantic -O2 -pthread -o vpn-poc compile.c
+gcc -std=gnu99 -g -Wall -Wextra -pedantic -O2 -pthread -o vpn-microbench compile_microbench.c
+gcc -std=gnu99 -g -Wall -Wextra -pedantic -O2 -o vpn-stats compile_stats.c
+gcc -std=gnu99 -g -Wall -Wextra -pedantic -O2 -pthread -o vpn-bench compile_bench.c
\ No newline at end of file
@@ -0,0 +1,21 @@
+// compilation unit for the loopback benchmark, the whole vpn without its main
+
+#define DEBUG 0  // set to 0 to disable debug logs
+
+#include "tunnel.c"
+#include "socket.c"
+#include "checksum.c"
+#include "compress.c"
+#include "cipher.c"
+#include "pool.c"
+#include "timer.c"
+#include "codel.c"
+#include "pacing.c"
+#include "latency.c"
+#include "stats.c"
+#include "protocol.c"
+#include "peer.c"
+#include "pipeline.c"
+#include "event.c"
+#include "debug.c"
+#include "bench.c"
\ No newline at end of file
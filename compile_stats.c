@@ -0,0 +1,7 @@
+// compilation unit for the stats reader
+
+#define DEBUG 0  // set to 0 to disable debug logs
+
+#include "latency.c"
+#include "stats.c"
+#include "stats_reader.c"
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include "common.h"
+
+// payload compression negotiated between peers
+// the codec is a small LZ77 variant using the LZ4 block format: sequences of
+// literals followed by a back reference, greedy matching through a hash table
+
+typedef enum {
+    CP_None = 0,
+    CP_LZ,
+    CP_Count
+} CompressionType;
+
+typedef struct {
+    uint32_t id; // FNV-1a of the name, sent in the handshake
+    const char* name;
+} CompressionCodec;
+
+static const CompressionCodec compression_codecs[CP_Count] = {
+    { 0, "none" },
+    { 0x4F31D4E3, "lz" }
+};
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5 // the block always ends with literals
+#define LZ_MATCH_LIMIT 12 // no match starts this close to the end
+
+uint32_t lz_read32(const uint8_t* pointer)
+{
+    uint32_t value;
+    memcpy(&value, pointer, sizeof(value));
+    return value;
+}
+
+uint32_t lz_hash(const uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// lengths over 15 continue in extra bytes, each 255 means there is another one
+uint8_t* lz_write_length(uint8_t* output, uint32_t length)
+{
+    while (length >= 255)
+    {
+        *output++ = 255;
+        length -= 255;
+    }
+    *output++ = (uint8_t)length;
+    return output;
+}
+
+// worst case size of a sequence: token, literals with their extra length bytes, offset and match length bytes
+uint32_t lz_sequence_bound(const uint32_t literal_length, const uint32_t match_length)
+{
+    return 1 + literal_length + literal_length / 255 + 1 + 2 + match_length / 255 + 1;
+}
+
+// returns the compressed size, or 0 if it doesn't fit in 'capacity'
+// passing the largest size worth sending makes it give up early on incompressible data
+uint32_t lz_compress(const uint8_t* input, const uint32_t length, uint8_t* output, const uint32_t capacity)
+{
+    const uint8_t* const end = input + length;
+    const uint8_t* const match_limit = (length > LZ_MATCH_LIMIT) ? end - LZ_MATCH_LIMIT : input;
+    const uint8_t* literals = input;
+    const uint8_t* current = input;
+    uint8_t* out = output;
+
+    // positions relative to the input, 0 is never a candidate after the first byte
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    while (current < match_limit)
+    {
+        const uint32_t sequence = lz_read32(current);
+        const uint32_t hash = lz_hash(sequence);
+        const uint8_t* candidate = input + table[hash];
+        table[hash] = (uint16_t)(current - input);
+
+        if (candidate >= current || current - candidate > LZ_MAX_OFFSET || lz_read32(candidate) != sequence)
+        {
+            current++;
+            continue;
+        }
+
+        // extend the match as far as allowed
+        const uint8_t* match_end = current + LZ_MIN_MATCH;
+        const uint8_t* reference = candidate + LZ_MIN_MATCH;
+        while (match_end < end - LZ_LAST_LITERALS && *match_end == *reference)
+        {
+            match_end++;
+            reference++;
+        }
+
+        const uint32_t literal_length = current - literals;
+        const uint32_t match_length = (match_end - current) - LZ_MIN_MATCH;
+        if ((uint32_t)(out - output) + lz_sequence_bound(literal_length, match_length) > capacity)
+            return 0;
+
+        uint8_t* token = out++;
+        *token = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+        if (literal_length >= 15)
+            out = lz_write_length(out, literal_length - 15);
+        memcpy(out, literals, literal_length);
+        out += literal_length;
+
+        const uint16_t offset = (uint16_t)(current - candidate);
+        *out++ = (uint8_t)(offset & 0xFF);
+        *out++ = (uint8_t)(offset >> 8);
+
+        *token |= (uint8_t)(match_length >= 15 ? 15 : match_length);
+        if (match_length >= 15)
+            out = lz_write_length(out, match_length - 15);
+
+        current = match_end;
+        literals = current;
+    }
+
+    // trailing literals
+    const uint32_t literal_length = end - literals;
+    if ((uint32_t)(out - output) + lz_sequence_bound(literal_length, 0) > capacity)
+        return 0;
+    *out++ = (uint8_t)((literal_length >= 15 ? 15 : literal_length) << 4);
+    if (literal_length >= 15)
+        out = lz_write_length(out, literal_length - 15);
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    return out - output;
+}
+
+// returns the decompressed size, or -1 if the input is malformed or doesn't fit
+int32_t lz_decompress(const uint8_t* input, const uint32_t length, uint8_t* output, const uint32_t capacity)
+{
+    const uint8_t* in = input;
+    const uint8_t* const in_end = input + length;
+    uint8_t* out = output;
+    uint8_t* const out_end = output + capacity;
+
+    while (in < in_end)
+    {
+        const uint8_t token = *in++;
+
+        // literals
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15)
+        {
+            uint8_t extra;
+            do {
+                if (in >= in_end)
+                    return -1;
+                extra = *in++;
+                literal_length += extra;
+            } while (extra == 255);
+        }
+
+        if (literal_length > (uint32_t)(in_end - in) || literal_length > (uint32_t)(out_end - out))
+            return -1;
+        memcpy(out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+
+        // the last sequence has no match
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return -1;
+        const uint32_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (uint32_t)(out - output))
+            return -1;
+
+        uint32_t match_length = token & 0x0F;
+        if (match_length == 15)
+        {
+            uint8_t extra;
+            do {
+                if (in >= in_end)
+                    return -1;
+                extra = *in++;
+                match_length += extra;
+            } while (extra == 255);
+        }
+        match_length += LZ_MIN_MATCH;
+
+        if (match_length > (uint32_t)(out_end - out))
+            return -1;
+
+        // offsets shorter than the match repeat the bytes being written, those go one at a time
+        const uint8_t* reference = out - offset;
+        if (offset >= match_length)
+        {
+            memcpy(out, reference, match_length);
+            out += match_length;
+        }
+        else
+        {
+            while (match_length--)
+                *out++ = *reference++;
+        }
+    }
+
+    return out - output;
+}
+
+const CompressionCodec* compression_get(const CompressionType type)
+{
+    return &compression_codecs[type < CP_Count ? type : CP_None];
+}
+
+bool compression_from_id(const uint32_t id, CompressionType* type)
+{
+    for (uint32_t i = CP_None + 1; i < CP_Count; i++)
+    {
+        if (compression_codecs[i].id == id)
+        {
+            *type = (CompressionType)i;
+            return true;
+        }
+    }
+    return false;
+}
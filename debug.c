@@ -0,0 +1,146 @@
+#include "common.h"
+
+// a client and a server peer connected through localhost in the same process
+// used by the debug mode and as the base of the loopback benchmark
+
+typedef struct {
+   Peer* server;
+   Peer* client;
+   EventLoop loop;
+   EventWorker* server_workers;
+   EventWorker* client_workers;
+} DebugPair;
+
+void debug_pair_destroy(DebugPair* pair)
+{
+   event_stop_workers(pair->client_workers, pair->client ? pair->client->worker_count : 0);
+   event_stop_workers(pair->server_workers, pair->server ? pair->server->worker_count : 0);
+   event_loop_close(&pair->loop);
+   peer_destroy(pair->client);
+   peer_destroy(pair->server);
+   memset(pair, 0, sizeof(DebugPair));
+}
+
+// both peers end up initialized, the client already connecting
+bool debug_pair_create(DebugPair* pair, const StartupOptions* startup_options)
+{
+   memset(pair, 0, sizeof(DebugPair));
+   pair->loop.fd = -1;
+   pair->loop.timer_fd = -1;
+   pair->loop.pacing_fd = -1;
+
+   StartupOptions options_server, options_client;
+   CLEAR(options_server);
+   CLEAR(options_client);
+
+   // use the same MTU for full compatibility
+   options_server.mtu = startup_options->mtu;
+   options_client.mtu = options_server.mtu;
+   options_server.offload = startup_options->offload;
+   options_client.offload = startup_options->offload;
+   options_server.compress = startup_options->compress;
+   options_client.compress = startup_options->compress;
+   memcpy(options_server.key_file, startup_options->key_file, sizeof(options_server.key_file));
+   memcpy(options_client.key_file, startup_options->key_file, sizeof(options_client.key_file));
+   options_server.queues = startup_options->queues;
+   memcpy(options_server.checksum, startup_options->checksum, sizeof(options_server.checksum));
+   memcpy(options_client.checksum, startup_options->checksum, sizeof(options_client.checksum));
+   options_client.queues = startup_options->queues;
+   options_server.crypto_threads = startup_options->crypto_threads;
+   options_client.crypto_threads = startup_options->crypto_threads;
+   options_server.backend = startup_options->backend;
+   options_client.backend = startup_options->backend;
+   options_server.rate = startup_options->rate;
+   options_client.rate = startup_options->rate;
+   options_server.total_rate = startup_options->total_rate;
+   options_client.total_rate = startup_options->total_rate;
+   options_server.burst = startup_options->burst;
+   options_client.burst = startup_options->burst;
+
+   // setup two compatible peers to run side-by-side locally
+   pair->client = peer_create(options_server.mtu);
+   pair->server = peer_create(options_client.mtu);
+   if (!pair->client || !pair->server)
+   {
+      debug_pair_destroy(pair);
+      return false;
+   }
+
+   options_server.mode = VPNMode_Server;
+   options_client.mode = VPNMode_Client;
+
+   // hardcode the interfaces to something meaningful
+   strncpy(options_server.interface, "vpns", IF_NAMESIZE-1);
+   strncpy(options_client.interface, "vpnc", IF_NAMESIZE-1);
+
+   // use different blocks to avoid conflicts (default network mask)
+   parse_network_address("10.9.7.0", &options_server.tunnel_address);
+   parse_network_address("10.9.6.0", &options_client.tunnel_address);
+
+   // connect them through localhost
+   parse_network_address("127.0.0.1", &options_server.address);
+   parse_network_address("127.0.0.1", &options_client.address);
+
+   assign_address_port(&options_server.address, SERVICE_PORT);
+   assign_address_port(&options_client.address, SERVICE_PORT);
+
+   if (!peer_initialize(pair->server, &options_server) || !peer_initialize(pair->client, &options_client))
+   {
+      debug_pair_destroy(pair);
+      return false;
+   }
+
+   printf("server peer ready using interface %s\n", pair->server->tunnel.if_name);
+   printf("client peer ready using interface %s\n", pair->client->tunnel.if_name);
+
+   peer_enable(pair->server, true);
+   peer_enable(pair->client, true);
+
+   if (!peer_connect(pair->client, &options_client.address))
+   {
+      debug_pair_destroy(pair);
+      return false;
+   }
+
+   // opened here so it can be stopped before it runs
+   if (!event_loop_open(&pair->loop))
+   {
+      debug_pair_destroy(pair);
+      return false;
+   }
+
+   return true;
+}
+
+// blocks until the loop is stopped or fails, the workers get their own threads
+// the descriptors of the peers are watched from here, after any change made since creating them
+bool debug_pair_run(DebugPair* pair)
+{
+   // service both peers from the same loop
+   if (!event_loop_add_peer(&pair->loop, pair->server) || !event_loop_add_peer(&pair->loop, pair->client))
+      return false;
+
+   if (!event_start_workers(pair->server, &pair->server_workers) || !event_start_workers(pair->client, &pair->client_workers))
+   {
+      printf("failed to start the worker threads\n");
+      return false;
+   }
+
+   if (!event_loop_run(&pair->loop))
+   {
+      printf("error while servicing peers\n");
+      return false;
+   }
+   return true;
+}
+
+int debug_main(const StartupOptions* startup_options)
+{
+   DebugPair pair;
+   if (!debug_pair_create(&pair, startup_options))
+      return -1;
+
+   debug_pair_run(&pair);
+   debug_pair_destroy(&pair);
+   return 0;
+}
\ No newline at end of file
@@ -0,0 +1,422 @@
+#include "peer.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+// event loop to service peers only when there is something to do
+// waits on the socket and tunnel descriptors of every registered peer
+// and uses a periodic timer to drive timeouts, keep-alives and retries
+// sockets are also watched for room while messages wait in their send queues
+// and a one-shot timer wakes the loop when the paced messages can go
+
+#define EVENT_MAX_PEERS 8
+#define EVENT_MAX_EVENTS 32
+#define DEFAULT_TIMER_INTERVAL 100 // ms
+
+typedef enum {
+    ES_Timer = 0,
+    ES_Socket,
+    ES_Tunnel,
+    ES_Pacing
+} EventSourceType;
+
+// passed to epoll to know what woke up the loop
+typedef struct {
+    EventSourceType type;
+    Peer* peer;
+    uint32_t index; // of the peer in the loop
+    uint32_t events; // watched right now
+} EventSource;
+
+typedef struct {
+    int fd;
+    int timer_fd;
+    int pacing_fd;
+    uint64_t pacing_wakeup; // armed, microseconds, 0 if not
+    bool running;
+
+    EventSource timer;
+    EventSource pacing;
+    EventSource sockets[EVENT_MAX_PEERS];
+    EventSource tunnels[EVENT_MAX_PEERS];
+    Peer* peers[EVENT_MAX_PEERS];
+    uint32_t peer_count;
+} EventLoop;
+
+bool event_loop_watch(EventLoop* loop, const int fd, EventSource* source)
+{
+    struct epoll_event event;
+    CLEAR(event);
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+
+    if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        print_errno(__func__, "error adding descriptor to epoll", errno);
+        return false;
+    }
+    source->events = event.events;
+    return true;
+}
+
+bool event_loop_rewatch(EventLoop* loop, const int fd, EventSource* source, const uint32_t events)
+{
+    if (source->events == events)
+        return true;
+
+    struct epoll_event event;
+    CLEAR(event);
+    event.events = events;
+    event.data.ptr = source;
+
+    if (epoll_ctl(loop->fd, EPOLL_CTL_MOD, fd, &event) == -1)
+    {
+        print_errno(__func__, "error changing descriptor events", errno);
+        return false;
+    }
+    source->events = events;
+    return true;
+}
+
+// wakes the loop when the first paced messages of its peers can go
+bool event_loop_arm_pacing(EventLoop* loop)
+{
+    uint64_t wakeup = 0;
+    for (uint32_t i = 0; i < loop->peer_count; i++)
+    {
+        const uint64_t peer_wakeup = loop->peers[i]->send_wakeup;
+        if (peer_wakeup != 0 && (wakeup == 0 || peer_wakeup < wakeup))
+            wakeup = peer_wakeup;
+    }
+
+    if (wakeup == loop->pacing_wakeup)
+        return true;
+
+    // on the same clock as the peers, a zero time disarms it
+    struct itimerspec time;
+    CLEAR(time);
+    time.it_value.tv_sec = wakeup / 1000000;
+    time.it_value.tv_nsec = (wakeup % 1000000) * 1000;
+
+    if (timerfd_settime(loop->pacing_fd, TFD_TIMER_ABSTIME, &time, NULL) == -1)
+    {
+        print_errno(__func__, "error arming pacing timer", errno);
+        return false;
+    }
+    loop->pacing_wakeup = wakeup;
+    return true;
+}
+
+// waits for room in the socket while it is full, and for the paced messages
+// and stops reading the tunnel while the send queues are full
+bool event_loop_update_peer(EventLoop* loop, const uint32_t index)
+{
+    Peer* peer = loop->peers[index];
+    const uint32_t socket_events = EPOLLIN | (peer->send_blocked ? EPOLLOUT : 0);
+    const uint32_t tunnel_events = peer_tunnel_paused(peer) ? 0 : EPOLLIN;
+
+    return event_loop_rewatch(loop, peer->socket.fd, &loop->sockets[index], socket_events)
+        && event_loop_rewatch(loop, peer->tunnel.fd, &loop->tunnels[index], tunnel_events)
+        && event_loop_arm_pacing(loop);
+}
+
+void event_loop_close(EventLoop* loop)
+{
+    if (!loop)
+        return;
+
+    // peers are owned by the caller, only the loop descriptors are released
+    if (loop->pacing_fd != -1)
+        close(loop->pacing_fd);
+    if (loop->timer_fd != -1)
+        close(loop->timer_fd);
+    if (loop->fd != -1)
+        close(loop->fd);
+
+    loop->pacing_fd = -1;
+    loop->timer_fd = -1;
+    loop->fd = -1;
+    loop->peer_count = 0;
+}
+
+bool event_loop_open(EventLoop* loop)
+{
+    if (!loop)
+        return false;
+
+    memset(loop, 0, sizeof(EventLoop));
+    loop->fd = -1;
+    loop->timer_fd = -1;
+    loop->pacing_fd = -1;
+    // set here so a stop requested before running is not lost
+    loop->running = true;
+
+    loop->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->fd == -1)
+    {
+        print_errno(__func__, "error creating epoll instance", errno);
+        return false;
+    }
+
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->pacing_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd == -1 || loop->pacing_fd == -1)
+    {
+        print_errno(__func__, "error creating timer", errno);
+        event_loop_close(loop);
+        return false;
+    }
+
+    // periodic timer for the connection checks
+    struct itimerspec interval;
+    CLEAR(interval);
+    interval.it_interval.tv_sec = DEFAULT_TIMER_INTERVAL / 1000;
+    interval.it_interval.tv_nsec = (DEFAULT_TIMER_INTERVAL % 1000) * 1000 * 1000;
+    interval.it_value = interval.it_interval;
+
+    if (timerfd_settime(loop->timer_fd, 0, &interval, NULL) == -1)
+    {
+        print_errno(__func__, "error arming timer", errno);
+        event_loop_close(loop);
+        return false;
+    }
+
+    // the pacing timer is only armed while paced messages wait
+    loop->timer.type = ES_Timer;
+    loop->pacing.type = ES_Pacing;
+    if (!event_loop_watch(loop, loop->timer_fd, &loop->timer) || !event_loop_watch(loop, loop->pacing_fd, &loop->pacing))
+    {
+        event_loop_close(loop);
+        return false;
+    }
+
+    return true;
+}
+
+bool event_loop_add_peer(EventLoop* loop, Peer* peer)
+{
+    if (!loop || !peer || loop->fd == -1)
+        return false;
+
+    if (loop->peer_count >= EVENT_MAX_PEERS)
+    {
+        printf("%s: too many peers registered in the event loop\n", __func__);
+        return false;
+    }
+
+    const uint32_t index = loop->peer_count;
+
+    EventSource* socket_source = &loop->sockets[index];
+    socket_source->type = ES_Socket;
+    socket_source->peer = peer;
+    socket_source->index = index;
+
+    EventSource* tunnel_source = &loop->tunnels[index];
+    tunnel_source->type = ES_Tunnel;
+    tunnel_source->peer = peer;
+    tunnel_source->index = index;
+
+    if (!event_loop_watch(loop, peer->socket.fd, socket_source))
+        return false;
+
+    if (!event_loop_watch(loop, peer->tunnel.fd, tunnel_source))
+    {
+        epoll_ctl(loop->fd, EPOLL_CTL_DEL, peer->socket.fd, NULL);
+        return false;
+    }
+
+    loop->peers[index] = peer;
+    loop->peer_count++;
+    return true;
+}
+
+bool event_loop_service_timers(EventLoop* loop)
+{
+    // drain the expiration counter so the timer doesn't fire again right away
+    uint64_t expirations = 0;
+    if (read(loop->timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+    {
+        print_errno(__func__, "error reading timer", errno);
+        return false;
+    }
+
+    // keep-alives and handshakes can end up queued too
+    for (uint32_t i = 0; i < loop->peer_count; i++)
+    {
+        if (!peer_service_timers(loop->peers[i]) || !event_loop_update_peer(loop, i))
+            return false;
+    }
+    return true;
+}
+
+bool event_loop_service_pacing(EventLoop* loop)
+{
+    uint64_t expirations = 0;
+    if (read(loop->pacing_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+    {
+        print_errno(__func__, "error reading pacing timer", errno);
+        return false;
+    }
+
+    // it went off, so it has to be armed again even for the same time
+    loop->pacing_wakeup = 0;
+    for (uint32_t i = 0; i < loop->peer_count; i++)
+    {
+        if (loop->peers[i]->send_wakeup == 0)
+            continue;
+        if (!peer_service_queues(loop->peers[i]) || !event_loop_update_peer(loop, i))
+            return false;
+    }
+    return event_loop_arm_pacing(loop);
+}
+
+// blocks servicing the registered peers until one of them fails or the loop is stopped
+bool event_loop_run(EventLoop* loop)
+{
+    if (!loop || loop->fd == -1)
+        return false;
+
+    // don't wait for the first tick to start handshaking
+    for (uint32_t i = 0; i < loop->peer_count; i++)
+    {
+        if (!peer_service_timers(loop->peers[i]))
+            return false;
+    }
+
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    while(__atomic_load_n(&loop->running, __ATOMIC_RELAXED))
+    {
+        int count = epoll_wait(loop->fd, events, EVENT_MAX_EVENTS, -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            print_errno(__func__, "error waiting for events", errno);
+            return false;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            EventSource* source = (EventSource*)events[i].data.ptr;
+
+            bool ok = true;
+            switch(source->type)
+            {
+            case ES_Timer:
+                ok = event_loop_service_timers(loop);
+                break;
+            case ES_Socket:
+                // room for the waiting messages first, they are older than anything read now
+                if (events[i].events & EPOLLOUT)
+                    ok = peer_service_queues(source->peer);
+                if (ok && events[i].events & ~EPOLLOUT)
+                    ok = peer_service_socket(source->peer);
+                ok = ok && event_loop_update_peer(loop, source->index);
+                break;
+            case ES_Tunnel:
+                ok = peer_service_tunnel(source->peer) && event_loop_update_peer(loop, source->index);
+                break;
+            case ES_Pacing:
+                ok = event_loop_service_pacing(loop);
+                break;
+            }
+
+            if (!ok)
+            {
+                printf_debug("%s: error servicing peer\n", __func__);
+                __atomic_store_n(&loop->running, false, __ATOMIC_RELAXED);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// can be called from any thread, the loop notices on the next timer tick at most
+void event_loop_stop(EventLoop* loop)
+{
+    if (loop)
+        __atomic_store_n(&loop->running, false, __ATOMIC_RELAXED);
+}
+
+// every worker of a peer runs its own event loop on its own thread
+typedef struct {
+    Peer* peer;
+    EventLoop loop;
+    pthread_t thread;
+    bool started;
+} EventWorker;
+
+void* event_worker_run(void* argument)
+{
+    EventWorker* worker = (EventWorker*)argument;
+    if (!event_loop_run(&worker->loop))
+        printf("%s: worker event loop failed\n", __func__);
+    return NULL;
+}
+
+void event_stop_workers(EventWorker* workers, const uint32_t count)
+{
+    if (!workers)
+        return;
+
+    for (uint32_t i = 0; i < count; i++)
+        event_loop_stop(&workers[i].loop);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        event_loop_close(&workers[i].loop);
+    }
+
+    free(workers);
+}
+
+// starts a thread per worker of the peer, returns the array to stop them later
+bool event_start_workers(Peer* peer, EventWorker** workers)
+{
+    *workers = NULL;
+    if (peer->worker_count == 0)
+        return true;
+
+    EventWorker* started = (EventWorker*)calloc(peer->worker_count, sizeof(EventWorker));
+    if (!started)
+        return false;
+
+    for (uint32_t i = 0; i < peer->worker_count; i++)
+    {
+        EventWorker* worker = &started[i];
+        worker->peer = peer->workers[i];
+
+        bool ok = event_loop_open(&worker->loop);
+        if (ok && !event_loop_add_peer(&worker->loop, worker->peer))
+        {
+            event_loop_close(&worker->loop);
+            ok = false;
+        }
+
+        if (ok)
+        {
+            int result = pthread_create(&worker->thread, NULL, event_worker_run, worker);
+            if (result != 0)
+            {
+                print_errno(__func__, "error creating worker thread", result);
+                event_loop_close(&worker->loop);
+                ok = false;
+            }
+        }
+
+        if (!ok)
+        {
+            event_stop_workers(started, i);
+            return false;
+        }
+        worker->started = true;
+    }
+
+    *workers = started;
+    return true;
+}
@@ -0,0 +1,177 @@
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// latency of every stage of the data path, in log-bucketed histograms (HDR style)
+// values below 16 ticks are exact, above that every power of two is split in 8 buckets
+// so the error is under 12.5% whatever the magnitude
+// timing is sampled: only one message of every 'sampling' is timed, none with zero
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 36 // anything longer (some seconds) lands in the last bucket
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef enum {
+    LS_TunnelRead = 0,
+    LS_Checksum,
+    LS_Compress,
+    LS_Encrypt,
+    LS_SocketSend, // a whole batch
+    LS_SocketReceive, // a whole batch
+    LS_Decrypt,
+    LS_Uncompress,
+    LS_Verify, // checksum of a received message
+    LS_Nat,
+    LS_TunnelWrite,
+    LS_Count
+} LatencyStage;
+
+const char* const latency_stage_names[LS_Count] = {
+    "tunnel read", "checksum", "compress", "encrypt", "socket send",
+    "socket receive", "decrypt", "uncompress", "verify", "nat", "tunnel write"
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// what a thread needs to time its stages
+typedef struct {
+    LatencyHistogram* histograms; // LS_Count of them, written only by this thread
+    const uint32_t* sampling; // time one message of every 'sampling', zero to stop
+    uint32_t countdown;
+    bool timing; // the message going through the stages now is being timed
+} LatencyProbe;
+
+// where probes record before they have a page, and what they read while nothing asks for timing
+LatencyHistogram latency_discard[LS_Count];
+const uint32_t latency_off = 0;
+
+// ticks of the time source, cycles where there is a TSC and nanoseconds elsewhere
+uint64_t latency_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+#endif
+}
+
+// measured once against the monotonic clock
+uint64_t latency_ticks_per_second()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static uint64_t ticks = 0;
+    if (ticks == 0)
+    {
+        struct timespec start, end, wait = { 0, 20 * 1000 * 1000 };
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const uint64_t first = __rdtsc();
+        nanosleep(&wait, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const uint64_t last = __rdtsc();
+
+        const uint64_t nanoseconds = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+        ticks = nanoseconds > 0 ? (last - first) * 1000000000ULL / nanoseconds : 1000000000ULL;
+    }
+    return ticks;
+#else
+    return 1000000000ULL;
+#endif
+}
+
+uint32_t latency_bucket(const uint64_t ticks)
+{
+    if (ticks < 2 * LATENCY_SUB_BUCKETS)
+        return (uint32_t)ticks;
+
+    const uint32_t shift = (63 - __builtin_clzll(ticks)) - LATENCY_SUB_BITS;
+    const uint32_t bucket = ((shift + 1) << LATENCY_SUB_BITS) + (uint32_t)((ticks >> shift) & (LATENCY_SUB_BUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// highest value that falls in the bucket
+uint64_t latency_bucket_value(const uint32_t bucket)
+{
+    if (bucket < 2 * LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    const uint32_t shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    const uint64_t lowest = (uint64_t)(LATENCY_SUB_BUCKETS + (bucket & (LATENCY_SUB_BUCKETS - 1))) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+// single writer, the relaxed stores only keep a reader from seeing torn values
+void latency_record(LatencyHistogram* histogram, const uint64_t ticks)
+{
+    uint64_t* bucket = &histogram->buckets[latency_bucket(ticks)];
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+void latency_probe_init(LatencyProbe* probe, LatencyHistogram* histograms, const uint32_t* sampling)
+{
+    probe->histograms = histograms ? histograms : latency_discard;
+    probe->sampling = sampling ? sampling : &latency_off;
+    probe->countdown = 0;
+    probe->timing = false;
+}
+
+// decides if the next message (or batch) is timed
+bool latency_sample(LatencyProbe* probe)
+{
+    const uint32_t every = __atomic_load_n(probe->sampling, __ATOMIC_RELAXED);
+    if (every == 0)
+    {
+        probe->timing = false;
+        return false;
+    }
+
+    if (probe->countdown == 0 || probe->countdown > every)
+        probe->countdown = every;
+    probe->timing = (--probe->countdown == 0);
+    return probe->timing;
+}
+
+// start of the first stage, zero when not timing
+uint64_t latency_start(const LatencyProbe* probe)
+{
+    return probe->timing ? latency_now() : 0;
+}
+
+// records the stage that began at 'start' and returns when the next one begins
+uint64_t latency_stage(LatencyProbe* probe, const LatencyStage stage, const uint64_t start)
+{
+    if (!probe->timing)
+        return 0;
+
+    const uint64_t now = latency_now();
+    latency_record(&probe->histograms[stage], now - start);
+    return now;
+}
+
+// value under which the fraction of the samples falls, in ticks
+uint64_t latency_percentile(const uint64_t* buckets, const uint64_t count, const double fraction)
+{
+    if (count == 0)
+        return 0;
+
+    uint64_t wanted = (uint64_t)(count * fraction);
+    if (wanted < 1)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen >= wanted)
+            return latency_bucket_value(i);
+    }
+    return latency_bucket_value(LATENCY_BUCKETS - 1);
+}
\ No newline at end of file
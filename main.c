@@ -2,21 +2,28 @@
 
 #include <getopt.h>
 
-// port used by the VPN
-const uint16_t SERVICE_PORT = 10980;
-
 void show_help(const char* executable)
 {
    if (!executable)
       executable = "executable";
 
-   printf("\nUsage: %s {-s [<bind address>] | -c <remote address>} [-a <tunnel address>] [-m <tunnel netmask>] [-l <mtu>] [-i <tunnel interface>] [-p] [-h]\n", executable);
+   printf("\nUsage: %s {-s [<bind address>] | -c <remote address>} [-a <tunnel address>] [-m <tunnel netmask>] [-l <mtu>] [-i <tunnel interface>] [-q <queues>] [-t <threads>] [-b <backend>] [-k <checksum>] [-z] [-e <key file>] [-r <rate>] [-g <rate>] [-n <burst>] [-o] [-p] [-h]\n", executable);
    printf("\t-s, --server\tstart the vpn in server mode. optionally specify the address to bind to (defaults to 0.0.0.0)\n");
    printf("\t-c, --connect\tstart the vpn in client mode. specify the remote server address to connect to.\n");
    printf("\t-a, --address\tspecify the address block used for the tun device. (defaults to 10.9.8.0)\n");
    printf("\t-m, --mask\tspecify the network mask used for the tun device. (defaults to 255.255.255.0)\n");
    printf("\t-l, --mtu\tspecify the MTU for the tun device. (defaults to 1400)\n");
    printf("\t-i, --interface\ttun device name to create or attach if it already exists. (max 15 characters)\n");
+   printf("\t-q, --queues\tnumber of tun queues, each serviced by its own thread and socket. servers pin every client to one socket. (defaults to 1)\n");
+   printf("\t-t, --threads\textra threads per queue to compress and encrypt the data, the queue thread only moves packets. (defaults to 0)\n");
+   printf("\t-b, --backend\twhere tunnel packets come from: tun, or ring and socketpair to run without privileges when something in the process feeds them (benchmarks and tests). (defaults to tun)\n");
+   printf("\t-k, --checksum\tpreferred message checksum: adler32, crc32c or none. (defaults to adler32)\n");
+   printf("\t-e, --key\tencrypt every message with ChaCha20-Poly1305, using the pre-shared key in the file (64 hex characters). both sides need the same key.\n");
+   printf("\t-z, --compress\tcompress data messages when the remote supports it. flows that don't compress well are skipped.\n");
+   printf("\t-r, --rate\tpace the messages sent to each remote peer to this many Mbit/s. (defaults to no limit)\n");
+   printf("\t-g, --total-rate\tpace the messages sent to all the remote peers together to this many Mbit/s. (defaults to no limit)\n");
+   printf("\t-n, --burst\tbytes that can be sent at once over the rates. (defaults to 10 ms at the rate)\n");
+   printf("\t-o, --offload\tlet the tun device exchange TCP super-packets with the vpn (TSO/GRO).\n");
    printf("\t-p, --persist\tkeep the tun device after shutting down the vpn.\n");
 }
 
@@ -33,11 +40,21 @@ bool parse_startup_options(int argc, char** argv, StartupOptions* result)
       {"mask",       required_argument,   0, 'm'}, // tunnel network mask
       {"mtu",        required_argument,   0, 'l'}, // socket & tunnel mtu
       {"interface",  required_argument,   0, 'i'}, // tun device to use
+      {"queues",     required_argument,   0, 'q'}, // tun queues and threads
+      {"threads",    required_argument,   0, 't'}, // crypto threads per queue
+      {"backend",    required_argument,   0, 'b'}, // tunnel backend
+      {"checksum",   required_argument,   0, 'k'}, // preferred integrity checksum
+      {"compress",   no_argument,         0, 'z'}, // payload compression
+      {"key",        required_argument,   0, 'e'}, // pre-shared key file
+      {"rate",       required_argument,   0, 'r'}, // pacing per remote peer
+      {"total-rate", required_argument,   0, 'g'}, // pacing for every remote peer together
+      {"burst",      required_argument,   0, 'n'}, // pacing burst
+      {"offload",    no_argument,         0, 'o'}, // tun segmentation offloads
       {"persist",    no_argument,         0, 'p'}, // keep the set tun device 
       {"debug",      no_argument,         0, 'd'}, // debug mode
       {0, 0, 0, 0}
    };
-   const char* short_options = ":s::c:a:m:l:i:p";
+   const char* short_options = ":s::c:a:m:l:i:q:t:b:k:ze:r:g:n:op";
 
    bool error = false;
    while(1)
@@ -113,6 +130,92 @@ bool parse_startup_options(int argc, char** argv, StartupOptions* result)
                strncpy(result->interface, optarg, IF_NAMESIZE-1);
                result->interface[IF_NAMESIZE-1] = '\0';
             break;
+         case 'q':
+         {
+            int queues = atoi(optarg);
+            if (queues < 1 || queues > PEER_MAX_QUEUES)
+            {
+               printf("queues have to be between 1 and %u\n", PEER_MAX_QUEUES);
+               error = true;
+            }
+            result->queues = (uint16_t)queues;
+            break;
+         }
+         case 't':
+         {
+            int threads = atoi(optarg);
+            if (threads < 0 || threads > PEER_MAX_CRYPTO_THREADS)
+            {
+               printf("threads have to be between 0 and %u\n", PEER_MAX_CRYPTO_THREADS);
+               error = true;
+            }
+            result->crypto_threads = (uint16_t)threads;
+            break;
+         }
+         case 'b':
+         {
+            TunnelBackendType backend = TB_Tun;
+            if (!tunnel_backend_from_name(optarg, &backend))
+            {
+               printf("unknown tunnel backend %s\n", optarg);
+               error = true;
+            }
+            result->backend = (uint8_t)backend;
+            break;
+         }
+         case 'k':
+         {
+            ChecksumType checksum;
+            if (!checksum_from_name(optarg, &checksum))
+            {
+               printf("unknown checksum %s\n", optarg);
+               error = true;
+            }
+            strncpy(result->checksum, optarg, sizeof(result->checksum)-1);
+            result->checksum[sizeof(result->checksum)-1] = '\0';
+            break;
+         }
+         case 'z':
+               result->compress = true;
+            break;
+         case 'e':
+            if (strlen(optarg) >= sizeof(result->key_file))
+            {
+               printf("key file path too long\n");
+               error = true;
+            }
+            strncpy(result->key_file, optarg, sizeof(result->key_file)-1);
+            result->key_file[sizeof(result->key_file)-1] = '\0';
+            break;
+         case 'r':
+         case 'g':
+         {
+            int rate = atoi(optarg);
+            if (rate < 1 || rate > PACING_MAX_RATE)
+            {
+               printf("rates have to be between 1 and %u Mbit/s\n", PACING_MAX_RATE);
+               error = true;
+            }
+            if (c == 'r')
+               result->rate = (uint32_t)rate;
+            else
+               result->total_rate = (uint32_t)rate;
+            break;
+         }
+         case 'n':
+         {
+            int burst = atoi(optarg);
+            if (burst < 1 || burst > PACING_MAX_BURST)
+            {
+               printf("burst has to be between 1 and %u bytes\n", PACING_MAX_BURST);
+               error = true;
+            }
+            result->burst = (uint32_t)burst;
+            break;
+         }
+         case 'o':
+               result->offload = true;
+            break;
          case 'p':
                result->persistent = true;
             break;
@@ -147,71 +250,11 @@ bool parse_startup_options(int argc, char** argv, StartupOptions* result)
    return !error;
 }
 
-int debug_main(const StartupOptions* startup_options)
-{
-   StartupOptions options_server, options_client;
-   CLEAR(options_server);
-   CLEAR(options_client);
-
-   // use the same MTU for full compatibility
-   options_server.mtu = startup_options->mtu;
-   options_client.mtu = options_server.mtu;
-
-   // setup two compatible peers to run side-by-side locally
-   Peer* client = peer_create(options_server.mtu);
-   Peer* server = peer_create(options_client.mtu);
-   if (!client ||  !server)
-   return -1;
-
-   options_server.mode = VPNMode_Server;
-   options_client.mode = VPNMode_Client;
-
-   // hardcode the interfaces to something meaningful
-   strncpy(options_server.interface, "vpns", IF_NAMESIZE-1);
-   strncpy(options_client.interface, "vpnc", IF_NAMESIZE-1);
-
-   // use different blocks to avoid conflicts (default network mask)
-   parse_network_address("10.9.7.0", &options_server.tunnel_address);
-   parse_network_address("10.9.6.0", &options_client.tunnel_address);
-
-   // connect them through localhost
-   parse_network_address("127.0.0.1", &options_server.address);
-   parse_network_address("127.0.0.1", &options_client.address);
-
-   assign_address_port(&options_server.address, SERVICE_PORT);
-   assign_address_port(&options_client.address, SERVICE_PORT);
-
-   if (!peer_initialize(server, &options_server))
-      return -1;
-   
-   if (!peer_initialize(client, &options_client))
-      return -1;
-
-   printf("server peer ready using interface %s\n", server->tunnel.if_name);
-   printf("client peer ready using interface %s\n", client->tunnel.if_name);
-
-   peer_enable(server, true);
-   peer_enable(client, true);
-
-   if (!peer_connect(client, &options_client.address))
-      return -1;  
-
-   while(true)
-   {
-      peer_service(server);
-      peer_service(client);
-   }
-
-   return 0;
-}
-
 int main(int argc, char** argv)
 {
-   if (!check_tun_privileges() || !check_socket_privileges())
-   {
-      printf("this program needs root or NET_CAP_ADMIN privileges\n");
-      return 0;
-   }
+   // select the checksum and cipher implementations for this cpu
+   checksum_initialize();
+   cipher_initialize();
 
    StartupOptions startup_options;
    CLEAR(startup_options);
@@ -223,6 +266,13 @@ int main(int argc, char** argv)
       return 0;
    }
 
+   // only the TUN device (and the socket marks that go with it) need privileges
+   if (startup_options.backend == TB_Tun && (!check_tun_privileges() || !check_socket_privileges()))
+   {
+      printf("this program needs root or NET_CAP_ADMIN privileges\n");
+      return 0;
+   }
+
    // divert execution to testing mode
    if (startup_options.debug_mode)
       return debug_main(&startup_options);
@@ -258,23 +308,28 @@ int main(int argc, char** argv)
    // activate the tunnel (ideally this should be done *after* connection)
    peer_enable(local_peer, true);
 
-   while(true)
+   // wait for packets and timers instead of polling the peer
+   EventLoop loop;
+   if (!event_loop_open(&loop))
    {
-      if (!peer_service(local_peer))
-      {
-         printf("error while servicing peer\n");
-         break;
-      }
-
-      // sleep 1ms to save cpu
-      usleep(1 * 1000);
+      printf("failed to create the event loop\n");
+      peer_destroy(local_peer);
+      return -1;
+   }
 
-      // execution gets stuck when using nanosleep
-      //struct timespec delay;
-      //delay.tv_nsec = 1 * (1000 * 1000); // 1ms
-      //nanosleep(&delay, NULL);
+   // the extra queues are serviced from their own threads
+   EventWorker* workers = NULL;
+   if (!event_start_workers(local_peer, &workers))
+      printf("failed to start the worker threads\n");
+   else if (event_loop_add_peer(&loop, local_peer))
+   {
+      if (!event_loop_run(&loop))
+         printf("error while servicing peer\n");
    }
 
+   event_stop_workers(workers, local_peer->worker_count);
+   event_loop_close(&loop);
+
    peer_enable(local_peer, false);
    peer_destroy(local_peer);
 
@@ -0,0 +1,906 @@
+#include "common.h"
+
+// micro-benchmarks for the hot functions of the data path
+// every case runs for a fixed time budget and reports the cost of a single call
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MICROBENCH_MIN_TIME 200 // ms per case
+#define MICROBENCH_MAX_SIZE 65536
+
+typedef struct {
+    const char* name;
+    ChecksumFunction compute;
+} ChecksumCase;
+
+// the original implementation, kept as the baseline
+uint32_t microbench_adler32_modulo(const uint8_t* buffer, const uint32_t length)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for(uint32_t i = 0; i < length; i++)
+    {
+        a = (a + buffer[i]) % ADLER32_MODULO;
+        b = (b + a) % ADLER32_MODULO;
+    }
+    return (b << 16) | a;
+}
+
+uint64_t microbench_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+uint64_t microbench_nanoseconds()
+{
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+}
+
+// prevents the compiler from dropping the results
+volatile uint32_t microbench_sink;
+
+void microbench_checksum(const ChecksumCase* bench, const uint8_t* buffer, const uint32_t length)
+{
+    // warm up and estimate how many calls fit in the time budget
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    while (elapsed < MICROBENCH_MIN_TIME * 1000000ULL / 10)
+    {
+        iterations *= 2;
+        const uint64_t start = microbench_nanoseconds();
+        for (uint64_t i = 0; i < iterations; i++)
+            microbench_sink = bench->compute(buffer, length);
+        elapsed = microbench_nanoseconds() - start;
+    }
+    iterations *= 10;
+
+    const uint64_t start = microbench_nanoseconds();
+    const uint64_t start_cycles = microbench_cycles();
+    for (uint64_t i = 0; i < iterations; i++)
+        microbench_sink = bench->compute(buffer, length);
+    const uint64_t cycles = microbench_cycles() - start_cycles;
+    elapsed = microbench_nanoseconds() - start;
+
+    const double ns_per_op = (double)elapsed / iterations;
+    printf("%-24s %6u %12.1f %12.1f %10.2f\n", bench->name, length, ns_per_op,
+        (double)cycles / iterations, length / ns_per_op);
+}
+
+typedef struct {
+    const char* name;
+    ChaChaFunction keystream; // NULL to only authenticate
+} CipherCase;
+
+void microbench_seal(const CipherCase* bench, uint8_t* buffer, const uint32_t length)
+{
+    static const uint8_t key[CIPHER_KEY_SIZE] = { 1 };
+    static const uint8_t nonce[CIPHER_NONCE_SIZE] = { 2 };
+    uint32_t key_words[8];
+    uint32_t nonce_words[3];
+    cipher_load_key(key, nonce, key_words, nonce_words);
+    uint8_t tag[CIPHER_TAG_SIZE];
+
+    chacha20_xor = bench->keystream ? bench->keystream : chacha20_xor_scalar;
+
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    while (elapsed < MICROBENCH_MIN_TIME * 1000000ULL / 10)
+    {
+        iterations *= 2;
+        const uint64_t start = microbench_nanoseconds();
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            if (bench->keystream)
+                cipher_seal(key, nonce, buffer, 8, buffer + 8, length - 8, tag);
+            else
+                cipher_authenticate(key_words, nonce_words, buffer, 8, buffer + 8, length - 8, tag);
+        }
+        elapsed = microbench_nanoseconds() - start;
+    }
+    iterations *= 10;
+
+    const uint64_t start = microbench_nanoseconds();
+    const uint64_t start_cycles = microbench_cycles();
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        if (bench->keystream)
+            cipher_seal(key, nonce, buffer, 8, buffer + 8, length - 8, tag);
+        else
+            cipher_authenticate(key_words, nonce_words, buffer, 8, buffer + 8, length - 8, tag);
+    }
+    const uint64_t cycles = microbench_cycles() - start_cycles;
+    elapsed = microbench_nanoseconds() - start;
+    microbench_sink = tag[0];
+
+    const double ns_per_op = (double)elapsed / iterations;
+    printf("%-24s %6u %12.1f %12.1f %10.2f\n", bench->name, length, ns_per_op,
+        (double)cycles / iterations, length / ns_per_op);
+}
+
+// RFC 8439 2.8.2 test vector, and every keystream implementation has to agree with the scalar one
+bool microbench_check_cipher(const CipherCase* cases, const uint32_t case_count, const uint8_t* input)
+{
+    const char* plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+    static const uint8_t expected[CIPHER_TAG_SIZE] = { 0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91 };
+    static const uint8_t nonce[CIPHER_NONCE_SIZE] = { 0x07, 0, 0, 0, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47 };
+    static const uint8_t header[12] = { 0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7 };
+    uint8_t key[CIPHER_KEY_SIZE];
+    for (uint32_t i = 0; i < CIPHER_KEY_SIZE; i++)
+        key[i] = 0x80 + i;
+
+    uint8_t* reference = (uint8_t*)malloc(MICROBENCH_MAX_SIZE);
+    uint8_t* output = (uint8_t*)malloc(MICROBENCH_MAX_SIZE);
+    bool ok = reference && output;
+    for (uint32_t c = 0; ok && c < case_count; c++)
+    {
+        if (!cases[c].keystream)
+            continue;
+        chacha20_xor = cases[c].keystream;
+
+        uint8_t tag[CIPHER_TAG_SIZE];
+        const uint32_t length = strlen(plaintext);
+        memcpy(output, plaintext, length);
+        cipher_seal(key, nonce, header, sizeof(header), output, length, tag);
+        ok = (memcmp(tag, expected, sizeof(tag)) == 0) && cipher_open(key, nonce, header, sizeof(header), output, length, tag)
+            && memcmp(output, plaintext, length) == 0;
+
+        for (uint32_t length = 0; ok && length < 2048; length += 7)
+        {
+            memcpy(reference, input, length);
+            memcpy(output, input, length);
+            chacha20_xor_scalar((const uint32_t*)input, (const uint32_t*)(input + 32), length, reference, length);
+            cases[c].keystream((const uint32_t*)input, (const uint32_t*)(input + 32), length, output, length);
+            ok = (memcmp(reference, output, length) == 0);
+        }
+
+        if (!ok)
+            printf("cipher mismatch for %s\n", cases[c].name);
+    }
+
+    free(reference);
+    free(output);
+    return ok;
+}
+
+// counters out of order within the window are fine once, the old and the repeated ones never
+bool microbench_check_replay()
+{
+    CipherReplay replay;
+    cipher_replay_reset(&replay);
+    const uint64_t far = (uint64_t)1 << 40;
+    bool ok = cipher_replay_accept(&replay, 0) && !cipher_replay_accept(&replay, 0)
+        && cipher_replay_accept(&replay, 5) && cipher_replay_accept(&replay, 3) && !cipher_replay_accept(&replay, 3)
+        && cipher_replay_accept(&replay, CIPHER_REPLAY_WINDOW + 100) && !cipher_replay_accept(&replay, 100)
+        && cipher_replay_accept(&replay, 101) && !cipher_replay_accept(&replay, 101)
+        && cipher_replay_accept(&replay, far) && cipher_replay_accept(&replay, far - 1)
+        && !cipher_replay_accept(&replay, far - CIPHER_REPLAY_WINDOW - 1) && !cipher_replay_accept(&replay, far);
+
+    if (!ok)
+        printf("replay window mismatch\n");
+    return ok;
+}
+
+// payloads resembling what goes through a tunnel
+typedef enum {
+    CT_Text = 0,
+    CT_Json,
+    CT_Random,
+    CT_Sparse,
+    CT_Mixed,
+    CT_Count
+} CorpusType;
+
+static const char* corpus_names[CT_Count] = { "text/html", "json", "random", "sparse binary", "mixed" };
+
+void microbench_fill_corpus(const CorpusType type, uint8_t* buffer, const uint32_t length)
+{
+    static const char* words[] = { "<div class=\"item\">", "the ", "packet ", "</div>\n", "tunnel ", "<a href=\"/index.html\">", "of ", "network " };
+    uint32_t i = 0;
+    while (i < length)
+    {
+        switch(type)
+        {
+        case CT_Text:
+        {
+            const char* word = words[rand() % 8];
+            for (uint32_t w = 0; word[w] && i < length; w++)
+                buffer[i++] = word[w];
+            break;
+        }
+        case CT_Json:
+        {
+            char record[64];
+            int written = snprintf(record, sizeof(record), "{\"id\":%d,\"name\":\"user%d\",\"active\":%s},", rand() % 100000, rand() % 1000, (rand() & 1) ? "true" : "false");
+            for (int w = 0; w < written && i < length; w++)
+                buffer[i++] = record[w];
+            break;
+        }
+        case CT_Random:
+            buffer[i++] = (uint8_t)rand();
+            break;
+        case CT_Sparse:
+            // mostly zeros with some small values, like structs and headers
+            buffer[i++] = (rand() % 8 == 0) ? (uint8_t)rand() : 0;
+            break;
+        case CT_Mixed:
+        {
+            // alternate compressible and incompressible runs
+            const uint32_t run = 256 < length - i ? 256 : length - i;
+            microbench_fill_corpus((i / 256) % 2 ? CT_Random : CT_Text, buffer + i, run);
+            i += run;
+            break;
+        }
+        default:
+            return;
+        }
+    }
+}
+
+// compresses and uncompresses every corpus checking the round trip, and reports throughput per core
+bool microbench_compression(const uint8_t* input, const CorpusType type, const uint32_t length)
+{
+    uint8_t* compressed = (uint8_t*)malloc(MICROBENCH_MAX_SIZE * 2);
+    uint8_t* output = (uint8_t*)malloc(MICROBENCH_MAX_SIZE);
+    if (!compressed || !output)
+    {
+        free(compressed);
+        free(output);
+        return false;
+    }
+
+    const uint32_t capacity = MICROBENCH_MAX_SIZE * 2;
+    const uint32_t compressed_length = lz_compress(input, length, compressed, capacity);
+    const int32_t output_length = lz_decompress(compressed, compressed_length, output, MICROBENCH_MAX_SIZE);
+    if (compressed_length == 0 || output_length != (int32_t)length || memcmp(input, output, length) != 0)
+    {
+        printf("compression round trip failed for %s (%u bytes)\n", corpus_names[type], length);
+        free(compressed);
+        free(output);
+        return false;
+    }
+
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    while (elapsed < MICROBENCH_MIN_TIME * 1000000ULL / 10)
+    {
+        iterations *= 2;
+        const uint64_t start = microbench_nanoseconds();
+        for (uint64_t i = 0; i < iterations; i++)
+            microbench_sink = lz_compress(input, length, compressed, capacity);
+        elapsed = microbench_nanoseconds() - start;
+    }
+    iterations *= 10;
+
+    uint64_t start = microbench_nanoseconds();
+    for (uint64_t i = 0; i < iterations; i++)
+        microbench_sink = lz_compress(input, length, compressed, capacity);
+    const uint64_t compress_elapsed = microbench_nanoseconds() - start;
+
+    start = microbench_nanoseconds();
+    for (uint64_t i = 0; i < iterations; i++)
+        microbench_sink = (uint32_t)lz_decompress(compressed, compressed_length, output, MICROBENCH_MAX_SIZE);
+    const uint64_t decompress_elapsed = microbench_nanoseconds() - start;
+
+    // bytes per ns * 1000 = MB/s
+    printf("%-24s %6u %10.1f%% %12.1f %12.1f\n", corpus_names[type], length, 100.0 * compressed_length / length,
+        1000.0 * length * iterations / compress_elapsed, 1000.0 * length * iterations / decompress_elapsed);
+
+    free(compressed);
+    free(output);
+    return true;
+}
+
+// the per-packet functions cost a few ns so they run the whole loop themselves
+// otherwise the indirect call would weigh as much as the function being measured
+typedef uint32_t (*PathLoop)(void* context, const uint64_t iterations);
+
+typedef struct {
+    const char* name;
+    PathLoop run;
+    void* context;
+    uint32_t size; // bytes of the packet or remote peers in the table
+} PathCase;
+
+void microbench_path(const PathCase* bench)
+{
+    uint64_t iterations = 1;
+    uint64_t elapsed = 0;
+    while (elapsed < MICROBENCH_MIN_TIME * 1000000ULL / 10)
+    {
+        iterations *= 2;
+        const uint64_t start = microbench_nanoseconds();
+        microbench_sink = bench->run(bench->context, iterations);
+        elapsed = microbench_nanoseconds() - start;
+    }
+    iterations *= 10;
+
+    const uint64_t start = microbench_nanoseconds();
+    const uint64_t start_cycles = microbench_cycles();
+    microbench_sink = bench->run(bench->context, iterations);
+    const uint64_t cycles = microbench_cycles() - start_cycles;
+    elapsed = microbench_nanoseconds() - start;
+
+    printf("%-24s %6u %12.2f %12.1f\n", bench->name, bench->size, (double)elapsed / iterations, (double)cycles / iterations);
+}
+
+typedef struct {
+    uint8_t* buffer;
+    uint32_t length;
+    struct sockaddr_storage addresses[2]; // alternated so every call changes the packet
+} PacketContext;
+
+// up to the transport header, past the IPv6 extension headers microbench_fill_packet() adds
+uint32_t microbench_ip_header_length(const uint8_t* packet, uint8_t* protocol)
+{
+    if ((packet[0] >> 4) == 4)
+    {
+        *protocol = ((const struct iphdr*)packet)->protocol;
+        return (uint32_t)(packet[0] & 0x0F) << 2;
+    }
+
+    uint32_t length = sizeof(struct ip6_hdr);
+    *protocol = ((const struct ip6_hdr*)packet)->ip6_nxt;
+    while (*protocol == IPPROTO_HOPOPTS || *protocol == IPPROTO_ROUTING || *protocol == IPPROTO_FRAGMENT)
+    {
+        // all of them are 8 bytes here
+        *protocol = packet[length];
+        length += 8;
+    }
+    return length;
+}
+
+// the whole transport checksum, with the pseudo header and the checksum field itself
+uint64_t microbench_transport_sum(const uint8_t* packet, const uint32_t length)
+{
+    uint8_t protocol = 0;
+    const uint32_t header_length = microbench_ip_header_length(packet, &protocol);
+    const uint32_t transport_length = length - header_length;
+    uint64_t sum = 0;
+    if ((packet[0] >> 4) == 4)
+        sum = checksum_add(sum, packet + offsetof(struct iphdr, saddr), 8);
+    else
+        sum = checksum_add(sum, packet + offsetof(struct ip6_hdr, ip6_src), 32);
+    sum += protocol;
+    sum += transport_length;
+    return checksum_add(sum, packet + header_length, transport_length);
+}
+
+uint16_t* microbench_transport_check(uint8_t* packet)
+{
+    uint8_t protocol = 0;
+    const uint32_t header_length = microbench_ip_header_length(packet, &protocol);
+    if (protocol == IPPROTO_TCP)
+        return &((struct tcphdr*)(packet + header_length))->check;
+    return &((struct udphdr*)(packet + header_length))->check;
+}
+
+// a tunnel packet from 10.9.8.2 (or fd00::2) to a host behind the server, with valid checksums
+// IPv6 ones can have hop-by-hop, routing (no segments left) and first fragment headers in front
+void microbench_fill_packet(uint8_t* packet, const uint32_t length, const bool ipv6, const bool extensions, const uint8_t protocol)
+{
+    for (uint32_t i = 0; i < length; i++)
+        packet[i] = (uint8_t)rand();
+
+    uint32_t header_length = sizeof(struct iphdr);
+    if (ipv6)
+    {
+        struct ip6_hdr* header6 = (struct ip6_hdr*)packet;
+        header_length = sizeof(struct ip6_hdr);
+        header6->ip6_flow = htonl(6 << 28);
+        header6->ip6_plen = htons(length - header_length);
+        header6->ip6_nxt = protocol;
+        header6->ip6_hlim = 64;
+        inet_pton(AF_INET6, "fd00::2", &header6->ip6_src);
+        inet_pton(AF_INET6, "2001:db8::80", &header6->ip6_dst);
+
+        if (extensions)
+        {
+            const uint8_t chain[] = { IPPROTO_HOPOPTS, IPPROTO_ROUTING, IPPROTO_FRAGMENT, protocol };
+            header6->ip6_nxt = chain[0];
+            for (uint32_t i = 0; i < 3; i++, header_length += 8)
+            {
+                uint8_t* extension = packet + header_length;
+                memset(extension, 0, 8);
+                extension[0] = chain[i + 1];
+                if (chain[i] == IPPROTO_FRAGMENT)
+                    ((struct ip6_frag*)extension)->ip6f_offlg = IP6F_MORE_FRAG;
+            }
+        }
+    }
+    else
+    {
+        struct iphdr* header4 = (struct iphdr*)packet;
+        memset(header4, 0, sizeof(struct iphdr));
+        header4->version = 4;
+        header4->ihl = 5;
+        header4->tot_len = htons(length);
+        header4->id = htons(0x1234);
+        header4->ttl = 64;
+        header4->protocol = protocol;
+        header4->saddr = inet_addr("10.9.8.2");
+        header4->daddr = inet_addr("93.184.216.34");
+        header4->check = htons(~checksum_fold(checksum_add(0, packet, header_length)));
+    }
+
+    uint8_t* transport = packet + header_length;
+    if (protocol == IPPROTO_TCP)
+    {
+        struct tcphdr* tcp = (struct tcphdr*)transport;
+        tcp->source = htons(51234);
+        tcp->dest = htons(443);
+        tcp->doff = 5;
+        tcp->check = 0;
+    }
+    else
+    {
+        struct udphdr* udp = (struct udphdr*)transport;
+        udp->source = htons(51234);
+        udp->dest = htons(53);
+        udp->len = htons(length - header_length);
+        udp->check = 0;
+    }
+    *microbench_transport_check(packet) = htons(~checksum_fold(microbench_transport_sum(packet, length)));
+}
+
+// both checksums have to verify after rewriting the addresses back and forth
+bool microbench_check_packet(const PacketContext* context)
+{
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+        if (!protocol_replace_address(context->buffer, context->length, &context->addresses[i & 1], i % 3 == 0))
+            return false;
+
+        uint8_t protocol = 0;
+        if ((context->buffer[0] >> 4) == 4 && checksum_fold(checksum_add(0, context->buffer, microbench_ip_header_length(context->buffer, &protocol))) != 0xFFFF)
+            return false;
+        if (checksum_fold(microbench_transport_sum(context->buffer, context->length)) != 0xFFFF)
+            return false;
+    }
+    return true;
+}
+
+uint32_t microbench_loop_replace_address(void* context, const uint64_t iterations)
+{
+    PacketContext* packet = (PacketContext*)context;
+    uint32_t result = 0;
+    for (uint64_t i = 0; i < iterations; i++)
+        result += protocol_replace_address(packet->buffer, packet->length, &packet->addresses[i & 1], true);
+    return result;
+}
+
+uint32_t microbench_loop_get_destination(void* context, const uint64_t iterations)
+{
+    PacketContext* packet = (PacketContext*)context;
+    struct sockaddr_storage destination;
+    memset(&destination, 0, sizeof(destination));
+    uint32_t result = 0;
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        protocol_get_destination(packet->buffer, packet->length, &destination);
+        result += destination.ss_family;
+    }
+    return result;
+}
+
+uint32_t microbench_loop_flow_hash(void* context, const uint64_t iterations)
+{
+    PacketContext* packet = (PacketContext*)context;
+    uint32_t result = 0;
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        // keeps the compiler from computing it once
+        __asm__ volatile("" ::: "memory");
+        result += protocol_flow_hash(packet->buffer, packet->length);
+    }
+    return result;
+}
+
+// what the incremental updates avoid: summing the headers or the whole segment again
+uint32_t microbench_loop_ip_checksum(void* context, const uint64_t iterations)
+{
+    PacketContext* packet = (PacketContext*)context;
+    struct iphdr* header4 = (struct iphdr*)packet->buffer;
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        header4->check = 0;
+        header4->check = htons(~checksum_fold(checksum_add(0, packet->buffer, header4->ihl << 2)));
+        __asm__ volatile("" ::: "memory");
+    }
+    return header4->check;
+}
+
+uint32_t microbench_loop_transport_checksum(void* context, const uint64_t iterations)
+{
+    PacketContext* packet = (PacketContext*)context;
+    uint16_t* check = microbench_transport_check(packet->buffer);
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        *check = 0;
+        *check = htons(~checksum_fold(microbench_transport_sum(packet->buffer, packet->length)));
+        __asm__ volatile("" ::: "memory");
+    }
+    return *check;
+}
+
+#define MICROBENCH_QUERIES 1024 // power of two
+
+typedef struct {
+    Peer* peer;
+    bool real; // by real address, otherwise by vpn address
+    struct sockaddr_storage queries[MICROBENCH_QUERIES];
+    struct sockaddr_storage copies[MICROBENCH_QUERIES]; // same addresses, other memory
+} LookupContext;
+
+uint32_t microbench_loop_find_remote(void* context, const uint64_t iterations)
+{
+    LookupContext* lookup = (LookupContext*)context;
+    uint32_t result = 0;
+    for (uint64_t i = 0; i < iterations; i++)
+        result += peer_find_remote(lookup->peer, &lookup->queries[i & (MICROBENCH_QUERIES - 1)], lookup->real) != NULL;
+    return result;
+}
+
+uint32_t microbench_loop_address_equal(void* context, const uint64_t iterations)
+{
+    LookupContext* lookup = (LookupContext*)context;
+    uint32_t result = 0;
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        const uint32_t index = i & (MICROBENCH_QUERIES - 1);
+        result += address_equal(&lookup->queries[index], &lookup->copies[index]);
+    }
+    return result;
+}
+
+// public addresses and ports, like clients behind different NATs
+void microbench_remote_address(struct sockaddr_storage* address, const bool ipv6)
+{
+    memset(address, 0, sizeof(struct sockaddr_storage));
+    if (ipv6)
+    {
+        struct sockaddr_in6* in6 = (struct sockaddr_in6*)address;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(1024 + rand() % 60000);
+        inet_pton(AF_INET6, "2001:db8::", &in6->sin6_addr);
+        for (uint32_t i = 8; i < 16; i++)
+            in6->sin6_addr.s6_addr[i] = (uint8_t)rand();
+    }
+    else
+    {
+        struct sockaddr_in* in = (struct sockaddr_in*)address;
+        in->sin_family = AF_INET;
+        in->sin_port = htons(1024 + rand() % 60000);
+        in->sin_addr.s_addr = htonl(0x64400000 | (rand() & 0x3FFFFF)); // 100.64.0.0/10
+    }
+}
+
+// a server with that many remote peers, the queries pick random ones (or unknown addresses to miss)
+Peer* microbench_create_server(LookupContext* lookup, const uint32_t count, const bool ipv6, const bool miss)
+{
+    Peer* peer = peer_create(0);
+    if (!peer)
+        return NULL;
+    parse_network_address("10.9.8.0", &peer->tunnel_address_block);
+
+    struct sockaddr_storage* addresses = (struct sockaddr_storage*)malloc(sizeof(struct sockaddr_storage) * count);
+    if (!addresses)
+    {
+        peer_destroy(peer);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        RemotePeer* remote = remotepeer_create(peer);
+        if (!remote)
+        {
+            free(addresses);
+            peer_destroy(peer);
+            return NULL;
+        }
+        remote->id = (uint8_t)(i % 253 + 1);
+        remote->next = peer->remote_peers;
+        peer->remote_peers = remote;
+
+        microbench_remote_address(&addresses[i], ipv6);
+        address_compact(&remote->real_address, &addresses[i]);
+        peer_insert_remote(peer, remote);
+
+        // the vpn addresses only go up to 253 hosts
+        if (i < 253)
+        {
+            struct sockaddr_storage vpn_address;
+            parse_network_address("10.9.8.0", &vpn_address);
+            ((struct sockaddr_in*)&vpn_address)->sin_addr.s_addr = htonl(0x0A090800 | remote->id);
+            address_compact(&remote->vpn_address, &vpn_address);
+            peer_insert_host(peer, remote);
+        }
+    }
+
+    lookup->peer = peer;
+    for (uint32_t i = 0; i < MICROBENCH_QUERIES; i++)
+    {
+        if (!lookup->real)
+        {
+            const uint32_t hosts = count < 253 ? count : 253;
+            parse_network_address("10.9.8.0", &lookup->queries[i]);
+            ((struct sockaddr_in*)&lookup->queries[i])->sin_addr.s_addr = htonl(0x0A090800 | (rand() % hosts + 1));
+        }
+        else if (miss)
+            microbench_remote_address(&lookup->queries[i], ipv6);
+        else
+            lookup->queries[i] = addresses[rand() % count];
+        lookup->copies[i] = lookup->queries[i];
+    }
+
+    free(addresses);
+    return peer;
+}
+
+bool microbench_data_path(uint8_t* buffer)
+{
+    printf("%-24s %6s %12s %12s\n", "data path", "bytes", "ns/op", "cycles/op");
+
+    // TCP and UDP over both IP versions, at the sizes of acks, DNS and full segments
+    const struct {
+        const char* name;
+        bool ipv6;
+        bool extensions;
+        uint8_t protocol;
+    } kinds[] = {
+        { "ipv4 tcp", false, false, IPPROTO_TCP }, { "ipv4 udp", false, false, IPPROTO_UDP },
+        { "ipv6 tcp", true, false, IPPROTO_TCP }, { "ipv6 ext udp", true, true, IPPROTO_UDP }
+    };
+    const uint32_t sizes[] = { 64, 576, 1400 };
+
+    for (uint32_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            // the three extension headers don't leave room for the smallest ones
+            if (kinds[k].extensions && sizes[s] < sizeof(struct ip6_hdr) + 3 * 8 + sizeof(struct udphdr))
+                continue;
+
+            PacketContext context;
+            context.buffer = buffer;
+            context.length = sizes[s];
+            microbench_fill_packet(buffer, sizes[s], kinds[k].ipv6, kinds[k].extensions, kinds[k].protocol);
+            parse_network_address(kinds[k].ipv6 ? "fd00::2" : "10.9.8.2", &context.addresses[0]);
+            parse_network_address(kinds[k].ipv6 ? "2001:db8:0:5::7" : "192.168.1.20", &context.addresses[1]);
+
+            if (!microbench_check_packet(&context))
+            {
+                printf("bad checksums after replacing the address of %s (%u bytes)\n", kinds[k].name, sizes[s]);
+                return false;
+            }
+
+            char names[5][32];
+            snprintf(names[0], sizeof(names[0]), "replace addr (%s)", kinds[k].name);
+            snprintf(names[1], sizeof(names[1]), "full ip sum (%s)", kinds[k].name);
+            snprintf(names[2], sizeof(names[2]), "full l4 sum (%s)", kinds[k].name);
+            snprintf(names[3], sizeof(names[3]), "destination (%s)", kinds[k].name);
+            snprintf(names[4], sizeof(names[4]), "flow hash (%s)", kinds[k].name);
+
+            microbench_path(&(PathCase){ names[0], microbench_loop_replace_address, &context, sizes[s] });
+            if (!kinds[k].ipv6)
+                microbench_path(&(PathCase){ names[1], microbench_loop_ip_checksum, &context, sizes[s] });
+            microbench_path(&(PathCase){ names[2], microbench_loop_transport_checksum, &context, sizes[s] });
+            microbench_path(&(PathCase){ names[3], microbench_loop_get_destination, &context, sizes[s] });
+            microbench_path(&(PathCase){ names[4], microbench_loop_flow_hash, &context, sizes[s] });
+        }
+        printf("\n");
+    }
+
+    printf("%-24s %6s %12s %12s\n", "remote lookup", "peers", "ns/op", "cycles/op");
+    LookupContext* lookup = (LookupContext*)malloc(sizeof(LookupContext));
+    if (!lookup)
+        return false;
+
+    const uint32_t counts[] = { 1, 16, 256, 4096 };
+    for (uint32_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        const struct {
+            const char* name;
+            bool real;
+            bool ipv6;
+            bool miss;
+        } lookups[] = {
+            { "find remote (real)", true, false, false },
+            { "find remote (real6)", true, true, false },
+            { "find remote (miss)", true, false, true },
+            { "find remote (host)", false, false, false },
+        };
+
+        for (uint32_t l = 0; l < sizeof(lookups) / sizeof(lookups[0]); l++)
+        {
+            lookup->real = lookups[l].real;
+            Peer* peer = microbench_create_server(lookup, counts[c], lookups[l].ipv6, lookups[l].miss);
+            if (!peer)
+            {
+                free(lookup);
+                return false;
+            }
+
+            // every query has to find its peer, or none when missing
+            const uint32_t found = microbench_loop_find_remote(lookup, MICROBENCH_QUERIES);
+            if (found != (lookups[l].miss ? 0 : MICROBENCH_QUERIES))
+            {
+                printf("%s found %u of %u remote peers\n", lookups[l].name, found, MICROBENCH_QUERIES);
+                peer_destroy(peer);
+                free(lookup);
+                return false;
+            }
+
+            microbench_path(&(PathCase){ lookups[l].name, microbench_loop_find_remote, lookup, counts[c] });
+            if (lookups[l].real && !lookups[l].miss)
+                microbench_path(&(PathCase){ lookups[l].ipv6 ? "address equal (ipv6)" : "address equal (ipv4)", microbench_loop_address_equal, lookup, counts[c] });
+            peer_destroy(peer);
+        }
+        printf("\n");
+    }
+
+    free(lookup);
+    return true;
+}
+
+// a remote peer that goes away releases its queued messages, and a peer torn down with messages
+// still queued releases them before its pools go (build with -fsanitize=address to see it)
+bool microbench_check_teardown()
+{
+    Peer* peer = peer_create(0);
+    if (!peer)
+        return false;
+
+    RemotePeer* remotes[2];
+    for (uint32_t r = 0; r < 2; r++)
+    {
+        remotes[r] = remotepeer_create(peer);
+        if (!remotes[r])
+        {
+            peer_destroy(peer);
+            return false;
+        }
+        remotes[r]->id = (uint8_t)(r + 1);
+    }
+    peer->remote_peers = remotes[0];
+    remotes[0]->next = remotes[1];
+    remotes[1]->prev = remotes[0];
+
+    const uint32_t free_count = peer->send_pool.free_count;
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        Packet* packet = packet_acquire(&peer->send_pool);
+        packet_set_length(packet, 100);
+        packet->remote = remotes[i & 1];
+        packet->flow = (uint16_t)(i % CODEL_FLOWS);
+        protocol_enqueue(peer, packet);
+    }
+
+    remotepeer_destroy(peer, remotes[1]);
+    const bool ok = peer->send_queued == 16 && peer->send_pool.free_count == free_count - 16;
+    if (!ok)
+        printf("purging a remote peer left %u messages queued and %u packets in use\n", peer->send_queued, free_count - peer->send_pool.free_count);
+
+    peer_destroy(peer);
+    return ok;
+}
+
+int main()
+{
+    checksum_initialize();
+    cipher_initialize();
+
+    ChecksumCase cases[8];
+    uint32_t case_count = 0;
+    cases[case_count++] = (ChecksumCase){ "adler32 (modulo)", microbench_adler32_modulo };
+    cases[case_count++] = (ChecksumCase){ "adler32 (scalar)", checksum_adler32_scalar };
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3"))
+        cases[case_count++] = (ChecksumCase){ "adler32 (ssse3)", checksum_adler32_ssse3 };
+#endif
+    cases[case_count++] = (ChecksumCase){ "crc32c (table)", checksum_crc32c_table };
+    if (checksum_get(CK_CRC32C)->compute != checksum_crc32c_table)
+        cases[case_count++] = (ChecksumCase){ "crc32c (hardware)", checksum_get(CK_CRC32C)->compute };
+    cases[case_count++] = (ChecksumCase){ "none", checksum_none };
+
+    uint8_t* buffer = (uint8_t*)malloc(MICROBENCH_MAX_SIZE);
+    if (!buffer)
+        return -1;
+
+    srand(0x5EC0070C);
+    for (uint32_t i = 0; i < MICROBENCH_MAX_SIZE; i++)
+        buffer[i] = (uint8_t)rand();
+
+    // every implementation of the same algorithm has to agree
+    const uint32_t sizes[] = { 64, 256, 1400, 9000, 65535 };
+    const uint32_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+    for (uint32_t s = 0; s < size_count; s++)
+    {
+        for (uint32_t length = sizes[s] - 33; length <= sizes[s]; length++)
+        {
+            const uint32_t adler = microbench_adler32_modulo(buffer, length);
+            const uint32_t crc = checksum_crc32c_table(buffer, length);
+            if (checksum_compute(CK_Adler32, buffer, length) != adler || checksum_compute(CK_CRC32C, buffer, length) != crc)
+            {
+                printf("checksum mismatch for %u bytes\n", length);
+                free(buffer);
+                return -1;
+            }
+        }
+    }
+
+    printf("%-24s %6s %12s %12s %10s\n", "checksum", "bytes", "ns/op", "cycles/op", "GB/s");
+    for (uint32_t s = 0; s < size_count; s++)
+    {
+        for (uint32_t i = 0; i < case_count; i++)
+            microbench_checksum(&cases[i], buffer, sizes[s]);
+        printf("\n");
+    }
+
+    CipherCase ciphers[4];
+    uint32_t cipher_count = 0;
+    ciphers[cipher_count++] = (CipherCase){ "chacha20 (scalar)", chacha20_xor_scalar };
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse2"))
+        ciphers[cipher_count++] = (CipherCase){ "chacha20 (sse2)", chacha20_xor_sse2 };
+    if (__builtin_cpu_supports("avx2"))
+        ciphers[cipher_count++] = (CipherCase){ "chacha20 (avx2)", chacha20_xor_avx2 };
+#elif defined(__aarch64__)
+    ciphers[cipher_count++] = (CipherCase){ "chacha20 (neon)", chacha20_xor_neon };
+#endif
+    ciphers[cipher_count++] = (CipherCase){ "poly1305 only", NULL };
+
+    if (!microbench_check_cipher(ciphers, cipher_count, buffer) || !microbench_check_replay())
+    {
+        free(buffer);
+        return -1;
+    }
+
+    // whole seal: keystream, xor and tag
+    printf("%-24s %6s %12s %12s %10s\n", "chacha20-poly1305", "bytes", "ns/op", "cycles/op", "GB/s");
+    for (uint32_t s = 0; s < size_count; s++)
+    {
+        for (uint32_t i = 0; i < cipher_count; i++)
+            microbench_seal(&ciphers[i], buffer, sizes[s]);
+        printf("\n");
+    }
+
+    printf("%-24s %6s %11s %12s %12s\n", "compression", "bytes", "ratio", "comp MB/s", "decomp MB/s");
+    const uint32_t compress_sizes[] = { 256, 1400, 9000 };
+    for (uint32_t s = 0; s < sizeof(compress_sizes) / sizeof(compress_sizes[0]); s++)
+    {
+        for (uint32_t type = 0; type < CT_Count; type++)
+        {
+            microbench_fill_corpus((CorpusType)type, buffer, compress_sizes[s]);
+            if (!microbench_compression(buffer, (CorpusType)type, compress_sizes[s]))
+            {
+                free(buffer);
+                return -1;
+            }
+        }
+        printf("\n");
+    }
+
+    if (!microbench_data_path(buffer))
+    {
+        free(buffer);
+        return -1;
+    }
+
+    if (!microbench_check_teardown())
+    {
+        free(buffer);
+        return -1;
+    }
+
+    free(buffer);
+    return 0;
+}
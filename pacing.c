@@ -0,0 +1,72 @@
+#include "common.h"
+
+// token buckets pacing the messages sent to each remote peer and to all of them together
+// a bucket is kept as the time it would be full again (virtual scheduling, the GCRA form of the token bucket)
+// sending moves that time forward by what the bytes take at the rate, and it can run ahead of the clock
+// up to the burst; a single compare and swap updates it so every queue thread can share the bucket
+
+#define PACING_BURST_TIME 10 // ms at the rate, when no burst is given
+#define PACING_MAX_RATE (100 * 1000) // Mbit/s
+#define PACING_MAX_BURST (16 * 1024 * 1024) // bytes
+
+typedef struct {
+    uint64_t rate; // bytes per second, 0 without a limit
+    uint64_t burst; // how far ahead of the clock the buckets can run, nanoseconds
+} PacingRate;
+
+typedef struct {
+    uint64_t full; // nanoseconds, when the bucket is full again
+} TokenBucket;
+
+// the burst can't be smaller than a message or the bigger ones would never fit
+void pacing_rate_init(PacingRate* pacing, const uint32_t mbits, const uint32_t burst, const uint32_t message_size)
+{
+    memset(pacing, 0, sizeof(PacingRate));
+    if (mbits == 0)
+        return;
+
+    pacing->rate = (uint64_t)mbits * 1000 * 1000 / 8;
+
+    uint64_t bytes = burst > 0 ? burst : pacing->rate * PACING_BURST_TIME / 1000;
+    if (bytes < message_size)
+        bytes = message_size;
+    pacing->burst = bytes * 1000000000ULL / pacing->rate;
+}
+
+bool pacing_enabled(const PacingRate* pacing)
+{
+    return pacing->rate > 0;
+}
+
+uint64_t pacing_cost(const PacingRate* pacing, const uint32_t bytes)
+{
+    return (uint64_t)bytes * 1000000000ULL / pacing->rate;
+}
+
+// takes the tokens for the bytes if the bucket has them and returns 0
+// otherwise it is left alone and returns how long until it has them, in nanoseconds
+uint64_t pacing_take(TokenBucket* bucket, const PacingRate* pacing, const uint32_t bytes, const uint64_t now)
+{
+    if (!pacing_enabled(pacing))
+        return 0;
+
+    const uint64_t cost = pacing_cost(pacing, bytes);
+    uint64_t full = __atomic_load_n(&bucket->full, __ATOMIC_RELAXED);
+    while (true)
+    {
+        // a bucket that filled up long ago doesn't keep the extra tokens
+        const uint64_t next = (full > now ? full : now) + cost;
+        if (next > now + pacing->burst)
+            return next - now - pacing->burst;
+
+        if (__atomic_compare_exchange_n(&bucket->full, &full, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 0;
+    }
+}
+
+// gives back the tokens of bytes that were taken but not sent
+void pacing_refund(TokenBucket* bucket, const PacingRate* pacing, const uint32_t bytes)
+{
+    if (pacing_enabled(pacing))
+        __atomic_fetch_sub(&bucket->full, pacing_cost(pacing, bytes), __ATOMIC_RELAXED);
+}
\ No newline at end of file
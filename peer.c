@@ -1,44 +1,147 @@
 #include "peer.h"
 
-RemotePeer* remotepeer_create()
+// adds a chunk of free remote peers to the slab
+bool remoteslab_grow(RemoteSlab* slab)
 {
-    RemotePeer* peer = (RemotePeer*)malloc(sizeof(RemotePeer));
-    if (!peer)
+    RemoteChunk* chunk = (RemoteChunk*)calloc(1, sizeof(RemoteChunk));
+    void* hot = NULL;
+    if (!chunk || posix_memalign(&hot, 64, sizeof(RemotePeer) * REMOTE_SLAB_CHUNK) != 0)
+    {
+        free(chunk);
+        return false;
+    }
+
+    chunk->hot = (RemotePeer*)hot;
+    chunk->cold = (RemotePeerCold*)calloc(REMOTE_SLAB_CHUNK, sizeof(RemotePeerCold));
+    if (!chunk->cold)
+    {
+        free(chunk->hot);
+        free(chunk);
+        return false;
+    }
+
+    // chain them in order so consecutive peers end up next to each other
+    memset(chunk->hot, 0, sizeof(RemotePeer) * REMOTE_SLAB_CHUNK);
+    for (uint32_t i = 0; i < REMOTE_SLAB_CHUNK; i++)
+    {
+        chunk->hot[i].cold = &chunk->cold[i];
+        chunk->hot[i].next = (i + 1 < REMOTE_SLAB_CHUNK) ? &chunk->hot[i + 1] : slab->free_list;
+    }
+    slab->free_list = &chunk->hot[0];
+
+    chunk->next = slab->chunks;
+    slab->chunks = chunk;
+    return true;
+}
+
+void remoteslab_destroy(RemoteSlab* slab)
+{
+    RemoteChunk* chunk = slab->chunks;
+    while(chunk)
+    {
+        RemoteChunk* next = chunk->next;
+        free(chunk->hot);
+        free(chunk->cold);
+        free(chunk);
+        chunk = next;
+    }
+    slab->chunks = NULL;
+    slab->free_list = NULL;
+}
+
+// drops the messages still waiting for a remote peer that goes away, in the owner and every worker
+// the caller must hold the lock exclusively
+void peer_purge_queues(Peer* peer, RemotePeer* remote)
+{
+    Peer* owner = peer->owner;
+    for (uint32_t w = 0; w <= owner->worker_count; w++)
+    {
+        // emptied queues leave the round robin in the next protocol_drain()
+        Peer* sender = (w == 0) ? owner : owner->workers[w - 1];
+        SendQueue* queue = sender->send_queues[remote->id];
+        if (queue)
+            sender->send_queued -= flowqueue_purge(&queue->flows, &sender->send_pool, remote);
+    }
+}
+
+// remote peers are shared by the owner and its workers so they come from the owner slab
+// the caller must hold the lock exclusively
+RemotePeer* remotepeer_create(Peer* peer)
+{
+    RemoteSlab* slab = &peer->owner->remote_slab;
+    if (!slab->free_list && !remoteslab_grow(slab))
         return NULL;
 
-    memset(peer, 0, sizeof(RemotePeer));
-    return peer;
+    RemotePeer* remote = slab->free_list;
+    slab->free_list = remote->next;
+
+    RemotePeerCold* cold = remote->cold;
+    memset(remote, 0, sizeof(RemotePeer));
+    remote->cold = cold;
+
+    // checked as soon as possible, it sets its own timer from there
+    cold->timer.data = remote;
+    timer_schedule(&peer->owner->timers, &cold->timer, peer->clock.ms);
+    return remote;
 }
 
 // returns the next remote peer in the intrusive list
-RemotePeer* remotepeer_destroy(RemotePeer* peer)
+RemotePeer* remotepeer_destroy(Peer* peer, RemotePeer* remote)
 {
-    if (!peer)
+    if (!remote)
         return NULL;
 
 #if DEBUG
     char text[256];
-    address_to_string(&peer->real_address, text, sizeof(text));
+    compact_address_to_string(&remote->real_address, text, sizeof(text));
     printf_debug("%s: peer address %s\n", __func__, text);
 #endif
 
+    // stop finding it by address or time, and forget what it had waiting
+    timer_cancel(&peer->owner->timers, &remote->cold->timer);
+    peer_purge_queues(peer, remote);
+    peer_remove_remote(peer, remote);
+    peer_remove_host(peer, remote);
+    if (peer->owner->stats.page)
+        stats_release_remote(peer->owner->stats.page, remote->stats);
+
     // remove the peer from the list
-    if (peer->prev)
-    {
-        peer->prev->next = peer->next;
-        if (peer->next)
-            peer->next->prev = peer->prev;
-    }
+    if (remote->prev)
+        remote->prev->next = remote->next;
+    if (remote->next)
+        remote->next->prev = remote->prev;
 
     // return the next one to update the list head if needed
-    RemotePeer* next = peer->next;
+    RemotePeer* next = remote->next;
 
-    // delete the peer
-    free(peer);
+    // give it back to the slab wiped
+    RemotePeerCold* cold = remote->cold;
+    memset(cold, 0, sizeof(RemotePeerCold));
+    memset(remote, 0, sizeof(RemotePeer));
+    remote->cold = cold;
+
+    RemoteSlab* slab = &peer->owner->remote_slab;
+    remote->next = slab->free_list;
+    slab->free_list = remote;
 
     return next;
 }
 
+// (re)allocates the receive packets, they can hold several coalesced messages each with GRO
+// only before the peer starts receiving
+bool peer_allocate_recv_slots(Peer* peer, const uint32_t slot_size)
+{
+    // plus one to uncompress messages into
+    PacketPool pool;
+    if (!packet_pool_create(&pool, PEER_BATCH_SIZE + 1, slot_size, 0, PW_OnRelease))
+        return false;
+
+    packet_pool_destroy(&peer->recv_pool);
+    peer->recv_pool = pool;
+    peer->inflate = packet_acquire(&peer->recv_pool);
+    return true;
+}
+
 Peer* peer_create(const uint32_t buffer_size)
 {
     Peer* peer = (Peer*)malloc(sizeof(Peer));
@@ -47,21 +150,41 @@ Peer* peer_create(const uint32_t buffer_size)
 
     memset(peer, 0, sizeof(Peer));
     socket_clear(&peer->socket);
+    peer->tunnel.fd = -1;
+    peer->tunnel.outside = -1;
+    peer->tunnel.socket = -1;
+    peer->owner = peer;
+    peer->counters = &stats_discard;
+    latency_probe_init(&peer->latency, NULL, NULL);
+    // a tick behind so the timers set before servicing it for the first time go off right away
+    timer_wheel_init(&peer->timers, get_current_timestamp() - 1);
 
     // include the header size to compose messages directly in the buffers
+    // and the room encryption appends so it happens in place too
     peer->buffer_size = buffer_size > 0 ? buffer_size : DEFAULT_BUFFER_SIZE;
-    peer->buffer_size += sizeof(MsgHeader);
+    peer->buffer_size += sizeof(MsgHeader) + MSG_SEAL_SIZE;
 
-    peer->recv_buffer = (uint8_t*)malloc(peer->buffer_size);
-    peer->send_buffer = (uint8_t*)malloc(peer->buffer_size);
-    if (!peer->recv_buffer || !peer->send_buffer)
+    // one packet per batched message in each direction plus one for control messages, one to compress into
+    // and the ones waiting in the send queues, tunnel data is read after the header headroom so it is packed in place
+    if (!packet_pool_create(&peer->send_pool, PEER_BATCH_SIZE + 2 + PEER_SEND_QUEUED, peer->buffer_size, sizeof(MsgHeader), PW_OnRelease)
+        || !peer_allocate_recv_slots(peer, peer->buffer_size))
     {
-        free(peer->recv_buffer);
-        free(peer->send_buffer);
+        packet_pool_destroy(&peer->send_pool);
         free(peer);
-        peer = NULL;
+        return NULL;
     }
 
+    peer->control = packet_acquire(&peer->send_pool);
+    peer->send_buffer = peer->control->buffer;
+    peer->deflate = packet_acquire(&peer->send_pool);
+
+    // writers first so timeouts and new connections don't starve behind the data path
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&peer->lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
     return peer;
 }
 
@@ -70,51 +193,261 @@ void peer_destroy(Peer* peer)
     if (!peer)
         return;
 
+    // the crypto threads use the pools and the remote peers
+    pipeline_destroy(peer->pipeline);
+    peer->pipeline = NULL;
+
+    // workers have to be stopped already
+    for (uint32_t i = 0; i < peer->worker_count; i++)
+        peer_destroy(peer->workers[i]);
+    peer->worker_count = 0;
+
     // shut down socket
     socket_close(&peer->socket);
     // shut down tunnel
     tunnel_down(&peer->tunnel);
     tunnel_close(&peer->tunnel);
 
-    // delete buffers
-    if (peer->recv_buffer)
-        free(peer->recv_buffer);
-     if (peer->send_buffer)
-        free(peer->send_buffer);
-
-    // delete remote peer list
+    // delete remote peer list, before the buffers because it purges their queued messages
     RemotePeer* remote_peer = peer->remote_peers;
     while(remote_peer)
-        remote_peer = remotepeer_destroy(remote_peer);
+        remote_peer = remotepeer_destroy(peer, remote_peer);
+    peer->remote_peers = NULL;
+    free(peer->remote_table.slots);
+    remoteslab_destroy(&peer->remote_slab);
+
+    // delete buffers
+    for (uint32_t i = 0; i < PEER_MAX_HOSTS; i++)
+        free(peer->send_queues[i]);
+    packet_pool_destroy(&peer->recv_pool);
+    packet_pool_destroy(&peer->send_pool);
+    stats_close(&peer->stats);
+
+    pthread_rwlock_destroy(&peer->lock);
 
     // delete the peer
+    memset(peer->key, 0, sizeof(peer->key));
     free(peer);
 }
 
-RemotePeer* peer_find_remote(Peer* peer, struct sockaddr_storage* address, const bool real)
+// the remote peers are shared with the workers so they have to be locked before use
+// exclusive access is only needed to add, remove or readdress them
+void peer_lock(Peer* peer, const bool exclusive)
+{
+    if (exclusive)
+        pthread_rwlock_wrlock(&peer->owner->lock);
+    else
+        pthread_rwlock_rdlock(&peer->owner->lock);
+}
+
+void peer_unlock(Peer* peer)
+{
+    pthread_rwlock_unlock(&peer->owner->lock);
+}
+
+// trades the shared lock for the exclusive one, which isn't atomic: the timers can destroy a
+// remote peer in between, so it is looked up again by its address (NULL if it is gone)
+RemotePeer* peer_lock_exclusive(Peer* peer, struct sockaddr_storage* address)
 {
-    //char remote_text[256];
-    //char address_text[256];
-    //address_to_string(address, address_text, sizeof(address_text));
+    peer_unlock(peer);
+    peer_lock(peer, true);
+    return peer_find_remote(peer, address, true);
+}
+
+// places the remote in the first free slot of its probe sequence
+void remotetable_place(RemoteTable* table, const uint32_t hash, RemotePeer* remote)
+{
+    const uint32_t mask = table->capacity - 1;
+    uint32_t index = hash & mask;
+    while(table->slots[index].remote)
+        index = (index + 1) & mask;
+
+    table->slots[index].hash = hash;
+    table->slots[index].remote = remote;
+    table->count++;
+}
+
+bool remotetable_resize(RemoteTable* table, const uint32_t capacity)
+{
+    RemoteSlot* slots = (RemoteSlot*)calloc(capacity, sizeof(RemoteSlot));
+    if (!slots)
+        return false;
 
-    // this should be a hashmap lookup or a binary search
-    RemotePeer* remote = peer->remote_peers;
-    while(remote)
+    RemoteSlot* old_slots = table->slots;
+    const uint32_t old_capacity = table->capacity;
+
+    table->slots = slots;
+    table->capacity = capacity;
+    table->count = 0;
+
+    for (uint32_t i = 0; i < old_capacity; i++)
     {
-        struct sockaddr_storage* relevant = real ? &remote->real_address : &remote->vpn_address;
+        if (old_slots[i].remote)
+            remotetable_place(table, old_slots[i].hash, old_slots[i].remote);
+    }
 
-        //address_to_string(relevant, remote_text, sizeof(remote_text));
-        //printf_debug("%s: checking %s against %s\n", __func__, address_text, remote_text);
+    free(old_slots);
+    return true;
+}
 
-        if (address_equal(relevant, address))
-            return remote;
-        remote = remote->next;
+// the caller must hold the lock exclusively
+bool peer_insert_remote(Peer* peer, RemotePeer* remote)
+{
+    RemoteTable* table = &peer->owner->remote_table;
+
+    // grow before going over half full to keep the probe sequences short
+    if ((table->count + 1) * 2 > table->capacity)
+    {
+        const uint32_t capacity = table->capacity ? table->capacity * 2 : REMOTE_TABLE_MIN_CAPACITY;
+        if (!remotetable_resize(table, capacity))
+        {
+            printf("%s: not enough memory to index the remote peer\n", __func__);
+            return false;
+        }
     }
 
-    return NULL;
+    remotetable_place(table, compact_address_hash(&remote->real_address), remote);
+
+    // show it in the stats under its current address
+    StatsPage* page = peer->owner->stats.page;
+    if (page)
+    {
+        if (remote->stats == 0)
+            remote->stats = (uint8_t)stats_claim_remote(page, remote->id);
+        if (remote->stats > 0)
+            compact_address_to_string(&remote->real_address, page->remotes[remote->stats].address, sizeof(page->remotes[0].address));
+    }
+    return true;
 }
 
-bool peer_initialize2(Peer* peer, const VPNMode mode, const struct sockaddr_storage* address, const char* interface)
+// the caller must hold the lock exclusively
+void peer_remove_remote(Peer* peer, RemotePeer* remote)
+{
+    RemoteTable* table = &peer->owner->remote_table;
+    if (table->count == 0)
+        return;
+
+    const uint32_t mask = table->capacity - 1;
+    uint32_t index = compact_address_hash(&remote->real_address) & mask;
+    while(table->slots[index].remote != remote)
+    {
+        if (!table->slots[index].remote)
+            return; // not indexed
+        index = (index + 1) & mask;
+    }
+
+    // shift back the following entries that would become unreachable through the hole
+    uint32_t hole = index;
+    uint32_t next = (hole + 1) & mask;
+    while(table->slots[next].remote)
+    {
+        const uint32_t home = table->slots[next].hash & mask;
+        // move it unless its home lies cyclically in (hole, next]
+        const bool reachable = (hole <= next) ? (hole < home && home <= next) : (hole < home || home <= next);
+        if (!reachable)
+        {
+            table->slots[hole] = table->slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    table->slots[hole].remote = NULL;
+    table->count--;
+}
+
+// vpn addresses are handed out as the address block with the remote id as last octet
+// so the id is also the slot in the direct index (TODO ipV4 only like the allocation)
+bool peer_host_index(Peer* peer, const struct sockaddr_storage* address, uint32_t* index)
+{
+    const struct sockaddr_storage* block = &peer->owner->tunnel_address_block;
+    if (address->ss_family != AF_INET || block->ss_family != AF_INET)
+        return false;
+
+    const uint32_t host = ntohl(((const struct sockaddr_in*)address)->sin_addr.s_addr);
+    const uint32_t network = ntohl(((const struct sockaddr_in*)block)->sin_addr.s_addr);
+    if ((host & 0xFFFFFF00) != (network & 0xFFFFFF00))
+        return false;
+
+    *index = host & 0xFF;
+    return true;
+}
+
+// the caller must hold the lock exclusively
+bool peer_insert_host(Peer* peer, RemotePeer* remote)
+{
+    struct sockaddr_storage vpn_address;
+    address_expand(&vpn_address, &remote->vpn_address);
+
+    uint32_t index;
+    if (!peer_host_index(peer, &vpn_address, &index))
+        return false;
+
+    peer->owner->remote_hosts[index] = remote;
+
+    StatsPage* page = peer->owner->stats.page;
+    if (page && remote->stats > 0)
+    {
+        page->remotes[remote->stats].id = remote->id;
+        compact_address_to_string(&remote->vpn_address, page->remotes[remote->stats].vpn_address, sizeof(page->remotes[0].vpn_address));
+    }
+    return true;
+}
+
+// the caller must hold the lock exclusively
+void peer_remove_host(Peer* peer, RemotePeer* remote)
+{
+    struct sockaddr_storage vpn_address;
+    address_expand(&vpn_address, &remote->vpn_address);
+
+    uint32_t index;
+    if (peer_host_index(peer, &vpn_address, &index) && peer->owner->remote_hosts[index] == remote)
+        peer->owner->remote_hosts[index] = NULL;
+}
+
+// the remote peers without a slot share the first one
+StatsCounters* peer_remote_counters(Peer* peer, const RemotePeer* remote)
+{
+    return &peer->owner->stats.page->remotes[remote->stats].counters;
+}
+
+// the caller must hold the lock
+RemotePeer* peer_find_remote(Peer* peer, struct sockaddr_storage* address, const bool real)
+{
+    if (real)
+    {
+        const RemoteTable* table = &peer->owner->remote_table;
+        if (table->count == 0)
+            return NULL;
+
+        const uint32_t hash = address_hash(address);
+        const uint32_t mask = table->capacity - 1;
+        for (uint32_t index = hash & mask; table->slots[index].remote; index = (index + 1) & mask)
+        {
+            const RemoteSlot* slot = &table->slots[index];
+            if (slot->hash == hash && compact_address_equal(&slot->remote->real_address, address))
+                return slot->remote;
+        }
+        return NULL;
+    }
+
+    // a single indexed load to route the tunnel packets
+    uint32_t index;
+    if (!peer_host_index(peer, address, &index))
+        return NULL;
+    return peer->owner->remote_hosts[index];
+}
+
+// reconnecting clients come from addresses nobody knows, only their id tells who they are
+RemotePeer* peer_find_remote_id(Peer* peer, const uint8_t id)
+{
+    RemotePeer* remote = peer->owner->remote_peers;
+    while (remote && remote->id != id)
+        remote = remote->next;
+    return remote;
+}
+
+bool peer_initialize2(Peer* peer, const VPNMode mode, const struct sockaddr_storage* address, const TunnelBackendType backend, const char* interface, const bool offload, const bool multi_queue)
 {
     if (!peer)
         return false;
@@ -122,15 +455,24 @@ bool peer_initialize2(Peer* peer, const VPNMode mode, const struct sockaddr_stor
     peer->mode = mode;
 
      // create an apropiate socket
-    if (!socket_open(&peer->socket, address->ss_family == AF_INET6, true))
+    if (!socket_open(&peer->socket, address->ss_family == AF_INET6, true, true))
+        return false;
+
+    // coalesced reads need room for several messages in each slot
+    if (peer->socket.gro && !peer_allocate_recv_slots(peer, SOCKET_GRO_BUFFER_SIZE))
         return false;
 
     // mark sent packets as 'SEC__POC' for later use in routing
-    if (!socket_set_mark(&peer->socket, 0x5EC0070C))
+    // only a real device can loop them back, and the other backends run without privileges
+    if (backend == TB_Tun && !socket_set_mark(&peer->socket, 0x5EC0070C))
+        return false;
+
+    // the worker sockets will share the same local address
+    if (multi_queue && !socket_set_reuse_port(&peer->socket))
         return false;
 
     // create the requested tunnel
-    if (!tunnel_open(&peer->tunnel, interface ))
+    if (!tunnel_open(&peer->tunnel, backend, interface, offload, multi_queue))
         return false;
 
     // set the tunnel mtu to just enough for the payload with no headers
@@ -139,13 +481,46 @@ bool peer_initialize2(Peer* peer, const VPNMode mode, const struct sockaddr_stor
     return true;
 }
 
+// creates a worker servicing a new queue of the owner tunnel through its own socket
+Peer* peer_create_worker(Peer* owner, const struct sockaddr_storage* address)
+{
+    Peer* worker = peer_create(protocol_max_payload(owner));
+    if (!worker)
+        return NULL;
+
+    worker->mode = owner->mode;
+    worker->owner = owner;
+    worker->tunnel_address_block = owner->tunnel_address_block;
+    worker->tunnel_local_address = owner->tunnel_local_address;
+    worker->tunnel_remote_address = owner->tunnel_remote_address;
+
+    bool ok = socket_open(&worker->socket, address->ss_family == AF_INET6, true, true)
+        && (!worker->socket.gro || peer_allocate_recv_slots(worker, SOCKET_GRO_BUFFER_SIZE))
+        && (!tunnel_has_device(&owner->tunnel) || socket_set_mark(&worker->socket, 0x5EC0070C))
+        && socket_set_reuse_port(&worker->socket)
+        && tunnel_open_queue(&worker->tunnel, &owner->tunnel);
+
+    // clients bind the workers to the same port once the owner connects
+    if (ok && worker->mode == VPNMode_Server)
+        ok = socket_bind(&worker->socket, address);
+
+    if (!ok)
+    {
+        peer_destroy(worker);
+        return NULL;
+    }
+
+    return worker;
+}
+
 bool peer_initialize(Peer* peer, const StartupOptions* options)
 {
     if (!peer || !options || options->mode == VPNMode_None)
         return false;
 
     
-    if (!peer_initialize2(peer, options->mode, &options->address, options->interface))
+    const uint32_t queues = options->queues > 0 ? options->queues : 1;
+    if (!peer_initialize2(peer, options->mode, &options->address, (TunnelBackendType)options->backend, options->interface, options->offload, queues > 1))
         return false;
 
     if (peer->mode == VPNMode_Server)
@@ -154,6 +529,34 @@ bool peer_initialize(Peer* peer, const StartupOptions* options)
             return false;
     }
 
+    // compression offered in the handshakes
+    peer->compression = options->compress ? CP_LZ : CP_None;
+
+    // encryption is mandatory with a pre-shared key and never used without one
+    if (options->key_file[0] != '\0')
+    {
+        if (!cipher_read_key(options->key_file, peer->key))
+            return false;
+        peer->cipher = CI_ChaCha20Poly1305;
+    }
+
+    // pacing, both buckets start full
+    pacing_rate_init(&peer->remote_rate, options->rate, options->burst, peer->buffer_size);
+    pacing_rate_init(&peer->total_rate, options->total_rate, options->burst, peer->buffer_size);
+
+    // counters published for vpn-stats, each queue thread writes its own set
+    if (!stats_open(&peer->stats, peer->tunnel.if_name, peer->mode, queues))
+        return false;
+    peer->counters = &peer->stats.page->queues[0];
+    latency_probe_init(&peer->latency, peer->stats.page->latency[0], &peer->stats.page->latency_sampling);
+
+    // integrity checksum offered first in the handshakes
+    if (options->checksum[0] != '\0' && !checksum_from_name(options->checksum, &peer->checksum))
+    {
+        printf("%s: unknown checksum %s\n", __func__, options->checksum);
+        return false;
+    }
+
     // set default or specified local and remote addresses
     struct sockaddr_storage address;
     memcpy(&address, &options->tunnel_address, sizeof(options->tunnel_address));
@@ -193,6 +596,39 @@ bool peer_initialize(Peer* peer, const StartupOptions* options)
     peer->next_id = 3;
     peer->total_ids = 252;
 
+    // one worker per extra tunnel queue
+    for (uint32_t i = 1; i < queues && i < PEER_MAX_QUEUES; i++)
+    {
+        Peer* worker = peer_create_worker(peer, &options->address);
+        if (!worker)
+        {
+            printf("%s: failed to create the worker for queue %u\n", __func__, i);
+            return false;
+        }
+        worker->counters = &peer->stats.page->queues[i];
+        latency_probe_init(&worker->latency, peer->stats.page->latency[i], &peer->stats.page->latency_sampling);
+        peer->workers[peer->worker_count++] = worker;
+    }
+
+    // crypto threads for every queue
+    for (uint32_t i = 0; i <= peer->worker_count && options->crypto_threads > 0; i++)
+    {
+        Peer* target = (i == 0) ? peer : peer->workers[i - 1];
+        target->pipeline = pipeline_create(target, options->crypto_threads);
+        if (!target->pipeline)
+        {
+            printf("%s: failed to start the crypto threads for queue %u\n", __func__, i);
+            return false;
+        }
+    }
+
+    // keep every client on the same socket shard so its session stays on one thread
+    if (peer->mode == VPNMode_Server && peer->worker_count > 0)
+    {
+        if (!socket_set_steering(&peer->socket, peer->worker_count + 1))
+            return false;
+    }
+
     return true;
 }
 
@@ -217,18 +653,35 @@ bool peer_connect(Peer* peer, const struct sockaddr_storage* address)
     if (!socket_connect(&peer->socket, address))
         return false;
 
+    // workers send from the same port so the server sees a single client
+    if (peer->worker_count > 0)
+    {
+        struct sockaddr_storage local_address;
+        if (!socket_get_local_address(&peer->socket, &local_address))
+            return false;
+
+        for (uint32_t i = 0; i < peer->worker_count; i++)
+        {
+            Socket* worker_socket = &peer->workers[i]->socket;
+            if (!socket_bind(worker_socket, &local_address) || !socket_connect(worker_socket, address))
+                return false;
+        }
+    }
+
     // create a remote peer representing the server
-    RemotePeer* remote_peer = remotepeer_create();
-    assert(remote_peer);
+    clock_refresh(&peer->clock);
+    RemotePeer* remote_peer = remotepeer_create(peer);
+    if (!remote_peer)
+        return false;
 
     remote_peer->state = PS_Handshaking;
-    remote_peer->real_address = *address;
-    remote_peer->last_recv_time = get_current_timestamp();
+    address_compact(&remote_peer->real_address, address);
+    remote_peer->last_recv_time = peer->clock.ms;
     assert(remote_peer->last_recv_time != 0);
 
     // first and only remote peer in the client list
     peer->remote_peers = remote_peer;
-    return true;
+    return peer_insert_remote(peer, remote_peer);
 }
 
 bool peer_enable(Peer* peer, const bool enabled)
@@ -239,91 +692,261 @@ bool peer_enable(Peer* peer, const bool enabled)
     return enabled ? tunnel_up(&peer->tunnel) : tunnel_down(&peer->tunnel);
 }
 
-void peer_check_connections(Peer* peer)
+// runs when the timer of the remote peer goes off and sets the next one
+// messages don't move the timer, the time of the last one is checked here instead
+bool peer_check_remote(Peer* peer, RemotePeer* remote, const uint64_t now)
 {
-    const uint64_t now = get_current_timestamp();
-    RemotePeer* remote = peer->remote_peers;
-    while(remote)
+    bool ok = true;
+    uint64_t next = now + DEFAULT_CONNECTION_TIMEOUT;
+
+    if (remote->state == PS_Connected)
     {
         const uint64_t elapsed = now - remote->last_recv_time;
 
-        if (remote->state == PS_Connected)
+        // disconnect all the remote peers that stay silent too long
+        if (elapsed > DEFAULT_CONNECTION_TIMEOUT)
         {
-            // disconnect all the remote peers that stay silent too long
-            if (elapsed > DEFAULT_CONNECTION_TIMEOUT)
-            {
-                printf("disconnecting peer because of timeout\n");
-                protocol_disconnect_request(peer, remote);
-                remote->state = PS_Disconnected;
-            }
+            printf("disconnecting peer because of timeout\n");
+            stats_add(peer->counters, SC_Timeouts, 1);
+            stats_add_shared(peer_remote_counters(peer, remote), SC_Timeouts, 1);
+            protocol_disconnect_request(peer, remote);
+            remote->state = PS_Disconnected;
+        }
+        else
+        {
+            next = remote->last_recv_time + DEFAULT_CONNECTION_TIMEOUT + 1;
 
             // use pings to keep alive the connection (from clients only)
-            if (elapsed > DEFAULT_KEEPALIVE_TIMEOUT)
+            if (peer->mode == VPNMode_Client)
             {
-                const uint64_t last_sent = now - remote->last_ping_time;
-                // disabled because requests without answer will trigger the timeout
-                if (last_sent > DEFAULT_KEEPALIVE_TIMEOUT)
+                if (elapsed > DEFAULT_KEEPALIVE_TIMEOUT && now - remote->last_ping_time > DEFAULT_KEEPALIVE_TIMEOUT)
                 {
-                    if (peer->mode == VPNMode_Client)
-                        protocol_ping_request(peer, remote);
-
+                    protocol_ping_request(peer, remote);
                     remote->last_ping_time = now;
                 }
+
+                // the next one if it stays silent
+                const uint64_t last = remote->last_recv_time > remote->last_ping_time ? remote->last_recv_time : remote->last_ping_time;
+                if (last + DEFAULT_KEEPALIVE_TIMEOUT + 1 < next)
+                    next = last + DEFAULT_KEEPALIVE_TIMEOUT + 1;
             }
         }
+    }
 
-        // remove remote peers flagged for disconnection on the server
-        // try to reconnect from scratch on the client
-        if (remote->state == PS_Disconnected)
+    // remove remote peers flagged for disconnection on the server
+    // try to reconnect from scratch on the client
+    if (remote->state == PS_Disconnected)
+    {
+        if (peer->mode != VPNMode_Client)
         {
-            if (peer->mode == VPNMode_Client)
-            {
-                remote->state = PS_Handshaking;
-            }
-            else
-            {
-                printf("removing disconnected peer\n");
-                RemotePeer* old = remote;
-                remote = remotepeer_destroy(remote);
+            printf("removing disconnected peer\n");
+            const bool first = (remote == peer->remote_peers);
+            RemotePeer* following = remotepeer_destroy(peer, remote);
+            if (first)
+                peer->remote_peers = following;
+            return true;
+        }
 
-                if (old == peer->remote_peers)
-                    peer->remote_peers = remote;
+        remote->state = PS_Handshaking;
+    }
 
-                continue;
-            }
-        }
-        remote = remote->next;
+    // handshake the server until it succeeds
+    if (remote->state == PS_Handshaking && peer->mode == VPNMode_Client)
+    {
+        if (now - remote->last_send_time > DEFAULT_RELIABLE_RETRY)
+            ok = protocol_handshake_request(peer, remote);
+        next = remote->last_send_time + DEFAULT_RELIABLE_RETRY + 1;
     }
+
+    timer_schedule(&peer->owner->timers, &remote->cold->timer, next);
+    return ok;
 }
 
-bool peer_service(Peer* peer)
+// manage timeouts, disconnections and handshake retries
+// only the owner manages them, workers just move packets
+bool peer_service_timers(Peer* peer)
 {
     if (!peer)
         return false;
 
-    // manage timeouts and disconnections
-    peer_check_connections(peer);
+    if (peer->owner != peer)
+        return true;
 
-    if (peer->mode == VPNMode_Client)
+    bool ok = true;
+    peer_lock(peer, true);
+
+    // only the remote peers whose timer went off
+    clock_refresh(&peer->clock);
+    const uint64_t now = peer->clock.ms;
+    TimerNode* expired = NULL;
+    timer_wheel_advance(&peer->timers, now, &expired);
+    while (expired)
     {
-        // handshake the server until it succeeds
-        if (peer->remote_peers && peer->remote_peers->state == PS_Handshaking)
+        TimerNode* node = expired;
+        timer_cancel(&peer->timers, node);
+        ok = peer_check_remote(peer, (RemotePeer*)node->data, now) && ok;
+    }
+
+    peer_unlock(peer);
+    return ok;
+}
+
+// handle the unpacked message currently in the receive buffer
+bool peer_handle_message(Peer* peer, RemotePeer* remote, struct sockaddr_storage* new_remote)
+{
+    // clients cannot receive messages from unknown sources
+    assert(remote || peer->mode == VPNMode_Server);
+
+    // this means unpacking the message failed
+    if (peer->recv_length == 0)
+        return true;
+
+    MsgType type = protocol_read_type(peer->recv_buffer, peer->recv_length);
+    if (peer->recv_length < protocol_get_message_size(type))
+        return true; // non-fatal, just ignore the message
+
+    if (!remote)
+    {
+        if (type != MT_ClientHandshake && type != MT_ClientReconnect)
+        {
+            printf("%s: invalid message [%s] received from unknown peer\n", __func__, protocol_get_type_text(type));
+            return true; // non-fatal, continue reading
+        }
+
+        // new and reconnecting peers modify the shared list
+        // another thread may have handled a message from the same address in the meantime
+        if (peer_lock_exclusive(peer, new_remote))
+        {
+            peer_unlock(peer);
+            peer_lock(peer, false);
+            return true;
+        }
+
+        bool ok = (type == MT_ClientHandshake)
+            ? protocol_handshake_client(peer, new_remote)
+            : protocol_reconnect_client(peer, new_remote);
+
+        peer_unlock(peer);
+        peer_lock(peer, false);
+        return ok;
+    }
+
+#if DEBUG
+    char remote_text[256];
+    compact_address_to_string(&remote->real_address, remote_text, sizeof(remote_text));
+    printf_debug("[%s] %s: received message [%s] from %s\n", 
+        peer->mode == VPNMode_Server ? "server" : "client", 
+        __func__, protocol_get_type_text(type), remote_text );
+#endif
+
+    bool ok = true;
+    switch(type)
+    {
+    case MT_Disconnect:
+        // its timer moves, and once the lock is dropped again the timers can destroy it
+        // so it can't be touched after that
+        remote = peer_lock_exclusive(peer, new_remote);
+        if (remote)
+            ok = protocol_disconnect(peer, remote);
+        peer_unlock(peer);
+        peer_lock(peer, false);
+        return ok;
+    case MT_ServerHandshake:
+        // the session key changes under the workers
+        remote = peer_lock_exclusive(peer, new_remote);
+        if (remote)
         {
-            const uint64_t now = get_current_timestamp();
-            if (now - peer->remote_peers->last_send_time > DEFAULT_RELIABLE_RETRY)
+            ok = protocol_handshake_server(peer, remote);
+            remote->last_recv_time = peer->clock.ms;
+        }
+        peer_unlock(peer);
+        peer_lock(peer, false);
+        return ok;
+    case MT_ServerReconnect:
+        ok = protocol_reconnect_server(peer, remote);
+        break;
+    case MT_Data:
+        protocol_data_receive(peer, remote); // non-fatal
+        break;
+    case MT_Ping:
+    case MT_Pong:
+        ok = protocol_ping(peer, remote);
+        break;
+    default:
+        printf("%s: invalid message [%s] received from known peer\n", __func__, protocol_get_type_text(type));
+        return true; // non-fatal, continue reading
+    }
+
+    // update the last received message timestamp
+    remote->last_recv_time = peer->clock.ms;
+    return ok;
+}
+
+// handle every message of the received batch, the caller must hold the lock
+bool peer_handle_batch(Peer* peer)
+{
+    bool ok = true;
+    MsgBatch* batch = &peer->recv_batch;
+
+    // a lone message isn't worth the trip to the crypto threads
+    if (peer->pipeline && (batch->count > 1 || batch->segments[0] > 0))
+        pipeline_open_batch(peer->pipeline, peer, batch);
+
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        // coalesced datagrams carry several messages of the same size (the last one may be shorter)
+        const uint32_t segment = batch->segments[i] > 0 ? batch->segments[i] : batch->lengths[i];
+        uint32_t index = 0;
+        for (uint32_t offset = 0; offset < batch->lengths[i]; offset += segment, index++)
+        {
+            const uint32_t remaining = batch->lengths[i] - offset;
+            const uint32_t length = remaining < segment ? remaining : segment;
+
+            RemotePeer* remote = NULL;
+            struct sockaddr_storage new_remote;
+            const bool opened = index < PIPELINE_MAX_SEGMENTS && (batch->opened[i] >> index) & 1;
+            protocol_unpack(peer, batch->buffers[i] + offset, length, &batch->addresses[i], opened, &remote, &new_remote);
+
+            ok = peer_handle_message(peer, remote, &new_remote);
+
+            // wipe the uncompressed copy if there was one
+            if (peer->inflate->used > 0)
+                peer->inflate = packet_recycle(&peer->recv_pool, peer->inflate);
+
+            if (!ok)
             {
-                if (!protocol_handshake_request(peer, peer->remote_peers))
-                    return false;
+                printf_debug("%s: error handling a message", __func__);
+                break;
             }
         }
+
+        if (!ok)
+            break;
+    }
+
+    // every received packet goes back to the pool (and gets wiped)
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        packet_release(&peer->recv_pool, batch->packets[i]);
+        batch->packets[i] = NULL;
     }
+    batch->count = 0;
+    peer->recv_buffer = NULL;
+    peer->recv_length = 0;
+
+    return ok;
+}
+
+// read and handle pending messages from the socket
+bool peer_service_socket(Peer* peer)
+{
+    if (!peer)
+        return false;
 
     uint32_t processed_socket_messages = 0;
     do {
-        // read messages from known and unknown peers
-        RemotePeer* remote = NULL;
-        struct sockaddr_storage new_remote;
-        SocketResult ret = protocol_receive(peer, &remote, &new_remote);
+        // read a batch of messages from known and unknown peers
+        SocketResult ret = protocol_receive(peer);
 
         if (ret == SR_Error)
         {
@@ -334,137 +957,196 @@ bool peer_service(Peer* peer)
         if (ret == SR_Pending)
             break; // no more data to read
 
-        if (ret == SR_Success)
-        {
-            // clients cannot receive messages from unknown sources
-            assert(remote || peer->mode == VPNMode_Server);
-
-            // this means unpacking the message failed
-            if (peer->recv_length == 0)
-                continue;
-
-            MsgType type = protocol_read_type(peer->recv_buffer, peer->recv_length);
-            if (peer->recv_length < protocol_get_message_size(type))
-                continue; // non-fatal, just ignore the message
-           
-            bool ok = true;
-            if (!remote)
-            {
-                switch(type)
-                {
-                case MT_ClientHandshake:
-                    ok = protocol_handshake_client(peer, &new_remote);
-                    break;
-                case MT_ClientReconnect:
-                    ok = protocol_reconnect_client(peer, &new_remote);
-                    break;
-                default:
-                    printf("%s: invalid message [%s] received from unknown peer\n", __func__, protocol_get_type_text(type));
-                    continue; // non-fatal, continue reading
-                }
-            }
-            else
-            {
-#if DEBUG
-            char remote_text[256];
-            address_to_string(&remote->real_address, remote_text, sizeof(remote_text));
-            printf_debug("[%s] %s: received message [%s] from %s\n", 
-                peer->mode == VPNMode_Server ? "server" : "client", 
-                __func__, protocol_get_type_text(type), remote_text );
-#endif
+        // the whole batch arrived at the same time
+        clock_refresh(&peer->clock);
+        const uint32_t count = peer->recv_batch.count;
+        peer_lock(peer, false);
+        bool ok = peer_handle_batch(peer);
+        peer_unlock(peer);
 
-                switch(type)
-                {
-                case MT_Disconnect:
-                    ok = protocol_disconnect(peer, remote);
-                    break;
-                case MT_ServerHandshake:
-                    ok = protocol_handshake_server(peer, remote);
-                    break;
-                case MT_ServerReconnect:
-                    ok = protocol_reconnect_server(peer, remote);
-                    break;
-                case MT_Data:
-                    protocol_data_receive(peer, remote); // non-fatal
-                    break;
-                case MT_Ping:
-                case MT_Pong:
-                    ok = protocol_ping(peer, remote);
-                    break;
-                default:
-                    printf("%s: invalid message [%s] received from known peer\n", __func__, protocol_get_type_text(type));
-                    continue; // non-fatal, continue reading
-                }
+        // write the TCP segments coalesced while processing the batch
+        tunnel_flush(&peer->tunnel);
 
-                // update the last received message timestamp
-                remote->last_recv_time = get_current_timestamp();
-            }
+        if (!ok)
+            return false;
 
-            // clear buffer after processing for privacy
-            memset(peer->recv_buffer, 0, peer->buffer_size);
-            peer->recv_length = 0;
+        processed_socket_messages += count;
+    } while(processed_socket_messages < 100);
 
-            if (!ok)
-            {
-                printf_debug("%s: error handling a message", __func__);
-                return false;
-            }
-        }
+    return true;
+}
 
-        processed_socket_messages++;
-    } while(processed_socket_messages < 100);
+// queues the packets the crypto threads finished packing, in the order they were read
+// and flushes every full batch, waiting for all of them if asked to
+// or for the next one when the pipeline is full, so another packet can always be sealed after it
+bool peer_queue_sealed(Peer* peer, const bool wait)
+{
+    bool ok = true;
+    Packet* packet = NULL;
+    while((packet = pipeline_sealed(peer->pipeline, wait || pipeline_full(peer->pipeline))) != NULL)
+    {
+        protocol_data_batch(peer, packet);
+        if (peer->send_batch.count == PEER_BATCH_SIZE)
+            ok = protocol_flush(peer) && ok;
+    }
+    return ok;
+}
+
+// read outgoing packets from the tunnel and send them to the remote peers
+bool peer_service_tunnel(Peer* peer)
+{
+    if (!peer)
+        return false;
+
+    bool ok = true;
+    peer_lock(peer, false);
+    clock_refresh(&peer->clock);
 
     uint32_t processed_tunnel_messages = 0;
     do {
-        // read outgoing data from the tunnel
+        // read outgoing data from the tunnel into a free packet
+        // after the headroom so the header can be composed in front of it
+        Packet* packet = packet_acquire(&peer->send_pool);
+        if (!packet && peer->pipeline)
+        {
+            // every packet is either in flight or in the batch
+            ok = peer_queue_sealed(peer, true) && protocol_flush(peer);
+            packet = packet_acquire(&peer->send_pool);
+        }
+        if (!packet)
+        {
+            ok = false;
+            break;
+        }
+
         uint32_t read = protocol_max_payload(peer);
-        // leave room for the header
-        uint8_t* buffer = peer->send_buffer + sizeof(MsgHeader);
+        uint8_t* buffer = packet_payload(&peer->send_pool, packet);
+        latency_sample(&peer->latency);
+        const uint64_t start = latency_start(&peer->latency);
         if (!tunnel_read(&peer->tunnel, buffer, &read))
+        {
+            peer->latency.timing = false;
+            packet_release(&peer->send_pool, packet);
             break; // no more data to read
+        }
+        latency_stage(&peer->latency, LS_TunnelRead, start);
+        packet_set_length(packet, sizeof(MsgHeader) + read);
 
+        processed_tunnel_messages++;
+
+        RemotePeer* remote = NULL;
         // blackhole the tunnel data if there are not remote peers available
-        if (!peer->remote_peers)
+        if (!peer->owner->remote_peers)
+        {
+            stats_add(peer->counters, SC_Blackholed, 1);
+            packet_release(&peer->send_pool, packet);
             continue;
+        }
 
-        RemotePeer* remote = NULL;
         if (peer->mode == VPNMode_Server)
         {
             // find the appropiate peer to send the data
             struct sockaddr_storage destination;
-            if (!protocol_get_destination(buffer, read, &destination))
+            CLEAR(destination);
+            if (protocol_get_destination(buffer, read, &destination))
             {
-                printf_debug("%s: failed to read packet destination\n", __func__);
-                continue;
+                remote = peer_find_remote(peer, &destination, false );
+#if DEBUG
+                if (!remote)
+                {
+                    char dst_text[256];
+                    address_to_string(&destination, dst_text, sizeof(dst_text));
+                    printf_debug("%s: packet targeted to a non-existant peer (%s)\n", __func__, dst_text);
+                }
+#endif
             }
-
-            remote = peer_find_remote(peer, &destination, false );
-            if (!remote)
+            else
             {
-                char dst_text[256];
-                address_to_string(&destination, dst_text, sizeof(dst_text));
-                printf_debug("%s: packet targeted to a non-existant peer (%s)\n", __func__, dst_text);
-                continue;
+                printf_debug("%s: failed to read packet destination\n", __func__);
             }
         }
         else
         {
-            remote = peer->remote_peers; // the server
+            remote = peer->owner->remote_peers; // the server
         }
 
         // don't send data if the connection is not fully established
-        if (remote->state != PS_Connected)
+        if (!remote || remote->state != PS_Connected)
+        {
+            stats_add(peer->counters, SC_Blackholed, 1);
+            packet_release(&peer->send_pool, packet);
             continue;
+        }
+
+        // only used if it has to wait in the send queues, but the payload is still readable here
+        packet->flow = protocol_send_flow(buffer, read);
 
-        // send tunnel data through the socket
-        peer->send_length = read + sizeof(MsgHeader);
-        if (!protocol_data_send(peer, remote))
+        if (peer->pipeline)
         {
-            printf_debug("%s: error on protocol_data_send", __func__);
-            return false;
+            // packed by the crypto threads meanwhile the next ones are read
+            packet->remote = remote;
+            pipeline_seal(peer->pipeline, packet);
+            ok = peer_queue_sealed(peer, false);
+            continue;
         }
-        processed_tunnel_messages++;
-    } while(processed_tunnel_messages < 100);
-    
-    return true;
+
+        // queue tunnel data to be sent through the socket
+        protocol_data_queue(peer, remote, packet);
+
+        // send the whole batch at once when there are no free slots left
+        if (peer->send_batch.count == PEER_BATCH_SIZE)
+            ok = protocol_flush(peer);
+    } while(ok && (processed_tunnel_messages < 100 || tunnel_has_pending(&peer->tunnel)));
+
+    // nothing can stay in flight once the lock is released
+    if (peer->pipeline)
+        ok = peer_queue_sealed(peer, true) && ok;
+
+    // send whatever is left in the batch
+    ok = protocol_flush(peer) && ok;
+    peer_unlock(peer);
+
+    if (!ok)
+        printf_debug("%s: error on protocol_flush", __func__);
+
+    return ok;
 }
+
+// sends what waits in the send queues once the socket has room again or the paced messages can go
+bool peer_service_queues(Peer* peer)
+{
+    if (!peer)
+        return false;
+
+    // the drain finds out if it is still full
+    peer->send_blocked = false;
+    if (peer->send_queued == 0)
+    {
+        peer->send_wakeup = 0;
+        return true;
+    }
+
+    peer_lock(peer, false);
+    clock_refresh(&peer->clock);
+    const bool ok = protocol_drain(peer);
+    peer_unlock(peer);
+    return ok;
+}
+
+// once the send queues are full the tunnel isn't read until they drain
+// the packets wait in the device queue instead of being read just to be dropped
+bool peer_tunnel_paused(Peer* peer)
+{
+    return peer->send_queued >= PEER_SEND_QUEUED;
+}
+
+bool peer_service(Peer* peer)
+{
+    if (!peer)
+        return false;
+
+    return peer_service_timers(peer)
+        && peer_service_queues(peer)
+        && peer_service_socket(peer)
+        && (peer_tunnel_paused(peer) || peer_service_tunnel(peer));
+}
\ No newline at end of file
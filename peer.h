@@ -11,6 +11,17 @@
 #define DEFAULT_KEEPALIVE_TIMEOUT (2 * 1000)
 #define DEFAULT_CONNECTION_TIMEOUT (10 * 1000)
 #define DEFAULT_RELIABLE_RETRY (1 * 1000)
+#define PEER_BATCH_SIZE 32
+#define PEER_MAX_QUEUES 64
+#define PEER_MAX_CRYPTO_THREADS 16 // per queue
+#define PIPELINE_MAX_SEGMENTS 64 // coalesced messages decrypted by the crypto threads per packet (the GRO limit)
+#define REMOTE_TABLE_MIN_CAPACITY 64 // power of two
+#define PEER_MAX_HOSTS 256 // one per possible remote id
+#define PEER_COMPRESS_FLOWS 256 // power of two
+#define PEER_SEND_QUEUE_DEPTH 64 // messages waiting for the socket per remote peer
+#define PEER_SEND_QUEUED 256 // messages waiting for the socket in all the queues of a peer
+
+STATIC_ASSERT(PEER_MAX_QUEUES <= STATS_MAX_QUEUES, every_queue_has_counters);
 
 /* remote peer data */
 
@@ -24,39 +35,156 @@ typedef enum {
 struct remote_peer_t;
 typedef struct remote_peer_t RemotePeer;
 
+// rarely used state, kept apart so the hot records stay small
+typedef struct {
+    uint64_t secret; // for reconnection
+    uint32_t rtt; // microseconds
+
+    // session key, derived from the pre-shared one during the handshake
+    uint8_t key[CIPHER_KEY_SIZE];
+    uint8_t salt[CIPHER_SALT_SIZE]; // local half of the handshake in progress
+    uint64_t nonce; // next one to send
+    CipherReplay replay; // counters already received
+
+    TimerNode timer; // next keepalive, timeout or handshake retry, in the owner wheel
+    TokenBucket pacing; // shared by the queue threads sending to it
+} RemotePeerCold;
+
+// fields touched for every packet and every timer tick (two cache lines)
 struct remote_peer_t {
-    uint8_t id;
     PeerState state;
-    uint64_t secret; // for reconnection
-    struct sockaddr_storage real_address;
-    struct sockaddr_storage vpn_address;
-    uint32_t rtt;
+    ChecksumType checksum; // negotiated for the data messages
+    uint8_t id;
+    uint8_t stats; // slot in the stats page, zero if it has none
+    CompressionType compression; // negotiated for the data messages
+    CipherType cipher; // negotiated for everything but the handshakes
     uint64_t last_recv_time;
     uint64_t last_send_time;
     uint64_t last_ping_time;
-
-    // encryption stuff (placeholder)
-    void* cipher;
-    uint8_t* key;
+    CompactAddress real_address;
+    CompactAddress vpn_address;
 
     // linked list members
     RemotePeer* prev;
     RemotePeer* next;
+
+    RemotePeerCold* cold;
+} __attribute__((aligned(64)));
+
+// remote peers are carved from chunks instead of allocated one by one
+// the free ones are chained through their 'next' member
+#define REMOTE_SLAB_CHUNK 256
+
+struct remote_chunk_t;
+typedef struct remote_chunk_t RemoteChunk;
+
+struct remote_chunk_t {
+    RemoteChunk* next;
+    RemotePeer* hot; // REMOTE_SLAB_CHUNK records each
+    RemotePeerCold* cold;
+};
+
+typedef struct {
+    RemoteChunk* chunks;
+    RemotePeer* free_list;
+} RemoteSlab;
+
+// open addressing table to find remote peers by their real address
+// linear probing with backward shift deletion, kept at most half full
+typedef struct {
+    uint32_t hash;
+    RemotePeer* remote; // NULL if empty
+} RemoteSlot;
+
+typedef struct {
+    RemoteSlot* slots;
+    uint32_t capacity;
+    uint32_t count;
+} RemoteTable;
+
+// adaptive skip: flows that don't compress well are left alone for a while
+typedef struct {
+    uint8_t misses; // poor ratios in a row
+    uint8_t skip; // messages left to send raw
+    uint8_t backoff; // next skip length, doubles every time
+} CompressFlow;
+
+// packed messages waiting for room in the socket, one queue per remote peer in each peer (socket)
+// the queues with messages take turns in a round robin so a congested remote can't hold back the rest
+// and inside each one the flows of the remote share it with fq_codel (codel.c)
+struct send_queue_t;
+typedef struct send_queue_t SendQueue;
+
+struct send_queue_t {
+    FlowQueue flows;
+    RemotePeer* remote; // of the messages in it
+    bool active; // in the round robin
+    SendQueue* next; // in the round robin
 };
 
 /* peer data */
 
+// messages moved through the socket with a single syscall
+// the buffers point into the packets, the other arrays are the syscall vectors
 typedef struct {
+    uint32_t count;
+    Packet* packets[PEER_BATCH_SIZE];
+    uint8_t* buffers[PEER_BATCH_SIZE];
+    uint32_t lengths[PEER_BATCH_SIZE];
+    uint32_t segments[PEER_BATCH_SIZE]; // size of each coalesced message (GRO)
+    uint64_t opened[PEER_BATCH_SIZE]; // coalesced messages already decrypted by the crypto threads, one bit each
+    struct sockaddr_storage addresses[PEER_BATCH_SIZE];
+} MsgBatch;
+
+struct peer_t;
+typedef struct peer_t Peer;
+
+// crypto threads packing and decrypting the data messages of a peer (pipeline.c)
+struct pipeline_t;
+typedef struct pipeline_t Pipeline;
+
+struct peer_t {
     VPNMode mode;
     Tunnel tunnel;
     Socket socket;
 
     uint32_t buffer_size;
+    // recv_buffer points to the message being processed inside a received packet
     uint8_t* recv_buffer;
     uint32_t recv_length;
+    // send_buffer is the control packet messages are composed in
     uint8_t* send_buffer;
     uint32_t send_length;
+    Packet* control;
+    Packet* deflate; // scratch for compressing data messages
+    Packet* inflate; // decompressed message, recv_buffer points here while it is handled
+    PacketPool recv_pool; // bigger buffers with GRO
+    PacketPool send_pool; // tunnel data and control messages
+    MsgBatch recv_batch;
+    MsgBatch send_batch;
+    SendQueue* send_queues[PEER_MAX_HOSTS]; // by remote id, allocated when first needed
+    SendQueue* send_active; // round robin of the queues with messages
+    SendQueue* send_active_tail;
+    uint32_t send_active_count;
+    uint32_t send_queued; // messages in every queue
+    bool send_blocked; // the socket is full, waiting for room
+    uint64_t send_wakeup; // microseconds, when paced messages can go, 0 if none wait for it
     RemotePeer* remote_peers;
+    RemoteSlab remote_slab; // where remote_peers live
+    RemoteTable remote_table; // indexes remote_peers by real address
+    RemotePeer* remote_hosts[PEER_MAX_HOSTS]; // indexes remote_peers by vpn address host id
+    TimerWheel timers; // of the remote peers, only used on the owner
+
+    // rates the messages are paced at, only used on the owner
+    PacingRate remote_rate; // to every remote peer
+    PacingRate total_rate; // to all of them together
+    TokenBucket total;
+
+    ChecksumType checksum; // preferred, the first one offered in the handshake
+    CompressionType compression; // offered in the handshake, none to disable it
+    CompressFlow compress_flows[PEER_COMPRESS_FLOWS]; // indexed by inner flow hash
+    CipherType cipher; // none without a pre-shared key
+    uint8_t key[CIPHER_KEY_SIZE]; // pre-shared
 
     uint32_t next_id; // for remote peers
     uint32_t total_ids;
@@ -64,10 +192,39 @@ typedef struct {
     struct sockaddr_storage tunnel_address_block; // cache
     struct sockaddr_storage tunnel_local_address; // cache
     struct sockaddr_storage tunnel_remote_address; // cache
-} Peer;
 
-RemotePeer* remotepeer_create();
+    // multi-queue workers service their own tunnel queue and socket
+    // but share the remote peers of the peer that created them
+    Peer* owner; // itself unless it is a worker
+    Peer* workers[PEER_MAX_QUEUES];
+    uint32_t worker_count;
+    pthread_rwlock_t lock; // protects the remote peers, only used on the owner
+
+    Pipeline* pipeline; // NULL to do the crypto work in the peer thread
+
+    CachedClock clock; // refreshed by the thread servicing the peer, once per batch
+
+    StatsRegion stats; // counters published by the owner
+    StatsCounters* counters; // the set of this queue in the owner page
+    LatencyProbe latency; // times the stages of the data path into the owner page
+};
+
+RemotePeer* remotepeer_create(Peer* peer);
+RemotePeer* remotepeer_destroy(Peer* peer, RemotePeer* remote);
 RemotePeer* peer_find_remote(Peer* peer, struct sockaddr_storage* address, const bool real);
+RemotePeer* peer_find_remote_id(Peer* peer, const uint8_t id);
+bool peer_insert_remote(Peer* peer, RemotePeer* remote);
+void peer_remove_remote(Peer* peer, RemotePeer* remote);
+bool peer_insert_host(Peer* peer, RemotePeer* remote);
+void peer_remove_host(Peer* peer, RemotePeer* remote);
+StatsCounters* peer_remote_counters(Peer* peer, const RemotePeer* remote);
+
+Pipeline* pipeline_create(Peer* peer, const uint32_t count);
+void pipeline_destroy(Pipeline* pipeline);
+void pipeline_seal(Pipeline* pipeline, Packet* packet);
+Packet* pipeline_sealed(Pipeline* pipeline, const bool wait);
+bool pipeline_full(const Pipeline* pipeline);
+void pipeline_open_batch(Pipeline* pipeline, Peer* peer, MsgBatch* batch);
 
 /* protocol data */
 
@@ -83,9 +240,21 @@ typedef enum {
     MT_Data
 } MsgType;
 
+typedef enum {
+    MF_Compressed = 0x01, // the payload has to be uncompressed with the negotiated codec
+    MF_Encrypted = 0x02 // the payload is followed by the nonce counter and the tag
+} MsgFlags;
+
+#define MSG_NO_CIPHER 0xFF
+// room encrypted messages need after the payload
+#define MSG_SEAL_SIZE (sizeof(uint64_t) + CIPHER_TAG_SIZE)
+
+// type and flags are single bytes (the original enum was 4 bytes, flags were always zero)
 typedef struct {
     uint32_t checksum;
-    MsgType type;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
 } MsgHeader;
 
 // ping acts like a keep-alive
@@ -99,9 +268,10 @@ typedef struct {
     MsgHeader header;
     uint32_t protocol;
     uint8_t version;
-    uint8_t preferred_cipher;
+    uint8_t preferred_cipher; // index in 'ciphers', MSG_NO_CIPHER to talk in the clear
     uint8_t cipher_count;
     uint32_t ciphers[8];
+    uint8_t salt[CIPHER_SALT_SIZE]; // for the session key
 } MsgHandshake;
 
 typedef struct {
@@ -0,0 +1,345 @@
+#include "peer.h"
+
+#include <sys/eventfd.h>
+
+// optional crypto stage next to the thread servicing a peer
+// that thread keeps reading the tunnel and the socket while a few others pack (compress and encrypt)
+// the outgoing data messages and decrypt the incoming ones, packet descriptors travel through
+// single-producer single-consumer rings in both directions
+// packets are dealt round robin and collected in the same order, so nothing gets reordered
+
+#define PIPELINE_RING_SIZE 64 // power of two, the peer thread keeps at most this many in flight per thread
+#define PIPELINE_SPIN 256 // empty polls before a thread goes to sleep
+#define PIPELINE_CACHE_LINE 64
+
+typedef struct {
+    Packet* packet;
+    uint32_t segment; // when opening, size of each coalesced message or zero if there is one
+    bool open; // decrypt instead of pack
+    uint64_t opened; // coalesced messages decrypted in place, one bit each
+} PipelineItem;
+
+// the indices only grow and each one is written by a single side
+// each side also caches the last index seen from the other to touch its cache line less
+typedef struct {
+    uint32_t tail __attribute__((aligned(PIPELINE_CACHE_LINE))); // producer
+    uint32_t cached_head;
+    uint32_t head __attribute__((aligned(PIPELINE_CACHE_LINE))); // consumer
+    uint32_t cached_tail;
+    PipelineItem items[PIPELINE_RING_SIZE] __attribute__((aligned(PIPELINE_CACHE_LINE)));
+} PipelineRing;
+
+typedef struct {
+    PipelineRing input; // from the peer thread
+    PipelineRing output; // back to it
+    Pipeline* pipeline;
+    Peer* context; // scratch state for packing (deflate packet, compression flows)
+    int wake_fd; // eventfd to sleep on while there is no work
+    uint32_t sleeping;
+    pthread_t thread;
+    bool started;
+} PipelineThread;
+
+struct pipeline_t {
+    PipelineThread* threads;
+    uint32_t count;
+    uint32_t submitted; // round robin cursors, only used by the peer thread
+    uint32_t collected;
+    bool running;
+};
+
+bool pipeline_ring_push(PipelineRing* ring, const PipelineItem* item)
+{
+    const uint32_t tail = ring->tail;
+    if (tail - ring->cached_head == PIPELINE_RING_SIZE)
+    {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cached_head == PIPELINE_RING_SIZE)
+            return false;
+    }
+
+    ring->items[tail & (PIPELINE_RING_SIZE - 1)] = *item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool pipeline_ring_pop(PipelineRing* ring, PipelineItem* item)
+{
+    const uint32_t head = ring->head;
+    if (head == ring->cached_tail)
+    {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->cached_tail)
+            return false;
+    }
+
+    *item = ring->items[head & (PIPELINE_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// consumer side
+bool pipeline_ring_empty(PipelineRing* ring)
+{
+    return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->head;
+}
+
+void pipeline_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// packs an outgoing data message, or decrypts in place every coalesced message of an incoming packet
+// the rest of the unpacking (uncompress, checksum) is left to the peer thread
+void pipeline_process(PipelineThread* thread, PipelineItem* item)
+{
+    Packet* packet = item->packet;
+    if (!item->open)
+    {
+        uint32_t length = packet->length;
+        protocol_pack(thread->context, packet->remote, MT_Data, packet->buffer, &length);
+        packet_set_length(packet, length);
+        return;
+    }
+
+    const uint32_t segment = item->segment > 0 ? item->segment : packet->length;
+    uint32_t index = 0;
+    for (uint32_t offset = 0; offset < packet->length && index < PIPELINE_MAX_SEGMENTS; offset += segment, index++)
+    {
+        const uint32_t remaining = packet->length - offset;
+        uint32_t length = remaining < segment ? remaining : segment;
+        uint8_t* buffer = packet->buffer + offset;
+
+        // the clear ones (and the failures) go through the normal path again
+        if (length < sizeof(MsgHeader) || !(((MsgHeader*)buffer)->flags & MF_Encrypted))
+            continue;
+        if (protocol_decrypt(thread->context, packet->remote, buffer, &length))
+            item->opened |= (uint64_t)1 << index;
+    }
+}
+
+void* pipeline_thread_run(void* argument)
+{
+    PipelineThread* thread = (PipelineThread*)argument;
+
+    uint32_t idle = 0;
+    while(__atomic_load_n(&thread->pipeline->running, __ATOMIC_RELAXED))
+    {
+        PipelineItem item;
+        if (pipeline_ring_pop(&thread->input, &item))
+        {
+            pipeline_process(thread, &item);
+            // can't stay full, the peer thread never has more packets in flight than fit (pipeline_full())
+            while(!pipeline_ring_push(&thread->output, &item))
+                sched_yield();
+            idle = 0;
+            continue;
+        }
+
+        // work comes in bursts, spin a little before sleeping
+        if (++idle < PIPELINE_SPIN)
+        {
+            pipeline_relax();
+            continue;
+        }
+
+        // either the peer thread sees the flag or this sees the new item
+        __atomic_store_n(&thread->sleeping, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!pipeline_ring_empty(&thread->input) || !__atomic_load_n(&thread->pipeline->running, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&thread->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        uint64_t wakes;
+        if (read(thread->wake_fd, &wakes, sizeof(wakes)) == -1 && errno != EINTR)
+        {
+            print_errno(__func__, "error waiting for work", errno);
+            break;
+        }
+        idle = 0;
+    }
+
+    return NULL;
+}
+
+void pipeline_wake(PipelineThread* thread)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&thread->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&thread->sleeping, 0, __ATOMIC_RELAXED))
+    {
+        const uint64_t wakes = 1;
+        if (write(thread->wake_fd, &wakes, sizeof(wakes)) == -1)
+            print_errno(__func__, "error waking crypto thread", errno);
+    }
+}
+
+void pipeline_destroy(Pipeline* pipeline)
+{
+    if (!pipeline)
+        return;
+
+    __atomic_store_n(&pipeline->running, false, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < pipeline->count; i++)
+    {
+        PipelineThread* thread = &pipeline->threads[i];
+        if (thread->started)
+        {
+            const uint64_t wakes = 1;
+            if (write(thread->wake_fd, &wakes, sizeof(wakes)) == -1)
+                print_errno(__func__, "error waking crypto thread", errno);
+            pthread_join(thread->thread, NULL);
+        }
+
+        if (thread->wake_fd != -1)
+            close(thread->wake_fd);
+        peer_destroy(thread->context);
+    }
+
+    free(pipeline->threads);
+    free(pipeline);
+}
+
+// starts the crypto threads of a peer, each one packs with its own scratch peer
+Pipeline* pipeline_create(Peer* peer, const uint32_t count)
+{
+    Pipeline* pipeline = (Pipeline*)calloc(1, sizeof(Pipeline));
+    void* threads = NULL;
+    if (!pipeline || count == 0 || posix_memalign(&threads, PIPELINE_CACHE_LINE, sizeof(PipelineThread) * count) != 0)
+    {
+        free(pipeline);
+        return NULL;
+    }
+
+    memset(threads, 0, sizeof(PipelineThread) * count);
+    pipeline->threads = (PipelineThread*)threads;
+    pipeline->count = count;
+    pipeline->running = true;
+    for (uint32_t i = 0; i < count; i++)
+        pipeline->threads[i].wake_fd = -1;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        PipelineThread* thread = &pipeline->threads[i];
+        thread->pipeline = pipeline;
+
+        thread->wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (thread->wake_fd == -1)
+        {
+            print_errno(__func__, "error creating eventfd", errno);
+            pipeline_destroy(pipeline);
+            return NULL;
+        }
+
+        thread->context = peer_create(protocol_max_payload(peer));
+        if (!thread->context)
+        {
+            pipeline_destroy(pipeline);
+            return NULL;
+        }
+        thread->context->mode = peer->mode;
+        thread->context->owner = peer->owner;
+
+        int result = pthread_create(&thread->thread, NULL, pipeline_thread_run, thread);
+        if (result != 0)
+        {
+            print_errno(__func__, "error creating crypto thread", result);
+            pipeline_destroy(pipeline);
+            return NULL;
+        }
+        thread->started = true;
+    }
+
+    return pipeline;
+}
+
+// with more in flight a thread could fill both of its rings and wait for room in the output while
+// the peer thread waits for room in its input, the items are dealt round robin so this keeps
+// every thread below a ring worth of them
+bool pipeline_full(const Pipeline* pipeline)
+{
+    return pipeline->submitted - pipeline->collected >= pipeline->count * PIPELINE_RING_SIZE;
+}
+
+// the caller collects first when it is full
+void pipeline_submit(Pipeline* pipeline, const PipelineItem* item)
+{
+    assert(!pipeline_full(pipeline));
+
+    PipelineThread* thread = &pipeline->threads[pipeline->submitted % pipeline->count];
+    while(!pipeline_ring_push(&thread->input, item))
+        sched_yield();
+    pipeline->submitted++;
+    pipeline_wake(thread);
+}
+
+// the next item in submission order, false if there is none in flight or it isn't done and there's no waiting
+bool pipeline_collect(Pipeline* pipeline, PipelineItem* item, const bool wait)
+{
+    if (pipeline->collected == pipeline->submitted)
+        return false;
+
+    PipelineThread* thread = &pipeline->threads[pipeline->collected % pipeline->count];
+    while(!pipeline_ring_pop(&thread->output, item))
+    {
+        if (!wait)
+            return false;
+        sched_yield();
+    }
+    pipeline->collected++;
+    return true;
+}
+
+// hands a data packet (with its remote set) to be packed
+void pipeline_seal(Pipeline* pipeline, Packet* packet)
+{
+    PipelineItem item;
+    CLEAR(item);
+    item.packet = packet;
+    pipeline_submit(pipeline, &item);
+}
+
+// the next packed packet in the order they were handed over, NULL if there is none (yet)
+Packet* pipeline_sealed(Pipeline* pipeline, const bool wait)
+{
+    PipelineItem item;
+    return pipeline_collect(pipeline, &item, wait) ? item.packet : NULL;
+}
+
+// decrypts the received batch in the crypto threads and waits for them, the caller must hold the lock
+// handling starts only afterwards because it can change the session keys
+// nothing else is in flight then and a batch is smaller than a ring, so it never gets full
+void pipeline_open_batch(Pipeline* pipeline, Peer* peer, MsgBatch* batch)
+{
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        batch->opened[i] = 0;
+
+        Packet* packet = batch->packets[i];
+        packet->remote = peer_find_remote(peer, &batch->addresses[i], true);
+        if (!packet->remote || packet->remote->cipher == CI_None)
+            continue;
+
+        PipelineItem item;
+        CLEAR(item);
+        item.packet = packet;
+        item.segment = batch->segments[i];
+        item.open = true;
+        pipeline_submit(pipeline, &item);
+    }
+
+    // they come back in batch order
+    PipelineItem item;
+    uint32_t index = 0;
+    while(pipeline_collect(pipeline, &item, true))
+    {
+        while(batch->packets[index] != item.packet)
+            index++;
+        batch->opened[index] = item.opened;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "common.h"
+
+// pool of pre-allocated packet buffers handed around by descriptor
+// buffers are cache aligned and keep headroom in front of the payload for the message header,
+// so tunnel reads, packing and socket sends all happen in place without copies
+
+#define POOL_ALIGNMENT 64
+
+struct remote_peer_t;
+
+// what happens to the buffer contents when a packet goes back to the pool
+typedef enum {
+    PW_None = 0,
+    PW_OnRelease // zero every byte written, so no data outlives its packet
+} PoolWipe;
+
+struct packet_t;
+typedef struct packet_t Packet;
+
+struct packet_t {
+    uint8_t* buffer; // start of the message (header included)
+    uint32_t length; // bytes of the message
+    uint32_t used; // highest byte ever written, what the wipe clears
+    struct remote_peer_t* remote; // destination or source, if known
+
+    // while it waits in a send queue (codel.c)
+    Packet* next;
+    uint64_t queued; // microseconds
+    uint16_t flow;
+};
+
+typedef struct {
+    uint8_t* memory;
+    Packet* packets;
+    Packet** free_list; // stack, the last released (cache hot) buffer is reused first
+    uint32_t free_count;
+    uint32_t count;
+    uint32_t capacity; // bytes per buffer
+    uint32_t headroom; // bytes reserved in front of the payload
+    PoolWipe wipe;
+} PacketPool;
+
+bool packet_pool_create(PacketPool* pool, const uint32_t count, const uint32_t capacity, const uint32_t headroom, const PoolWipe wipe)
+{
+    if (!pool || count == 0 || headroom >= capacity)
+        return false;
+
+    memset(pool, 0, sizeof(PacketPool));
+
+    // every buffer starts on its own cache line
+    const uint32_t stride = (capacity + POOL_ALIGNMENT - 1) & ~(POOL_ALIGNMENT - 1);
+    void* memory = NULL;
+    if (posix_memalign(&memory, POOL_ALIGNMENT, (size_t)stride * count) != 0)
+        return false;
+
+    pool->memory = (uint8_t*)memory;
+    pool->packets = (Packet*)calloc(count, sizeof(Packet));
+    pool->free_list = (Packet**)calloc(count, sizeof(Packet*));
+    if (!pool->packets || !pool->free_list)
+    {
+        free(pool->memory);
+        free(pool->packets);
+        free(pool->free_list);
+        memset(pool, 0, sizeof(PacketPool));
+        return false;
+    }
+
+    memset(pool->memory, 0, (size_t)stride * count);
+    pool->count = count;
+    pool->capacity = capacity;
+    pool->headroom = headroom;
+    pool->wipe = wipe;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pool->packets[i].buffer = pool->memory + (size_t)stride * i;
+        pool->free_list[count - 1 - i] = &pool->packets[i];
+    }
+    pool->free_count = count;
+
+    return true;
+}
+
+void packet_pool_destroy(PacketPool* pool)
+{
+    if (!pool || !pool->memory)
+        return;
+
+    // wipe whatever is still around when the policy asks for it
+    if (pool->wipe == PW_OnRelease)
+    {
+        for (uint32_t i = 0; i < pool->count; i++)
+            memset(pool->packets[i].buffer, 0, pool->packets[i].used);
+    }
+
+    free(pool->memory);
+    free(pool->packets);
+    free(pool->free_list);
+    memset(pool, 0, sizeof(PacketPool));
+}
+
+// NULL when every packet is in flight
+Packet* packet_acquire(PacketPool* pool)
+{
+    if (pool->free_count == 0)
+        return NULL;
+
+    Packet* packet = pool->free_list[--pool->free_count];
+    packet->length = 0;
+    packet->remote = NULL;
+    return packet;
+}
+
+// the single place where packet contents are wiped
+void packet_release(PacketPool* pool, Packet* packet)
+{
+    if (!packet)
+        return;
+
+    assert(pool->free_count < pool->count);
+
+    if (pool->wipe == PW_OnRelease && packet->used > 0)
+        memset(packet->buffer, 0, packet->used);
+    packet->used = 0;
+    packet->length = 0;
+    packet->remote = NULL;
+
+    pool->free_list[pool->free_count++] = packet;
+}
+
+// wipes a packet that stays in use by giving it back and taking it again (the same one)
+Packet* packet_recycle(PacketPool* pool, Packet* packet)
+{
+    packet_release(pool, packet);
+    return packet_acquire(pool);
+}
+
+// where the data goes, after the headroom
+uint8_t* packet_payload(const PacketPool* pool, Packet* packet)
+{
+    return packet->buffer + pool->headroom;
+}
+
+// stages changing the message size go through here so the wipe covers everything written
+void packet_set_length(Packet* packet, const uint32_t length)
+{
+    packet->length = length;
+    if (length > packet->used)
+        packet->used = length;
+}
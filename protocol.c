@@ -3,9 +3,15 @@
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <netinet/icmp6.h>
 
 #define PROTOCOL_ID 0xBEEFCAFE
-#define PROTOCOL_VERSION 0x1
+#define PROTOCOL_VERSION 0x2
+// payloads smaller than this are never compressed
+#define PROTOCOL_COMPRESS_MIN 64
+// poor ratios in a row before a flow is skipped, and for how many messages at first
+#define PROTOCOL_COMPRESS_MISSES 4
+#define PROTOCOL_COMPRESS_SKIP 16
 
 MsgType protocol_read_type(const uint8_t* buffer, const uint32_t length)
 {
@@ -62,21 +68,76 @@ uint32_t protocol_get_message_size(const MsgType type)
 uint32_t protocol_max_payload(Peer* peer)
 {
     assert(peer);
-    return peer->buffer_size - sizeof(MsgHeader);
+    return peer->buffer_size - sizeof(MsgHeader) - MSG_SEAL_SIZE;
 }
 
-uint32_t protocol_compute_checksum(const uint8_t* buffer, const uint32_t length)
+// control messages always use the default so they can be checked before and during the negotiation
+ChecksumType protocol_checksum_type(const RemotePeer* remote, const MsgType type)
 {
-    uint32_t a = 1;
-    uint32_t b = 0;
-    const uint32_t modulo = 65521;
+    if (remote && type == MT_Data)
+        return remote->checksum;
+    return CK_Adler32;
+}
 
-    for(uint32_t i = 0; i < length; i++)
+// offers the preferred checksum first, 'none' is only offered when preferred
+uint8_t protocol_offer_checksums(const ChecksumType preferred, uint32_t* ids, const uint8_t max_count)
+{
+    uint8_t count = 0;
+    ids[count++] = checksum_get(preferred)->id;
+    for (uint32_t i = 0; i < CK_Count && count < max_count; i++)
     {
-        a = (a + buffer[i]) % modulo;
-        b = (b + a) % modulo;
+        if (i != preferred && i != CK_None)
+            ids[count++] = checksum_get((ChecksumType)i)->id;
     }
-    return (b << 16) | a;
+    return count;
+}
+
+// compression is only used when both sides offer the same codec
+CompressionType protocol_negotiate_compression(const CompressionType preferred, const MsgHandshake* message)
+{
+    if (preferred == CP_None)
+        return CP_None;
+
+    const uint8_t count = message->cipher_count < 8 ? message->cipher_count : 8;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        CompressionType type;
+        if (compression_from_id(message->ciphers[i], &type) && type == preferred)
+            return type;
+    }
+    return CP_None;
+}
+
+// the client offers the cipher it wants and the server confirms it, both sides have to want the same one
+// so a side with a key never talks in the clear and a side without one is never asked to encrypt
+bool protocol_negotiate_cipher(const CipherType local, const MsgHandshake* message, CipherType* chosen)
+{
+    *chosen = CI_None;
+    const uint8_t count = message->cipher_count < 8 ? message->cipher_count : 8;
+    if (message->preferred_cipher < count && !cipher_from_id(message->ciphers[message->preferred_cipher], chosen))
+        return false;
+    return *chosen == local;
+}
+
+// picks the first checksum offered by the remote that is also offered locally
+ChecksumType protocol_negotiate_checksum(const ChecksumType preferred, const MsgHandshake* message)
+{
+    uint32_t local_ids[CK_Count];
+    const uint8_t local_count = protocol_offer_checksums(preferred, local_ids, CK_Count);
+
+    const uint8_t count = message->cipher_count < 8 ? message->cipher_count : 8;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        for (uint8_t j = 0; j < local_count; j++)
+        {
+            ChecksumType type;
+            if (message->ciphers[i] == local_ids[j] && checksum_from_id(local_ids[j], &type))
+                return type;
+        }
+    }
+
+    // peers that don't know about them keep using the original one
+    return CK_Adler32;
 }
 
 bool protocol_get_destination(const uint8_t* buffer, const uint32_t length, struct sockaddr_storage* destination)
@@ -107,125 +168,305 @@ bool protocol_get_destination(const uint8_t* buffer, const uint32_t length, stru
     return true;
 }
 
-void protocol_compute_ip_checksum(struct iphdr* ip_header)
+// adjusts the transport checksum covering the replaced address through the pseudo header
+void protocol_adjust_transport_checksum(uint8_t* payload, const uint32_t length, const uint8_t protocol, const uint8_t* old_address, const uint8_t* new_address, const uint32_t address_length)
 {
-    ip_header->check = 0;
+    switch(protocol)
+    {
+    case IPPROTO_TCP:
+    {
+        if (length < sizeof(struct tcphdr))
+            return;
 
-    uint16_t* addr = (uint16_t*)ip_header;
-    uint32_t count = ip_header->ihl << 2;
-    register uint64_t sum = 0;
-    while (count > 1) 
+        struct tcphdr* tcp_header = (struct tcphdr*)payload;
+        checksum_adjust(&tcp_header->check, old_address, new_address, address_length);
+        break;
+    }
+    case IPPROTO_UDP:
     {
-        sum += *addr++;
-        count -= 2;
+        if (length < sizeof(struct udphdr))
+            return;
+
+        // zero means no checksum (only valid over IPv4), it must stay that way
+        struct udphdr* udp_header = (struct udphdr*)payload;
+        if (udp_header->check == 0 && address_length == sizeof(struct in_addr))
+            return;
+
+        checksum_adjust(&udp_header->check, old_address, new_address, address_length);
+        // and a computed zero is sent as all ones
+        if (udp_header->check == 0)
+            udp_header->check = 0xFFFF;
+        break;
+    }
+    case IPPROTO_ICMPV6:
+    {
+        // unlike ICMP over IPv4 it includes the pseudo header
+        if (length < sizeof(struct icmp6_hdr))
+            return;
+
+        struct icmp6_hdr* icmp6_header = (struct icmp6_hdr*)payload;
+        checksum_adjust(&icmp6_header->icmp6_cksum, old_address, new_address, address_length);
+        break;
+    }
+    default:
+        break;
     }
-    
-    // padding
-    if (count > 0)
-        sum += ((*addr) & htons(0xFF00));
-    
-    // folding
-    while (sum >> 16)
-        sum = (sum & 0xffff) + (sum >> 16);
-    
-    sum = ~sum;
-    ip_header->check = (uint16_t)sum;
 }
 
-void protocol_compute_tcp_checksum(struct iphdr* ip_header, uint16_t* payload)
+// hashes the addresses, transport protocol and ports of the tunnel packet
+uint32_t protocol_flow_hash(const uint8_t* buffer, const uint32_t length)
 {
-    register uint64_t sum = 0;
-    uint16_t tcp_length = ntohs(ip_header->tot_len) - (ip_header->ihl << 2);
-    struct tcphdr* tcp_header = (struct tcphdr*)payload;
-    
-    // tcp pseudoheader
-    // source ip
-    sum += (ip_header->saddr >> 16) & 0xFFFF;
-    sum += (ip_header->saddr) & 0xFFFF;
-    //destination ip
-    sum += (ip_header->daddr >> 16) & 0xFFFF;
-    sum += (ip_header->daddr) & 0xFFFF;
-    // protocol and reserved: 6
-    sum += htons(IPPROTO_TCP);
-    // length
-    sum += htons(tcp_length);
- 
-    tcp_header->check = 0;
-    while (tcp_length > 1) 
+    uint32_t hash = 0;
+    uint32_t transport_offset = 0;
+    uint8_t transport = 0;
+
+    const struct iphdr* header4 = (const struct iphdr*)buffer;
+    if (length >= sizeof(struct iphdr) && header4->version == 4)
     {
-        sum += * payload++;
-        tcp_length -= 2;
+        hash = header4->saddr ^ (header4->daddr * 31);
+        transport = header4->protocol;
+        transport_offset = header4->ihl << 2;
+    }
+    else if (length >= sizeof(struct ip6_hdr) && header4->version == 6)
+    {
+        const struct ip6_hdr* header6 = (const struct ip6_hdr*)buffer;
+        hash = checksum_fold(checksum_add(0, (const uint8_t*)&header6->ip6_src, 32));
+        transport = header6->ip6_nxt;
+        transport_offset = sizeof(struct ip6_hdr);
     }
 
-    // padding
-    if (tcp_length > 0) 
-        sum += ((*payload) & htons(0xFF00));
-
-    // folding
-    while (sum>>16)
-        sum = (sum & 0xffff) + (sum >> 16);
+    // both TCP and UDP start with the ports
+    if ((transport == IPPROTO_TCP || transport == IPPROTO_UDP) && length >= transport_offset + 4)
+    {
+        uint32_t ports;
+        memcpy(&ports, buffer + transport_offset, sizeof(ports));
+        hash ^= ports * 17;
+    }
 
-    sum = ~sum;
-    tcp_header->check = (uint16_t)sum;
+    hash ^= transport;
+    return (hash * 2654435761U) >> 16;
 }
 
-void protocol_compute_udp_checksum(struct iphdr* ip_header, uint16_t* payload)
+// compresses the payload of data messages in place when the remote negotiated it
+// flows that keep compressing poorly are skipped for a while, doubling the wait each time
+bool protocol_compress(Peer* peer, RemotePeer* remote, uint8_t* buffer, uint32_t* length)
 {
-    (void)ip_header;
-    struct udphdr *udp_header = (struct udphdr*)payload;
-    udp_header->check = 0; // udp checksum is optional
-}
-void protocol_recompute_packet_checksums(const uint8_t* buffer, const uint32_t length)
-{
-    (void)length;
-    struct iphdr* header = (struct iphdr*)buffer;
-    // recompute the ip header
-    protocol_compute_ip_checksum(header);
-    
-    uint16_t* payload = (uint16_t*)(buffer + (header->ihl << 2));
-    switch(header->protocol)
+    MsgHeader* header = (MsgHeader*)buffer;
+    if (!remote || remote->compression == CP_None || header->type != MT_Data)
+        return true;
+
+    uint8_t* payload = buffer + sizeof(MsgHeader);
+    const uint32_t payload_length = *length - sizeof(MsgHeader);
+    if (payload_length < PROTOCOL_COMPRESS_MIN)
+        return true;
+
+    CompressFlow* flow = &peer->compress_flows[protocol_flow_hash(payload, payload_length) & (PEER_COMPRESS_FLOWS - 1)];
+    if (flow->skip > 0)
     {
-    case IPPROTO_TCP:
-        protocol_compute_tcp_checksum(header, payload);
-        break;
-    case IPPROTO_UDP:
-        protocol_compute_udp_checksum(header, payload);
-        break;
-    default:
-        break;
+        flow->skip--;
+        return true;
     }
+
+    // only worth it if it saves at least an eighth, the codec gives up once it passes that
+    const uint32_t worth = payload_length - payload_length / 8;
+    const uint32_t compressed = lz_compress(payload, payload_length, peer->deflate->buffer, worth);
+    packet_set_length(peer->deflate, compressed > 0 ? compressed : worth);
+
+    if (compressed == 0)
+    {
+        if (++flow->misses >= PROTOCOL_COMPRESS_MISSES)
+        {
+            flow->backoff = flow->backoff == 0 ? PROTOCOL_COMPRESS_SKIP : (flow->backoff < 128 ? flow->backoff * 2 : 255);
+            flow->skip = flow->backoff;
+            flow->misses = 0;
+        }
+    }
+    else
+    {
+        flow->misses = 0;
+        flow->backoff = 0;
+
+        memcpy(payload, peer->deflate->buffer, compressed);
+        header->flags |= MF_Compressed;
+        *length = sizeof(MsgHeader) + compressed;
+    }
+
+    // wipe the scratch copy
+    peer->deflate = packet_recycle(&peer->send_pool, peer->deflate);
+    return true;
 }
 
-// placeholder
-bool protocol_compress(Peer* peer, uint8_t* buffer, uint32_t* length)
+// uncompresses the payload into the inflate packet and points the message there
+// the flag is cleared again so the checksum sees the message as it was packed
+bool protocol_uncompress(Peer* peer, RemotePeer* remote, uint8_t** buffer, uint32_t* length)
 {
-    (void) peer; (void) buffer; (void) length;
+    MsgHeader* header = (MsgHeader*)*buffer;
+    if (!(header->flags & MF_Compressed))
+        return true;
+
+    // only negotiated peers can send compressed data
+    if (!remote || remote->compression == CP_None)
+        return false;
+
+    // a failed decompression can leave part of the plaintext behind, mark the whole
+    // output as used so the buffer is wiped when it is recycled either way
+    uint8_t* output = peer->inflate->buffer;
+    packet_set_length(peer->inflate, sizeof(MsgHeader) + protocol_max_payload(peer));
+    const int32_t uncompressed = lz_decompress(*buffer + sizeof(MsgHeader), *length - sizeof(MsgHeader),
+        output + sizeof(MsgHeader), protocol_max_payload(peer));
+    if (uncompressed < 0)
+        return false;
+
+    memcpy(output, header, sizeof(MsgHeader));
+    ((MsgHeader*)output)->flags &= ~MF_Compressed;
+
+    *buffer = output;
+    *length = sizeof(MsgHeader) + uncompressed;
+    packet_set_length(peer->inflate, *length);
     return true;
 }
 
-// placeholder
-bool protocol_uncompress(Peer* peer, uint8_t* buffer, uint32_t* length)
+// handshakes always travel in the clear, they happen before there is a key
+bool protocol_is_sealed(const MsgType type)
+{
+    return type != MT_ClientHandshake && type != MT_ServerHandshake;
+}
+
+// the server finds the key of a reconnecting client by the id in its message, so that one is
+// only authenticated: all of it goes into the tag and nothing is encrypted
+bool protocol_is_readable(const MsgType type)
+{
+    return type == MT_ClientReconnect;
+}
+
+// both directions share the key, so the sender role keeps their nonces apart
+void protocol_nonce(const VPNMode sender, const uint64_t counter, uint8_t nonce[CIPHER_NONCE_SIZE])
+{
+    cipher_store32(nonce, sender == VPNMode_Server ? 1 : 0);
+    cipher_store32(nonce + 4, (uint32_t)counter);
+    cipher_store32(nonce + 8, (uint32_t)(counter >> 32));
+}
+
+// encrypts everything after the header in place and appends the nonce counter and the tag
+// the header stays readable but is authenticated along with the payload
+bool protocol_encrypt(Peer* peer, RemotePeer* remote, uint8_t* buffer, uint32_t* length)
 {
-    (void) peer; (void) buffer; (void) length;
+    MsgHeader* header = (MsgHeader*)buffer;
+    if (!remote || remote->cipher == CI_None || !protocol_is_sealed(header->type))
+        return true;
+
+    header->flags |= MF_Encrypted;
+
+    // workers can be sending to the same remote at the same time
+    const uint64_t counter = __atomic_fetch_add(&remote->cold->nonce, 1, __ATOMIC_RELAXED);
+    uint8_t nonce[CIPHER_NONCE_SIZE];
+    protocol_nonce(peer->mode, counter, nonce);
+
+    const uint32_t header_length = protocol_is_readable(header->type) ? *length : sizeof(MsgHeader);
+    uint8_t* payload = buffer + header_length;
+    const uint32_t payload_length = *length - header_length;
+    uint8_t* trailer = payload + payload_length;
+    memcpy(trailer, nonce + 4, sizeof(uint64_t));
+    cipher_seal(remote->cold->key, nonce, buffer, header_length, payload, payload_length, trailer + sizeof(uint64_t));
+
+    *length += MSG_SEAL_SIZE;
     return true;
 }
 
-// placeholder
-bool protocol_encrypt(RemotePeer* remote, uint8_t* buffer, uint32_t* length)
+// checks and decrypts the message in place, the trailer is left out of the length
+// a counter the other side already used means the message was recorded and sent again
+bool protocol_decrypt(Peer* peer, RemotePeer* remote, uint8_t* buffer, uint32_t* length)
 {
-    (void) remote; (void) buffer; (void) length;
-    //if (remote->cipher)
-        //remote->cipher->encrypt(remote->key, buffer, length);
-    return true; 
+    MsgHeader* header = (MsgHeader*)buffer;
+    const bool encrypted = (header->flags & MF_Encrypted) != 0;
+
+    // without a cipher nothing can be decrypted, with one only some messages can come in the clear
+    if (!remote || remote->cipher == CI_None)
+        return !encrypted;
+    if (!encrypted)
+        return !protocol_is_sealed(header->type);
+
+    if (*length < sizeof(MsgHeader) + MSG_SEAL_SIZE)
+        return false;
+
+    const uint32_t header_length = protocol_is_readable(header->type) ? *length - MSG_SEAL_SIZE : sizeof(MsgHeader);
+    uint8_t* payload = buffer + header_length;
+    const uint32_t payload_length = *length - header_length - MSG_SEAL_SIZE;
+    const uint8_t* trailer = payload + payload_length;
+
+    // sent by the other side
+    uint8_t nonce[CIPHER_NONCE_SIZE];
+    cipher_store32(nonce, peer->mode == VPNMode_Server ? 0 : 1);
+    memcpy(nonce + 4, trailer, sizeof(uint64_t));
+
+    if (!cipher_open(remote->cold->key, nonce, buffer, header_length, payload, payload_length, trailer + sizeof(uint64_t)))
+        return false;
+
+    const uint64_t counter = cipher_load32(trailer) | ((uint64_t)cipher_load32(trailer + 4) << 32);
+    if (!cipher_replay_accept(&remote->cold->replay, counter))
+        return false;
+
+    header->flags &= ~MF_Encrypted;
+    *length -= MSG_SEAL_SIZE;
+    return true;
 }
 
-// placeholder
-bool protocol_decrypt(RemotePeer* remote, uint8_t* buffer, uint32_t* length)
+// follows the IPv6 extension headers to the transport header, false if they don't fit in the packet
+// the transport checksum is left alone when the header isn't there (later fragments) or when its
+// pseudo header doesn't use the rewritten address (the final destination of a routing header)
+bool protocol_find_ipv6_transport(const uint8_t* buffer, const uint32_t length, const bool origin, uint8_t* transport, uint32_t* header_length, bool* has_transport)
 {
-    (void) remote; (void) buffer; (void) length;
-    //if (remote->cipher)
-        //remote->cipher->decrypt(remote->key, buffer, length);
-    return true; 
+    const struct ip6_hdr* header = (const struct ip6_hdr*)buffer;
+    uint8_t next = header->ip6_nxt;
+    uint32_t offset = sizeof(struct ip6_hdr);
+
+    while (true)
+    {
+        switch(next)
+        {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+        {
+            if (offset + sizeof(struct ip6_ext) > length)
+                return false;
+
+            const struct ip6_ext* extension = (const struct ip6_ext*)(buffer + offset);
+            if (next == IPPROTO_ROUTING && !origin)
+            {
+                if (offset + sizeof(struct ip6_rthdr) > length)
+                    return false;
+                if (((const struct ip6_rthdr*)extension)->ip6r_segleft > 0)
+                    *has_transport = false;
+            }
+
+            next = extension->ip6e_nxt;
+            offset += (extension->ip6e_len + 1) * 8;
+            break;
+        }
+        case IPPROTO_FRAGMENT:
+        {
+            if (offset + sizeof(struct ip6_frag) > length)
+                return false;
+
+            // only the first fragment carries the transport header
+            const struct ip6_frag* fragment = (const struct ip6_frag*)(buffer + offset);
+            if ((fragment->ip6f_offlg & IP6F_OFF_MASK) != 0)
+                *has_transport = false;
+
+            next = fragment->ip6f_nxt;
+            offset += sizeof(struct ip6_frag);
+            break;
+        }
+        default:
+            if (offset > length)
+                return false;
+
+            *transport = next;
+            *header_length = offset;
+            return true;
+        }
+    }
 }
 
 bool protocol_replace_address(uint8_t* buffer, const uint32_t length, const struct sockaddr_storage* address, const bool origin)
@@ -258,113 +499,371 @@ bool protocol_replace_address(uint8_t* buffer, const uint32_t length, const stru
 
     struct sockaddr_in* address4 = (struct sockaddr_in*)address;
     struct sockaddr_in6* address6 = (struct sockaddr_in6*)address;
+
+    uint8_t* field = NULL;
+    const uint8_t* value = NULL;
+    uint32_t field_length = 0;
+    uint8_t transport = 0;
+    uint32_t header_length = 0;
+    bool has_transport = true;
     
-    if (origin) // outgoing -> change source
+    if (address_version == 6)
     {
-        if (address_version == 6)
-            header6->ip6_src = address6->sin6_addr;
-        else
-            header4->saddr = address4->sin_addr.s_addr;
+        // origin: outgoing -> change source, otherwise incoming -> change destination
+        field = origin ? (uint8_t*)&header6->ip6_src : (uint8_t*)&header6->ip6_dst;
+        value = (const uint8_t*)&address6->sin6_addr;
+        field_length = sizeof(struct in6_addr);
+
+        if (!protocol_find_ipv6_transport(buffer, length, origin, &transport, &header_length, &has_transport))
+            return false;
     }
-    else // incoming -> change destination
+    else
     {
-        if (address_version == 6 )
-            header6->ip6_dst = address6->sin6_addr;
-        else
-            header4->daddr = address4->sin_addr.s_addr;
+        field = origin ? (uint8_t*)&header4->saddr : (uint8_t*)&header4->daddr;
+        value = (const uint8_t*)&address4->sin_addr.s_addr;
+        field_length = sizeof(struct in_addr);
+        transport = header4->protocol;
+        header_length = header4->ihl << 2;
+        // only the first fragment carries the transport header
+        has_transport = (ntohs(header4->frag_off) & IP_OFFMASK) == 0;
+
+        if (header_length < sizeof(struct iphdr) || header_length > length)
+            return false;
     }
 
-    protocol_recompute_packet_checksums(buffer, length);
+    uint8_t old_address[sizeof(struct in6_addr)];
+    memcpy(old_address, field, field_length);
+    memcpy(field, value, field_length);
+
+    // adjust the checksums with the difference instead of summing the whole packet again
+    if (address_version == 4)
+        checksum_adjust(&header4->check, old_address, field, field_length);
+
+    if (has_transport)
+        protocol_adjust_transport_checksum(buffer + header_length, length - header_length, transport, old_address, field, field_length);
     
     return true;
 }
 
-bool protocol_send(Peer* peer, RemotePeer* remote, const MsgType type)
+// composes the header and transforms the message in the buffer before sending it
+void protocol_pack(Peer* peer, RemotePeer* remote, const MsgType type, uint8_t* buffer, uint32_t* length)
 {
     // set header data at the beginning of the buffer
-    MsgHeader* header = (MsgHeader*)peer->send_buffer;
+    MsgHeader* header = (MsgHeader*)buffer;
     memset(header, 0, sizeof(MsgHeader));
     header->type = type;
     // compute the checksum of the buffer *after* the checksum field
-    header->checksum = protocol_compute_checksum(peer->send_buffer + sizeof(uint32_t), peer->send_length - sizeof(uint32_t));
+    uint64_t time = latency_start(&peer->latency);
+    header->checksum = checksum_compute(protocol_checksum_type(remote, type), buffer + sizeof(uint32_t), *length - sizeof(uint32_t));
+    time = latency_stage(&peer->latency, LS_Checksum, time);
 
     // first compress to get better ratio
-    bool ok = protocol_compress(peer, peer->send_buffer, &peer->send_length);
+    bool ok = protocol_compress(peer, remote, buffer, length);
     assert(ok); // compress cannot fail
+    time = latency_stage(&peer->latency, LS_Compress, time);
 
     // then encrypt
-    ok = protocol_encrypt(remote, peer->send_buffer, &peer->send_length);
+    ok = protocol_encrypt(peer, remote, buffer, length);
     assert(ok); // encrypt cannot fail
+    latency_stage(&peer->latency, LS_Encrypt, time);
+}
+
+// flow of a tunnel packet in the send queues, by its inner addresses, transport protocol and ports
+uint16_t protocol_send_flow(const uint8_t* buffer, const uint32_t length)
+{
+    // all but the one kept for the control messages
+    return CODEL_CONTROL_FLOW + 1 + protocol_flow_hash(buffer, length) % (CODEL_FLOWS - 1);
+}
+
+void protocol_count_drops(Peer* peer, RemotePeer* remote, const StatsCounter counter, const uint32_t count)
+{
+    stats_add(peer->counters, counter, count);
+    stats_add_shared(peer_remote_counters(peer, remote), counter, count);
+}
+
+// whether any rate has to be kept when sending
+bool protocol_pacing(Peer* peer)
+{
+    return pacing_enabled(&peer->owner->remote_rate) || pacing_enabled(&peer->owner->total_rate);
+}
+
+// takes the tokens to send the bytes to the remote from its bucket and the total one
+// returns 0 if they can go now, or how long until they can otherwise (nanoseconds)
+uint64_t protocol_pace(Peer* peer, RemotePeer* remote, const uint32_t bytes)
+{
+    Peer* owner = peer->owner;
+    const uint64_t now = peer->clock.us * 1000;
+
+    uint64_t wait = pacing_take(&remote->cold->pacing, &owner->remote_rate, bytes, now);
+    if (wait > 0)
+        return wait;
+
+    wait = pacing_take(&owner->total, &owner->total_rate, bytes, now);
+    if (wait > 0)
+        pacing_refund(&remote->cold->pacing, &owner->remote_rate, bytes);
+    return wait;
+}
+
+// for messages that took their tokens but didn't fit in the socket
+void protocol_unpace(Peer* peer, RemotePeer* remote, const uint32_t bytes)
+{
+    Peer* owner = peer->owner;
+    pacing_refund(&remote->cold->pacing, &owner->remote_rate, bytes);
+    pacing_refund(&owner->total, &owner->total_rate, bytes);
+}
+
+// the send queues are drained again once the paced messages can go
+void protocol_pace_wakeup(Peer* peer, const uint64_t wait)
+{
+    const uint64_t wakeup = peer->clock.us + (wait + 999) / 1000;
+    if (peer->send_wakeup == 0 || wakeup < peer->send_wakeup)
+        peer->send_wakeup = wakeup;
+}
+
+// messages of a remote don't overtake the ones it already has waiting
+bool protocol_remote_waiting(Peer* peer, const RemotePeer* remote)
+{
+    const SendQueue* queue = peer->send_queues[remote->id];
+    return queue && queue->flows.count > 0;
+}
+
+// keeps a packed message until the socket has room for it
+// if the queue of its remote peer is full the flow with most messages makes room
+// and if every queue together is full it is discarded
+void protocol_enqueue(Peer* peer, Packet* packet)
+{
+    RemotePeer* remote = packet->remote;
+    SendQueue* queue = peer->send_queues[remote->id];
+    if (!queue)
+    {
+        queue = peer->send_queues[remote->id] = (SendQueue*)calloc(1, sizeof(SendQueue));
+        if (queue)
+            flowqueue_init(&queue->flows, peer->buffer_size);
+    }
+
+    if (!queue || peer->send_queued >= PEER_SEND_QUEUED)
+    {
+        protocol_count_drops(peer, remote, SC_QueueDrops, 1);
+        packet_release(&peer->send_pool, packet);
+        return;
+    }
+
+    if (queue->flows.count == PEER_SEND_QUEUE_DEPTH)
+    {
+        protocol_count_drops(peer, remote, SC_QueueDrops, 1);
+        packet_release(&peer->send_pool, flowqueue_drop_fattest(&queue->flows));
+        peer->send_queued--;
+    }
+
+    flowqueue_push(&queue->flows, packet, peer->clock.us);
+    queue->remote = remote;
+    peer->send_queued++;
+
+    if (!queue->active)
+    {
+        queue->active = true;
+        queue->next = NULL;
+        peer->send_active_count++;
+        if (peer->send_active_tail)
+            peer->send_active_tail->next = queue;
+        else
+            peer->send_active = queue;
+        peer->send_active_tail = queue;
+    }
+}
+
+bool protocol_send(Peer* peer, RemotePeer* remote, const MsgType type)
+{
+    // only the data path is timed
+    peer->latency.timing = false;
+    protocol_pack(peer, remote, type, peer->send_buffer, &peer->send_length);
+
+    packet_set_length(peer->control, peer->send_length);
+    peer->control->remote = remote;
+    peer->control->flow = CODEL_CONTROL_FLOW;
 
-    SocketResult ret = SR_Pending;
+    // control messages aren't paced, but they don't overtake the messages already waiting
+    bool queued = peer->send_blocked || protocol_remote_waiting(peer, remote);
     uint32_t sent = peer->send_length;
-    do {
-        ret = socket_send(&peer->socket, peer->send_buffer, &sent, &remote->real_address);
+    if (!queued)
+    {
+        struct sockaddr_storage address;
+        address_expand(&address, &remote->real_address);
+        SocketResult ret = socket_send(&peer->socket, peer->send_buffer, &sent, &address);
         if (ret == SR_Error)
             return false;
-    }while(ret == SR_Pending);
 
-    assert(sent == peer->send_length); // TODO manage this
+        if (ret == SR_Pending)
+        {
+            // it waits with the data for the socket to have room
+            stats_add(peer->counters, SC_SendBlocked, 1);
+            peer->send_blocked = true;
+            queued = true;
+        }
+    }
 
-    // clear buffer after sending for privacy
-    memset(peer->send_buffer, 0, peer->buffer_size);
+    if (queued)
+        protocol_enqueue(peer, peer->control);
+    else
+    {
+        assert(sent == peer->send_length); // TODO manage this
+
+        StatsCounters* counters = peer_remote_counters(peer, remote);
+        stats_add(peer->counters, SC_PacketsOut, 1);
+        stats_add(peer->counters, SC_BytesOut, sent);
+        stats_add_shared(counters, SC_PacketsOut, 1);
+        stats_add_shared(counters, SC_BytesOut, sent);
+
+        // the control packet goes through the pool to be wiped, it comes right back
+        packet_release(&peer->send_pool, peer->control);
+    }
+
+    // there is always one left, the queues can't take the packets reserved for the batch and this one
+    peer->control = packet_acquire(&peer->send_pool);
+    assert(peer->control);
+    peer->send_buffer = peer->control->buffer;
     peer->send_length = 0;
 
-    remote->last_send_time = get_current_timestamp();
+    remote->last_send_time = peer->clock.ms;
 
     return true;
 }
 
-// if the remote peer is unknown 'remote' is null and new_remote contains the address
-SocketResult protocol_receive(Peer* peer, RemotePeer** remote, struct sockaddr_storage* new_remote)
+// reads a batch of incoming messages from the socket into the receive slots
+SocketResult protocol_receive(Peer* peer)
 {
-    // read incoming message from the socket
-    struct sockaddr_storage address;
-    peer->recv_length = peer->buffer_size;
-    SocketResult ret = socket_receive(&peer->socket, peer->recv_buffer, &peer->recv_length, &address);
+    MsgBatch* batch = &peer->recv_batch;
+    assert(batch->count == 0);
 
-    if (ret == SR_Success)
+    uint32_t count = 0;
+    while (count < PEER_BATCH_SIZE)
     {
-        // if not found will be NULL
-        *remote = peer_find_remote(peer, &address, true);
-        *new_remote = address;
+        Packet* packet = packet_acquire(&peer->recv_pool);
+        if (!packet)
+            break;
 
-        // first decrypt
-        bool decrypted = protocol_decrypt(*remote, peer->recv_buffer, &peer->recv_length);
-        // then uncompress if decrypted
-        bool uncompressed = decrypted && protocol_uncompress(peer, peer->recv_buffer, &peer->recv_length);
+        batch->packets[count] = packet;
+        batch->buffers[count] = packet->buffer;
+        batch->lengths[count] = peer->recv_pool.capacity;
+        batch->segments[count] = 0;
+        batch->opened[count] = 0;
+        count++;
+    }
 
-        // check the integrity
-        bool valid = false;
-        if (uncompressed)
+    const uint32_t acquired = count;
+    latency_sample(&peer->latency);
+    const uint64_t start = latency_start(&peer->latency);
+    SocketResult ret = socket_receive_batch(&peer->socket, batch->buffers, batch->lengths, batch->segments, batch->addresses, &count);
+    if (ret != SR_Success)
+        count = 0;
+    else
+        latency_stage(&peer->latency, LS_SocketReceive, start);
+
+    // the data is already in place, the leftover packets go back unused
+    for (uint32_t i = 0; i < acquired; i++)
+    {
+        if (i < count)
         {
-            uint32_t computed = protocol_compute_checksum(peer->recv_buffer + sizeof(uint32_t), peer->recv_length - sizeof(uint32_t));
-            uint32_t incoming = ((MsgHeader*)peer->recv_buffer)->checksum;
-            valid = (computed == incoming);
+            packet_set_length(batch->packets[i], batch->lengths[i]);
         }
-
-        if (!decrypted || !uncompressed || !valid)
+        else
         {
-            char address_text[256];
-            address_to_string(&address, address_text,sizeof(address_text));
-            if (!valid)
-                printf("%s: checksum failed in message from %s\n", __func__, address_text);
-            else
-                printf("%s: failed to %s message from %s\n", __func__, decrypted ? "uncompress" : "decrypt", address_text);
-
-            peer->recv_length = 0; // length zero because theres no available data
+            packet_release(&peer->recv_pool, batch->packets[i]);
+            batch->packets[i] = NULL;
         }
-    }   
+    }
+    batch->count = count;
 
     return ret;
 }
 
+// makes a received message (or a segment of a coalesced one) available through recv_buffer
+// if the remote peer is unknown 'remote' is null and new_remote contains the address
+// 'opened' messages were decrypted in place by a crypto thread, only the trailer is left to drop
+void protocol_unpack(Peer* peer, uint8_t* buffer, const uint32_t length, struct sockaddr_storage* address, const bool opened, RemotePeer** remote, struct sockaddr_storage* new_remote)
+{
+    peer->recv_buffer = buffer;
+    peer->recv_length = length;
+
+    // if not found will be NULL
+    *remote = peer_find_remote(peer, address, true);
+    *new_remote = *address;
+
+    StatsCounters* counters = *remote ? peer_remote_counters(peer, *remote) : NULL;
+    stats_add(peer->counters, SC_PacketsIn, 1);
+    stats_add(peer->counters, SC_BytesIn, length);
+    if (counters)
+    {
+        stats_add_shared(counters, SC_PacketsIn, 1);
+        stats_add_shared(counters, SC_BytesIn, length);
+    }
+
+    // too small to even carry a header
+    if (peer->recv_length < sizeof(MsgHeader))
+    {
+        peer->recv_length = 0;
+        return;
+    }
+
+    // the stages of this message are timed (or not) up to the tunnel write
+    latency_sample(&peer->latency);
+    uint64_t time = latency_start(&peer->latency);
+
+    // a reconnecting client is checked with the key of the remote peer its message names
+    RemotePeer* sender = *remote;
+    if (!sender && protocol_read_type(peer->recv_buffer, peer->recv_length) == MT_ClientReconnect
+        && peer->recv_length >= sizeof(MsgReconnect))
+        sender = peer_find_remote_id(peer, ((MsgReconnect*)peer->recv_buffer)->id);
+
+    // first decrypt
+    bool decrypted = true;
+    if (opened)
+        peer->recv_length -= MSG_SEAL_SIZE;
+    else
+    {
+        decrypted = protocol_decrypt(peer, sender, peer->recv_buffer, &peer->recv_length);
+        time = latency_stage(&peer->latency, LS_Decrypt, time);
+    }
+    // then uncompress if decrypted
+    bool uncompressed = decrypted && protocol_uncompress(peer, *remote, &peer->recv_buffer, &peer->recv_length);
+    if (decrypted)
+        time = latency_stage(&peer->latency, LS_Uncompress, time);
+
+    // check the integrity
+    bool valid = false;
+    if (uncompressed)
+    {
+        const ChecksumType type = protocol_checksum_type(*remote, ((MsgHeader*)peer->recv_buffer)->type);
+        uint32_t computed = checksum_compute(type, peer->recv_buffer + sizeof(uint32_t), peer->recv_length - sizeof(uint32_t));
+        uint32_t incoming = ((MsgHeader*)peer->recv_buffer)->checksum;
+        valid = (computed == incoming);
+        latency_stage(&peer->latency, LS_Verify, time);
+    }
+
+    if (!decrypted || !uncompressed || !valid)
+    {
+        char address_text[256];
+        address_to_string(address, address_text,sizeof(address_text));
+        if (decrypted && uncompressed)
+            printf("%s: checksum failed in message from %s\n", __func__, address_text);
+        else
+            printf("%s: failed to %s message from %s\n", __func__, decrypted ? "uncompress" : "decrypt", address_text);
+
+        const StatsCounter counter = (decrypted && uncompressed) ? SC_ChecksumFailures : SC_Rejected;
+        stats_add(peer->counters, counter, 1);
+        if (counters)
+            stats_add_shared(counters, counter, 1);
+
+        peer->recv_length = 0; // length zero because theres no available data
+    }
+}
+
 // message originating on both client and server
 bool protocol_reconnect_request(Peer* peer, RemotePeer* remote)
 {
     MsgReconnect* message = (MsgReconnect*)peer->send_buffer;
     message->id = remote->id;
-    message->secret = remote->secret;
+    message->secret = remote->cold->secret;
 
     peer->send_length = sizeof(MsgReconnect);
     MsgType type = (peer->mode == VPNMode_Server ? MT_ServerReconnect : MT_ClientReconnect);
@@ -378,17 +877,20 @@ bool protocol_reconnect_client(Peer* peer, struct sockaddr_storage* remote)
 
     // find a matching peer entry to update its address
     bool found = false;
-    RemotePeer* remote_peer = peer->remote_peers;
+    RemotePeer* remote_peer = peer->owner->remote_peers;
     while(remote_peer)
     {
-        if ((remote_peer->id == message->id) && (remote_peer->secret == message->secret))
+        if ((remote_peer->id == message->id) && (remote_peer->cold->secret == message->secret))
         {
-            remote_peer->real_address = *remote;
-            remote_peer->secret = rand();
+            // reindex it under the new address
+            peer_remove_remote(peer, remote_peer);
+            address_compact(&remote_peer->real_address, remote);
+            peer_insert_remote(peer, remote_peer);
+            remote_peer->cold->secret = rand();
             found = true;
             break;
         }
-        remote_peer = peer->remote_peers->next;
+        remote_peer = remote_peer->next;
     }
 
     // if updated send an acknowledgement
@@ -408,7 +910,7 @@ bool protocol_reconnect_server(Peer* peer, RemotePeer* remote)
 
     // update the secret always
     if (remote->id == message->id)
-        remote->secret = message->secret;
+        remote->cold->secret = message->secret;
 
     return true;
 }
@@ -422,11 +924,39 @@ bool protocol_handshake_request(Peer* peer, RemotePeer* remote)
     MsgHandshake* message = (MsgHandshake*)peer->send_buffer;
     message->protocol = PROTOCOL_ID;
     message->version = PROTOCOL_VERSION;
-    // pure placeholder for illustration purposes
-    message->preferred_cipher = 1;
-    message->cipher_count = 2;
-    message->ciphers[0] = 0xAE5128; // these would be FNV-1a hashes
-    message->ciphers[1] = 0xAE5256;
+    message->preferred_cipher = MSG_NO_CIPHER;
+    // the client offers the integrity checksums it supports (FNV-1a of their names)
+    // and the server answers with the chosen one
+    // the same goes for the compression codec and the cipher, listed after them
+    if (peer->mode == VPNMode_Server)
+    {
+        message->cipher_count = 1;
+        message->ciphers[0] = checksum_get(remote->checksum)->id;
+        if (remote->compression != CP_None)
+            message->ciphers[message->cipher_count++] = compression_get(remote->compression)->id;
+        if (remote->cipher != CI_None)
+        {
+            message->preferred_cipher = message->cipher_count;
+            message->ciphers[message->cipher_count++] = cipher_get(remote->cipher)->id;
+        }
+    }
+    else
+    {
+        message->cipher_count = protocol_offer_checksums(peer->owner->checksum, message->ciphers, 6);
+        if (peer->owner->compression != CP_None)
+            message->ciphers[message->cipher_count++] = compression_get(peer->owner->compression)->id;
+        if (peer->owner->cipher != CI_None)
+        {
+            message->preferred_cipher = message->cipher_count;
+            message->ciphers[message->cipher_count++] = cipher_get(peer->owner->cipher)->id;
+
+            // the same salt for every retry of this handshake, a new one for the next
+            static const uint8_t unset[CIPHER_SALT_SIZE];
+            if (memcmp(remote->cold->salt, unset, CIPHER_SALT_SIZE) == 0 && !cipher_random(remote->cold->salt, CIPHER_SALT_SIZE))
+                return false;
+        }
+    }
+    memcpy(message->salt, remote->cold->salt, CIPHER_SALT_SIZE);
 
     peer->send_length = sizeof(MsgHandshake);
     MsgType type = (peer->mode == VPNMode_Server ? MT_ServerHandshake : MT_ClientHandshake);
@@ -448,50 +978,86 @@ bool protocol_handshake_client(Peer* peer, struct sockaddr_storage* remote)
     if (message->version != PROTOCOL_VERSION)
         return true;
 
+    // another worker may have accepted it already
+    if (peer_find_remote(peer, remote, true))
+        return true;
+
+    CipherType cipher;
+    if (!protocol_negotiate_cipher(peer->owner->cipher, message, &cipher))
+    {
+        printf("%s: rejected %s, %s\n", __func__, remote_text,
+            peer->owner->cipher == CI_None ? "it wants encryption but there is no key" : "it doesn't encrypt");
+        return true;
+    }
+
     // TODO temporal failsafe
-    if (peer->next_id >= peer->total_ids)
+    Peer* owner = peer->owner;
+    if (owner->next_id >= owner->total_ids)
     {
         printf("%s: client IDs exhausted! restart the server to accept more\n", __func__);
         return true;
     }
 
      // create a remote peer representing the new client
-    RemotePeer* new_peer = remotepeer_create();
-    assert(new_peer);
+    RemotePeer* new_peer = remotepeer_create(peer);
+    if (!new_peer)
+        return false;
 
-    new_peer->id = peer->next_id++;
-    new_peer->secret = rand();
+    new_peer->id = owner->next_id++;
+    new_peer->cold->secret = rand();
 
     new_peer->state = PS_Connected;
-    new_peer->real_address = *remote;
-    new_peer->last_recv_time = get_current_timestamp();
-    //new_peer->cipher = ;
-    //new_peer->key = ;
+    address_compact(&new_peer->real_address, remote);
+    new_peer->last_recv_time = peer->clock.ms;
+    new_peer->checksum = protocol_negotiate_checksum(owner->checksum, message);
+    new_peer->compression = protocol_negotiate_compression(owner->compression, message);
+
+    // the session key mixes in a salt from each side, this one goes back in the answer
+    new_peer->cipher = cipher;
+    if (cipher != CI_None)
+    {
+        if (!cipher_random(new_peer->cold->salt, CIPHER_SALT_SIZE))
+        {
+            remotepeer_destroy(peer, new_peer);
+            return false;
+        }
+        cipher_derive_key(owner->key, message->salt, new_peer->cold->salt, new_peer->cold->key);
+    }
 
     // create a fake vpn address based on the id (TODO ipV4 only)
     assert(remote->ss_family == AF_INET);
-    new_peer->vpn_address = peer->tunnel_address_block;
-    struct sockaddr_in* ipv4 = (struct sockaddr_in*)&new_peer->vpn_address;
+    address_compact(&new_peer->vpn_address, &peer->tunnel_address_block);
+    struct sockaddr_in* ipv4 = &new_peer->vpn_address.ipv4;
     uint8_t* last_octet = ((uint8_t*)&ipv4->sin_addr.s_addr) + 3;
     *last_octet = new_peer->id;
-    ipv4->sin_port = ((struct sockaddr_in*)&new_peer->real_address)->sin_port;
+
+    // make it reachable by real and vpn address
+    if (!peer_insert_remote(peer, new_peer) || !peer_insert_host(peer, new_peer))
+    {
+        remotepeer_destroy(peer, new_peer);
+        return false;
+    }
 
     // place it at the end of the list
-    if (!peer->remote_peers)
+    if (!owner->remote_peers)
     {
-        peer->remote_peers = new_peer;
+        owner->remote_peers = new_peer;
     }
     else
     {
-        RemotePeer* last = peer->remote_peers;
+        RemotePeer* last = owner->remote_peers;
         while(last && last->next)
             last = last->next;
         last->next = new_peer;
+        new_peer->prev = last;
     }
 
     char vpn_text[256];
-    address_to_string(&new_peer->vpn_address, vpn_text, sizeof(vpn_text));
-    printf("%s: peer %u (%s) accepted from %s\n", __func__, new_peer->id, vpn_text, remote_text);
+    compact_address_to_string(&new_peer->vpn_address, vpn_text, sizeof(vpn_text));
+    printf("%s: peer %u (%s) accepted from %s (%s checksum, %s compression, %s cipher)\n", __func__, new_peer->id, vpn_text, remote_text,
+        checksum_get(new_peer->checksum)->name, compression_get(new_peer->compression)->name, cipher_get(new_peer->cipher)->name);
+    stats_add(peer->counters, SC_Handshakes, 1);
+    stats_add_shared(peer_remote_counters(peer, new_peer), SC_Handshakes, 1);
 
     // send handshake answer
     if (!protocol_handshake_request(peer, new_peer))
@@ -515,7 +1081,31 @@ bool protocol_handshake_server(Peer* peer, RemotePeer* remote)
     if (message->version != PROTOCOL_VERSION)
         return false;
 
-    printf("%s: handshake successful\n", __func__);
+    remote->checksum = protocol_negotiate_checksum(peer->owner->checksum, message);
+    remote->compression = protocol_negotiate_compression(peer->owner->compression, message);
+
+    CipherType cipher;
+    if (!protocol_negotiate_cipher(peer->owner->cipher, message, &cipher))
+    {
+        printf("%s: %s\n", __func__, peer->owner->cipher == CI_None
+            ? "the server wants encryption but there is no key" : "the server doesn't encrypt, refusing to talk in the clear");
+        return false;
+    }
+
+    // a new session key, the nonces can start over
+    remote->cipher = cipher;
+    if (cipher != CI_None)
+    {
+        cipher_derive_key(peer->owner->key, remote->cold->salt, message->salt, remote->cold->key);
+        remote->cold->nonce = 0;
+        cipher_replay_reset(&remote->cold->replay);
+        memset(remote->cold->salt, 0, CIPHER_SALT_SIZE);
+    }
+
+    printf("%s: handshake successful (%s checksum, %s compression, %s cipher)\n", __func__,
+        checksum_get(remote->checksum)->name, compression_get(remote->compression)->name, cipher_get(remote->cipher)->name);
+    stats_add(peer->counters, SC_Handshakes, 1);
+    stats_add_shared(peer_remote_counters(peer, remote), SC_Handshakes, 1);
 
     // now it can start forwawrding packets
     remote->state = PS_Connected;
@@ -526,13 +1116,14 @@ bool protocol_ping_request(Peer* peer, RemotePeer* remote)
 {
 #if DEBUG
     char remote_text[256];
-    address_to_string(&remote->real_address, remote_text, sizeof(remote_text));
+    compact_address_to_string(&remote->real_address, remote_text, sizeof(remote_text));
     printf_debug("%s: keep-alive to %s after %lums\n", __func__, remote_text, 
-        get_current_timestamp() - remote->last_recv_time);
+        peer->clock.ms - remote->last_recv_time);
 #endif
 
+    // only this side reads it back, so it can be as precise as wanted
     MsgPing* message = (MsgPing*)peer->send_buffer;
-    message->send_time = get_current_timestamp();
+    message->send_time = peer->clock.us;
     message->recv_time = 0;
 
     peer->send_length = sizeof(MsgPing);
@@ -545,7 +1136,7 @@ bool protocol_ping(Peer* peer, RemotePeer* remote)
 
     if (request->header.type == MT_Pong)
     {
-        remote->rtt = get_current_timestamp() - request->send_time;
+        remote->cold->rtt = (uint32_t)(peer->clock.us - request->send_time);
         return true;
     }
 
@@ -554,7 +1145,7 @@ bool protocol_ping(Peer* peer, RemotePeer* remote)
     // could just memcpy the request
     MsgPing* response = (MsgPing*)peer->send_buffer;
     response->send_time = request->send_time;
-    response->recv_time = get_current_timestamp();
+    response->recv_time = peer->clock.us;
 
     peer->send_length = sizeof(MsgPing);
     return protocol_send(peer, remote, MT_Pong);
@@ -563,7 +1154,7 @@ bool protocol_ping(Peer* peer, RemotePeer* remote)
 // message originating on both client and server
 bool protocol_disconnect_request(Peer* peer, RemotePeer* remote)
 {
-    // mark as disconnected and remove it in peer_check_connections()
+    // mark as disconnected and remove it in peer_check_remote()
     remote->state = PS_Disconnected;
 
     MsgDisconnect* message = (MsgDisconnect*)peer->send_buffer;
@@ -579,21 +1170,260 @@ bool protocol_disconnect(Peer* peer, RemotePeer* remote)
     MsgDisconnect* message = (MsgDisconnect*)peer->recv_buffer;
 
     char remote_text[256];
-    address_to_string(&remote->real_address, remote_text, sizeof(remote_text));
+    compact_address_to_string(&remote->real_address, remote_text, sizeof(remote_text));
     printf("disconnection (reason %u) from %s\n", message->reason, remote_text);
 
-    // mark as disconnected and remove it in peer_check_connections()
+    // mark as disconnected and remove it in peer_check_remote() on the next tick
     remote->state = PS_Disconnected;
+    timer_schedule(&peer->owner->timers, &remote->cold->timer, 0);
 
     return true;
 }
 
-bool protocol_data_send(Peer* peer, RemotePeer* remote)
+// adds an already packed data packet to the send batch, sent later by protocol_flush()
+void protocol_data_batch(Peer* peer, Packet* packet)
 {
-    if (peer->send_length == 0)
-        return true;
+    MsgBatch* batch = &peer->send_batch;
+    assert(batch->count < PEER_BATCH_SIZE);
+
+    RemotePeer* remote = packet->remote;
+    const uint32_t index = batch->count;
+    batch->packets[index] = packet;
+    batch->buffers[index] = packet->buffer;
+    batch->lengths[index] = packet->length;
+    address_expand(&batch->addresses[index], &remote->real_address);
+    batch->count++;
+
+    remote->last_send_time = peer->clock.ms;
+}
+
+// packs the data in place and adds the packet to the send batch
+void protocol_data_queue(Peer* peer, RemotePeer* remote, Packet* packet)
+{
+    uint32_t length = packet->length;
+    protocol_pack(peer, remote, MT_Data, packet->buffer, &length);
+    packet_set_length(packet, length);
+    packet->remote = remote;
+
+    protocol_data_batch(peer, packet);
+}
+
+// sends as much of the send batch as the socket takes with as few syscalls as possible
+// the sent packets go back to the pool, the rest stay at the end of the batch for the caller
+bool protocol_send_batch(Peer* peer, uint32_t* sent)
+{
+    MsgBatch* batch = &peer->send_batch;
+
+    bool ok = true;
+    *sent = 0;
+    latency_sample(&peer->latency);
+    const uint64_t start = latency_start(&peer->latency);
+    while(*sent < batch->count)
+    {
+        uint32_t count = batch->count - *sent;
+        SocketResult ret = socket_send_batch(&peer->socket, batch->buffers + *sent, batch->lengths + *sent, batch->addresses + *sent, &count);
+        if (ret == SR_Error)
+        {
+            ok = false;
+            break;
+        }
+        *sent += count;
+        if (ret == SR_Pending)
+        {
+            // the socket will tell when it has room again
+            stats_add(peer->counters, SC_SendBlocked, 1);
+            peer->send_blocked = true;
+            break;
+        }
+    }
+    if (ok && *sent > 0)
+        latency_stage(&peer->latency, LS_SocketSend, start);
 
-    return protocol_send(peer, remote, MT_Data);
+    // consecutive messages usually go to the same remote, their counters are updated once per run
+    uint64_t bytes = 0;
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < *sent; i++)
+    {
+        bytes += batch->lengths[i];
+        run++;
+        if (i + 1 == *sent || batch->packets[i + 1]->remote != batch->packets[i]->remote)
+        {
+            StatsCounters* counters = peer_remote_counters(peer, batch->packets[i]->remote);
+            stats_add_shared(counters, SC_PacketsOut, run);
+            stats_add_shared(counters, SC_BytesOut, bytes);
+            stats_add(peer->counters, SC_PacketsOut, run);
+            stats_add(peer->counters, SC_BytesOut, bytes);
+            bytes = 0;
+            run = 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < *sent; i++)
+    {
+        packet_release(&peer->send_pool, batch->packets[i]);
+        batch->packets[i] = NULL;
+    }
+
+    return ok;
+}
+
+// leaves in the send batch the messages that can go right now, the rest wait in the send queues
+// their remote already has some waiting, or they would go over the rates
+void protocol_admit_batch(Peer* peer, const bool pacing)
+{
+    MsgBatch* batch = &peer->send_batch;
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < batch->count; i++)
+    {
+        Packet* packet = batch->packets[i];
+        bool wait = protocol_remote_waiting(peer, packet->remote);
+        if (!wait && pacing)
+        {
+            const uint64_t time = protocol_pace(peer, packet->remote, packet->length);
+            if (time > 0)
+            {
+                protocol_pace_wakeup(peer, time);
+                wait = true;
+            }
+        }
+
+        if (wait)
+        {
+            protocol_enqueue(peer, packet);
+            continue;
+        }
+
+        if (kept != i)
+        {
+            batch->packets[kept] = packet;
+            batch->buffers[kept] = batch->buffers[i];
+            batch->lengths[kept] = batch->lengths[i];
+            memcpy(&batch->addresses[kept], &batch->addresses[i], sizeof(struct sockaddr_storage));
+        }
+        kept++;
+    }
+    batch->count = kept;
+}
+
+// sends every message queued in the send batch
+// what doesn't fit in the socket or has to be paced waits in the send queues
+bool protocol_flush(Peer* peer)
+{
+    MsgBatch* batch = &peer->send_batch;
+
+    // with the socket full everything waits, otherwise the batch is only filtered when it has to be
+    bool ok = true;
+    uint32_t sent = 0;
+    const bool pacing = protocol_pacing(peer);
+    bool paced = false; // the messages left in the batch took their tokens
+    if (!peer->send_blocked)
+    {
+        if (peer->send_queued > 0 || pacing)
+        {
+            protocol_admit_batch(peer, pacing);
+            paced = pacing;
+        }
+        ok = protocol_send_batch(peer, &sent);
+    }
+
+    for (uint32_t i = sent; i < batch->count; i++)
+    {
+        Packet* packet = batch->packets[i];
+        if (ok)
+        {
+            if (paced)
+                protocol_unpace(peer, packet->remote, packet->length);
+            protocol_enqueue(peer, packet);
+        }
+        else
+            packet_release(&peer->send_pool, packet);
+        batch->packets[i] = NULL;
+    }
+    batch->count = 0;
+
+    return ok;
+}
+
+// sends the messages waiting in the send queues while the socket has room and the rates allow it
+// every queue in turn gets a batch worth of messages, picked and dropped by its fq_codel
+bool protocol_drain(Peer* peer)
+{
+    MsgBatch* batch = &peer->send_batch;
+    assert(batch->count == 0);
+
+    // set again by the queues that still have to wait for their tokens
+    peer->send_wakeup = 0;
+    const bool pacing = protocol_pacing(peer);
+
+    // until the socket is full or every queue left waits for its tokens
+    uint32_t waiting = 0; // queues in a row that only had messages waiting for tokens
+    while(peer->send_active && waiting < peer->send_active_count)
+    {
+        SendQueue* queue = peer->send_active;
+        uint32_t drops = 0;
+        Packet* packet = NULL;
+        while (batch->count < PEER_BATCH_SIZE && (packet = flowqueue_pop(&queue->flows, peer->clock.us, &peer->send_pool, &drops)) != NULL)
+        {
+            // control messages aren't paced here either
+            const bool paced = pacing && packet->flow != CODEL_CONTROL_FLOW;
+            const uint64_t wait = paced ? protocol_pace(peer, packet->remote, packet->length) : 0;
+            if (wait > 0)
+            {
+                flowqueue_unpop(&queue->flows, packet);
+                protocol_pace_wakeup(peer, wait);
+                break;
+            }
+            protocol_data_batch(peer, packet);
+        }
+
+        const uint32_t taken = batch->count;
+        uint32_t sent = 0;
+        const bool ok = protocol_send_batch(peer, &sent);
+
+        // the ones that didn't fit go back in front of their flows, last first
+        for (uint32_t i = taken; i > sent; i--)
+        {
+            packet = batch->packets[i - 1];
+            if (pacing && packet->flow != CODEL_CONTROL_FLOW)
+                protocol_unpace(peer, packet->remote, packet->length);
+            flowqueue_unpop(&queue->flows, packet);
+            batch->packets[i - 1] = NULL;
+        }
+        peer->send_queued -= sent + drops;
+        batch->count = 0;
+
+        if (drops > 0)
+            protocol_count_drops(peer, queue->remote, SC_CodelDrops, drops);
+
+        if (!ok)
+            return false;
+
+        // to the back of the round robin, or out of it if empty
+        peer->send_active = queue->next;
+        if (!peer->send_active)
+            peer->send_active_tail = NULL;
+        queue->next = NULL;
+        queue->active = queue->flows.count > 0;
+        if (queue->active)
+        {
+            if (peer->send_active_tail)
+                peer->send_active_tail->next = queue;
+            else
+                peer->send_active = queue;
+            peer->send_active_tail = queue;
+
+            waiting = (taken == 0) ? waiting + 1 : 0;
+        }
+        else
+            peer->send_active_count--;
+
+        // full again, wait until it has room
+        if (sent < taken)
+            break;
+    }
+
+    return true;
 }
 
 bool protocol_data_receive(Peer* peer, RemotePeer* remote)
@@ -601,14 +1431,16 @@ bool protocol_data_receive(Peer* peer, RemotePeer* remote)
     // skip the header at the beginning of the buffer
     uint8_t* data = peer->recv_buffer + sizeof(MsgHeader);
     const uint32_t data_length = peer->recv_length - sizeof(MsgHeader);
+    uint64_t time = latency_start(&peer->latency);
 
     // NAT
     if (peer->mode == VPNMode_Server)
     {
         // replace the tunnel remote address with the fake vpn address
         // so it can figure out where to send the responses later
-        struct sockaddr_storage* source = &remote->vpn_address;
-        if (!protocol_replace_address(data, data_length, source, true))
+        struct sockaddr_storage source;
+        address_expand(&source, &remote->vpn_address);
+        if (!protocol_replace_address(data, data_length, &source, true))
             return false;
     }
     else
@@ -616,10 +1448,12 @@ bool protocol_data_receive(Peer* peer, RemotePeer* remote)
         if (!protocol_replace_address(data, data_length, &peer->tunnel_local_address, false))
            return false;
     }
+    time = latency_stage(&peer->latency, LS_Nat, time);
         
 
     if (!tunnel_write(&peer->tunnel, data, data_length))
         return false;
+    latency_stage(&peer->latency, LS_TunnelWrite, time);
     
     return true;
 }
@@ -1,10 +1,22 @@
 #include "common.h"
 
+#include <netinet/udp.h>
+#include <linux/filter.h>
+
 // socket wrapper to simplify the BSD interface
 // UDP is assumed right now
 
+// max datagrams moved by a single batched syscall
+#define SOCKET_MAX_BATCH 64
+// limits for UDP segmentation offload (GSO) and its receive counterpart (GRO)
+#define SOCKET_MAX_SEGMENTS 64
+#define SOCKET_MAX_DATAGRAM 65507
+#define SOCKET_GRO_BUFFER_SIZE 65535
+
 typedef struct {
     int fd;
+    bool gro; // the kernel may coalesce several datagrams in a single read
+    bool gso; // the kernel can split a large datagram in segments on send
 } Socket;
 
 typedef enum
@@ -29,7 +41,8 @@ bool socket_is_valid(Socket* socket)
     return (socket && socket->fd != -1);
 }
 
-bool socket_open(Socket* sock, const bool ipV6, const bool nonblocking)
+// offloads are optional and only enabled if the kernel supports them
+bool socket_open(Socket* sock, const bool ipV6, const bool nonblocking, const bool offloads)
 {  
     if (!sock)
         return false;
@@ -68,11 +81,27 @@ bool socket_open(Socket* sock, const bool ipV6, const bool nonblocking)
         }
     }
 
+    bool gro = false;
+    bool gso = false;
+    if (offloads)
+    {
+        int32_t enable = 1;
+        gro = (setsockopt(s, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0);
+
+        // a zero segment size keeps normal sends unsegmented, it only probes for support
+        int32_t segment = 0;
+        gso = (setsockopt(s, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0);
+
+        printf_debug("%s: UDP GRO %s, UDP GSO %s\n", __func__, gro ? "enabled" : "unavailable", gso ? "enabled" : "unavailable");
+    }
+
     // set the socket only if everything went fine
     if (sock->fd != -1)
         close(sock->fd);
 
     sock->fd = s;
+    sock->gro = gro;
+    sock->gso = gso;
 
     return true;
 }
@@ -89,6 +118,8 @@ bool socket_close(Socket* socket)
     }
 
     socket->fd = -1;
+    socket->gro = false;
+    socket->gso = false;
     return true;
 }
 
@@ -113,6 +144,90 @@ bool socket_set_buffer_sizes(Socket* socket, const int32_t recv_size, const int3
     return true;
 }
 
+// lets several sockets bind to the same address, incoming datagrams are spread between them
+bool socket_set_reuse_port(Socket* socket)
+{
+    if (!socket_is_valid(socket))
+        return false;
+
+    int32_t reuse = 1;
+    if (setsockopt(socket->fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1)
+    {
+        print_errno(__func__, "error setting socket port reuse", errno);
+        return false;
+    }
+    return true;
+}
+
+// steers every client to the same socket of a SO_REUSEPORT group
+// the classic BPF program hashes the source address and port and picks the socket
+// by its position in the group (the order they were bound in)
+// the mapping only holds while the group has exactly shards sockets: when one closes the
+// kernel moves the last socket into its slot, and positions past the end fall back to the
+// default hash, so clients do move between threads then
+bool socket_set_steering(Socket* socket, const uint32_t shards)
+{
+    if (!socket_is_valid(socket) || shards == 0)
+        return false;
+
+    // the program sees the UDP payload, the headers are reached through SKF_NET_OFF
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, SKF_NET_OFF + 0),      // ip version
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,   4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   4, 0, 5),
+        // IPv4 (no options expected)
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 12),     // source address
+        BPF_STMT(BPF_MISC| BPF_TAX,           0),
+        BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, SKF_NET_OFF + 20),     // source port
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+        BPF_JUMP(BPF_JMP | BPF_JA,            13, 0, 0),
+        // IPv6
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 8),      // source address
+        BPF_STMT(BPF_MISC| BPF_TAX,           0),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+        BPF_STMT(BPF_MISC| BPF_TAX,           0),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 16),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+        BPF_STMT(BPF_MISC| BPF_TAX,           0),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 20),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+        BPF_STMT(BPF_MISC| BPF_TAX,           0),
+        BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, SKF_NET_OFF + 40),     // source port
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X,   0),
+        // mix the bits (fibonacci hashing) and take the shard from the top ones
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K,   0x9E3779B1),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K,   16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K,   shards),
+        BPF_STMT(BPF_RET | BPF_A,             0),
+    };
+
+    struct sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+
+    if (setsockopt(socket->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1)
+    {
+        print_errno(__func__, "error attaching the steering program", errno);
+        return false;
+    }
+    return true;
+}
+
+bool socket_get_local_address(Socket* socket, struct sockaddr_storage* address)
+{
+    if (!socket_is_valid(socket))
+        return false;
+
+    socklen_t length = sizeof(*address);
+    if (getsockname(socket->fd, (struct sockaddr*)address, &length) == -1)
+    {
+        print_errno(__func__, "error retrieving socket address", errno);
+        return false;
+    }
+    return true;
+}
+
 bool socket_set_mark(Socket* socket, const uint32_t mark)
 {
     if (!socket_is_valid(socket))
@@ -215,7 +330,7 @@ SocketResult socket_send(Socket* socket, const uint8_t* buffer, uint32_t* length
     if (!socket_is_valid(socket))
         return SR_Error;
     
-    ssize_t sent = sendto(socket->fd, buffer, *length, 0, (struct sockaddr*)remote, sizeof(*remote) );
+    ssize_t sent = sendto(socket->fd, buffer, *length, 0, (struct sockaddr*)remote, address_length(remote) );
     if (sent == -1)
     {
         int32_t error = errno;
@@ -241,10 +356,175 @@ SocketResult socket_send(Socket* socket, const uint8_t* buffer, uint32_t* length
     return SR_Success;
 }
 
+// receives up to *count datagrams with a single syscall
+// lengths hold the size of each buffer and are updated with the received sizes
+// if GRO is enabled segments receive the size of each coalesced datagram (zero if not coalesced)
+// *count is updated with the number of datagrams received
+SocketResult socket_receive_batch(Socket* socket, uint8_t** buffers, uint32_t* lengths, uint32_t* segments, struct sockaddr_storage* remotes, uint32_t* count)
+{
+    if (!socket_is_valid(socket))
+        return SR_Error;
+
+    const uint32_t capacity = *count < SOCKET_MAX_BATCH ? *count : SOCKET_MAX_BATCH;
+    *count = 0;
+
+    struct mmsghdr messages[SOCKET_MAX_BATCH];
+    struct iovec vectors[SOCKET_MAX_BATCH];
+    uint8_t controls[SOCKET_MAX_BATCH][CMSG_SPACE(sizeof(int32_t))];
+    memset(messages, 0, sizeof(struct mmsghdr) * capacity);
+
+    for (uint32_t i = 0; i < capacity; i++)
+    {
+        vectors[i].iov_base = buffers[i];
+        vectors[i].iov_len = lengths[i];
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+        messages[i].msg_hdr.msg_name = remotes ? &remotes[i] : NULL;
+        messages[i].msg_hdr.msg_namelen = remotes ? sizeof(remotes[i]) : 0;
+
+        if (socket->gro)
+        {
+            messages[i].msg_hdr.msg_control = controls[i];
+            messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+        }
+    }
+
+    int received = recvmmsg(socket->fd, messages, capacity, 0, NULL);
+    if (received == -1)
+    {
+        int32_t error = errno;
+        if (error == EAGAIN || error == EWOULDBLOCK)
+            return SR_Pending;
+
+        print_errno(__func__, "error reading from socket", error);
+        return SR_Error;
+    }
+
+    for (int i = 0; i < received; i++)
+    {
+        lengths[i] = messages[i].msg_len;
+        if (!segments)
+            continue;
+
+        segments[i] = 0;
+        struct msghdr* header = &messages[i].msg_hdr;
+        for (struct cmsghdr* control = CMSG_FIRSTHDR(header); control; control = CMSG_NXTHDR(header, control))
+        {
+            if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO)
+            {
+                int32_t segment = 0;
+                memcpy(&segment, CMSG_DATA(control), sizeof(segment));
+                segments[i] = (uint32_t)segment;
+            }
+        }
+    }
+
+    *count = (uint32_t)received;
+    return SR_Success;
+}
+
+// groups consecutive datagrams to the same address that the kernel can segment
+// all of them must have the same size except the last one which can be shorter
+uint32_t socket_gso_group(const uint32_t* lengths, const struct sockaddr_storage* remotes, const uint32_t count)
+{
+    const uint32_t segment = lengths[0];
+    uint32_t total = segment;
+    uint32_t grouped = 1;
+    while(grouped < count && grouped < SOCKET_MAX_SEGMENTS)
+    {
+        if (lengths[grouped] > segment || total + lengths[grouped] > SOCKET_MAX_DATAGRAM)
+            break;
+        if (!address_equal((struct sockaddr_storage*)&remotes[0], (struct sockaddr_storage*)&remotes[grouped]))
+            break;
+
+        total += lengths[grouped];
+        grouped++;
+
+        // a shorter datagram closes the group
+        if (lengths[grouped - 1] < segment)
+            break;
+    }
+    return grouped;
+}
+
+// sends up to *count datagrams with a single syscall
+// with GSO enabled runs of datagrams to the same address leave as a single segmented buffer
+// *count is updated with the number of datagrams sent, which may be less than requested
+SocketResult socket_send_batch(Socket* socket, uint8_t** buffers, const uint32_t* lengths, const struct sockaddr_storage* remotes, uint32_t* count)
+{
+    if (!socket_is_valid(socket))
+        return SR_Error;
+
+    const uint32_t capacity = *count < SOCKET_MAX_BATCH ? *count : SOCKET_MAX_BATCH;
+    *count = 0;
+
+    struct mmsghdr messages[SOCKET_MAX_BATCH];
+    struct iovec vectors[SOCKET_MAX_BATCH];
+    uint32_t grouped[SOCKET_MAX_BATCH];
+    uint8_t controls[SOCKET_MAX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    memset(messages, 0, sizeof(struct mmsghdr) * capacity);
+
+    uint32_t message_count = 0;
+    for (uint32_t i = 0; i < capacity; i += grouped[message_count++])
+    {
+        struct msghdr* header = &messages[message_count].msg_hdr;
+        grouped[message_count] = socket->gso ? socket_gso_group(lengths + i, remotes + i, capacity - i) : 1;
+
+        for (uint32_t j = 0; j < grouped[message_count]; j++)
+        {
+            vectors[i + j].iov_base = buffers[i + j];
+            vectors[i + j].iov_len = lengths[i + j];
+        }
+        header->msg_iov = &vectors[i];
+        header->msg_iovlen = grouped[message_count];
+        header->msg_name = (void*)&remotes[i];
+        header->msg_namelen = address_length(&remotes[i]);
+
+        // tell the kernel where to split the buffer
+        if (grouped[message_count] > 1)
+        {
+            const uint16_t segment = (uint16_t)lengths[i];
+            header->msg_control = controls[message_count];
+            header->msg_controllen = sizeof(controls[message_count]);
+            struct cmsghdr* control = CMSG_FIRSTHDR(header);
+            control->cmsg_level = SOL_UDP;
+            control->cmsg_type = UDP_SEGMENT;
+            control->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(control), &segment, sizeof(segment));
+        }
+    }
+
+    int sent = sendmmsg(socket->fd, messages, message_count, 0);
+    if (sent == -1)
+    {
+        int32_t error = errno;
+        if (error == EAGAIN || error == EWOULDBLOCK)
+            return SR_Pending;
+
+        // the output device may not support segmentation after all
+        if (socket->gso && (error == EIO || error == EINVAL || error == ENOPROTOOPT) && message_count < capacity)
+        {
+            print_errno(__func__, "error sending segmented datagrams, disabling UDP GSO", error);
+            socket->gso = false;
+            *count = capacity;
+            return socket_send_batch(socket, buffers, lengths, remotes, count);
+        }
+
+        print_errno(__func__, "error writing to socket", error);
+        return SR_Error;
+    }
+
+    // report sent datagrams, not sent groups
+    for (int i = 0; i < sent; i++)
+        *count += grouped[i];
+
+    return SR_Success;
+}
+
 bool check_socket_privileges()
 {
     Socket dummy;
-    if (!socket_open(&dummy, false, true))
+    if (!socket_open(&dummy, false, true, false))
         return false;
 
     if (!socket_set_mark(&dummy, 0x1))
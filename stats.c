@@ -0,0 +1,216 @@
+#include "common.h"
+
+#include <glob.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+// counters kept in a memory mapped file so they can be watched live from another process
+// the layout is fixed: only 64-bit counters after a small header, every set on its own cache lines
+// writers use relaxed atomics, a reader may see a set half updated but never a torn counter
+
+#define STATS_DIRECTORY "/dev/shm"
+#define STATS_MAGIC 0x53544154 // "STAT"
+#define STATS_VERSION 2
+#define STATS_MAX_QUEUES 64 // at least PEER_MAX_QUEUES
+#define STATS_MAX_REMOTES 256 // slot 0 gathers the remote peers without a slot of their own
+
+typedef enum {
+    SC_PacketsIn = 0, // messages received
+    SC_BytesIn,
+    SC_PacketsOut, // messages sent
+    SC_BytesOut,
+    SC_ChecksumFailures,
+    SC_Rejected, // failed to decrypt or uncompress
+    SC_Blackholed, // tunnel packets with nowhere to go
+    SC_SendBlocked, // sends that found the socket full and left messages in the send queues
+    SC_Handshakes, // completed
+    SC_Timeouts, // disconnections for staying silent too long
+    SC_QueueDrops, // messages dropped because the send queue of their remote peer was full
+    SC_CodelDrops, // messages dropped for waiting too long in the send queues
+    SC_Count
+} StatsCounter;
+
+const char* const stats_counter_names[SC_Count] = {
+    "packets in", "bytes in", "packets out", "bytes out", "checksum failures",
+    "rejected", "blackholed", "send blocked", "handshakes", "timeouts",
+    "queue drops", "codel drops"
+};
+
+typedef struct {
+    uint64_t values[SC_Count];
+} __attribute__((aligned(64))) StatsCounters;
+
+typedef struct {
+    uint32_t active; // set last when the slot is taken
+    uint32_t id;
+    char address[64]; // real address as text
+    char vpn_address[64];
+    StatsCounters counters;
+} __attribute__((aligned(64))) StatsRemote;
+
+typedef struct {
+    uint32_t magic; // written last, once everything else is in place
+    uint32_t version;
+    uint32_t counter_count; // SC_Count of the writer
+    uint32_t queue_count;
+    uint32_t pid;
+    uint32_t mode; // VPNMode
+    uint64_t start_time; // seconds since the epoch
+    char interface[16];
+    uint64_t ticks_per_second; // of the latency time source
+    uint32_t latency_sampling; // set by vpn-stats: time one message of every n, zero to stop
+
+    // one set per queue thread so each has a single writer, the reader adds them up
+    StatsCounters queues[STATS_MAX_QUEUES];
+    StatsRemote remotes[STATS_MAX_REMOTES];
+    LatencyHistogram latency[STATS_MAX_QUEUES][LS_Count];
+} __attribute__((aligned(64))) StatsPage;
+
+// the mapping as seen by the process writing it
+typedef struct {
+    StatsPage* page;
+    bool mapped; // private memory if the file couldn't be created
+    char path[64];
+} StatsRegion;
+
+// where peers count before they have a page
+StatsCounters stats_discard;
+
+// the pid keeps apart the processes using the same interface name in different namespaces
+void stats_path(const char* process, const char* interface, char* path, const uint32_t length)
+{
+    snprintf(path, length, "%s/vpn-poc.%s.%s", STATS_DIRECTORY, process, interface);
+}
+
+// counters written by a single thread, no locked instruction needed
+void stats_add(StatsCounters* counters, const StatsCounter counter, const uint64_t value)
+{
+    __atomic_store_n(&counters->values[counter], __atomic_load_n(&counters->values[counter], __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// counters written by several threads
+void stats_add_shared(StatsCounters* counters, const StatsCounter counter, const uint64_t value)
+{
+    __atomic_fetch_add(&counters->values[counter], value, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get(const StatsCounters* counters, const StatsCounter counter)
+{
+    return __atomic_load_n(&counters->values[counter], __ATOMIC_RELAXED);
+}
+
+// the files of processes killed before cleaning up
+void stats_remove_stale(const char* interface)
+{
+    char pattern[64];
+    stats_path("*", interface, pattern, sizeof(pattern));
+
+    glob_t found;
+    if (glob(pattern, 0, NULL, &found) != 0)
+        return;
+
+    const size_t prefix = strlen(STATS_DIRECTORY "/vpn-poc.");
+    for (size_t i = 0; i < found.gl_pathc; i++)
+    {
+        const int pid = atoi(found.gl_pathv[i] + prefix);
+        if (pid > 0 && kill((pid_t)pid, 0) == -1 && errno == ESRCH)
+            unlink(found.gl_pathv[i]);
+    }
+    globfree(&found);
+}
+
+// falls back to private memory so counting never has to check for a page
+bool stats_open(StatsRegion* region, const char* interface, const VPNMode mode, const uint32_t queues)
+{
+    memset(region, 0, sizeof(StatsRegion));
+    stats_remove_stale(interface);
+
+    char process[16];
+    snprintf(process, sizeof(process), "%d", (int)getpid());
+    stats_path(process, interface, region->path, sizeof(region->path));
+
+    void* memory = MAP_FAILED;
+    int fd = open(region->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        print_errno(__func__, "error creating the stats file", errno);
+    else if (ftruncate(fd, sizeof(StatsPage)) == -1)
+        print_errno(__func__, "error sizing the stats file", errno);
+    else
+        memory = mmap(NULL, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (fd != -1)
+        close(fd);
+
+    if (memory != MAP_FAILED)
+    {
+        region->page = (StatsPage*)memory;
+        region->mapped = true;
+    }
+    else
+    {
+        if (fd != -1)
+        {
+            print_errno(__func__, "error mapping the stats file", errno);
+            unlink(region->path);
+        }
+        printf("%s: the counters won't be visible from outside\n", __func__);
+        if (posix_memalign(&memory, 64, sizeof(StatsPage)) != 0)
+            return false;
+        memset(memory, 0, sizeof(StatsPage));
+        region->page = (StatsPage*)memory;
+    }
+
+    StatsPage* page = region->page;
+    page->version = STATS_VERSION;
+    page->counter_count = SC_Count;
+    page->queue_count = queues;
+    page->pid = (uint32_t)getpid();
+    page->mode = (uint32_t)mode;
+    page->start_time = (uint64_t)time(NULL);
+    strncpy(page->interface, interface, sizeof(page->interface) - 1);
+    page->ticks_per_second = latency_ticks_per_second();
+    __atomic_store_n(&page->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+void stats_close(StatsRegion* region)
+{
+    if (!region->page)
+        return;
+
+    if (region->mapped)
+    {
+        munmap(region->page, sizeof(StatsPage));
+        unlink(region->path);
+    }
+    else
+    {
+        free(region->page);
+    }
+    memset(region, 0, sizeof(StatsRegion));
+}
+
+// returns the slot taken, zero if they are all in use
+uint32_t stats_claim_remote(StatsPage* page, const uint32_t id)
+{
+    for (uint32_t i = 1; i < STATS_MAX_REMOTES; i++)
+    {
+        StatsRemote* remote = &page->remotes[i];
+        if (__atomic_load_n(&remote->active, __ATOMIC_RELAXED))
+            continue;
+
+        memset(&remote->counters, 0, sizeof(StatsCounters));
+        memset(remote->address, 0, sizeof(remote->address));
+        memset(remote->vpn_address, 0, sizeof(remote->vpn_address));
+        remote->id = id;
+        __atomic_store_n(&remote->active, 1, __ATOMIC_RELEASE);
+        return i;
+    }
+    return 0;
+}
+
+void stats_release_remote(StatsPage* page, const uint32_t slot)
+{
+    if (slot > 0)
+        __atomic_store_n(&page->remotes[slot].active, 0, __ATOMIC_RELEASE);
+}
\ No newline at end of file
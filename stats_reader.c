@@ -0,0 +1,333 @@
+#include "common.h"
+
+#include <sys/stat.h>
+
+// live view of the counters every running vpn publishes in its stats file
+// shows the totals and the rates since the previous refresh, and the latency of each stage when sampled
+
+#define READER_MAX_PAGES 8
+#define READER_INTERVAL 1000 // ms
+
+// previous values to compute the rates, remembered by file
+typedef struct {
+    char path[64];
+    uint32_t pid;
+    uint64_t totals[SC_Count];
+    uint64_t remotes[STATS_MAX_REMOTES][SC_Count];
+} ReaderHistory;
+
+typedef struct {
+    ReaderHistory history[READER_MAX_PAGES];
+    uint32_t history_count;
+    uint64_t last_time;
+} Reader;
+
+const StatsPage* reader_map(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat info;
+    void* memory = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(StatsPage))
+        memory = mmap(NULL, sizeof(StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (memory == MAP_FAILED)
+        return NULL;
+
+    const StatsPage* page = (const StatsPage*)memory;
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC || page->version != STATS_VERSION || page->counter_count != SC_Count)
+    {
+        munmap(memory, sizeof(StatsPage));
+        return NULL;
+    }
+    return page;
+}
+
+ReaderHistory* reader_history(Reader* reader, const char* path, const uint32_t pid)
+{
+    for (uint32_t i = 0; i < reader->history_count; i++)
+    {
+        ReaderHistory* history = &reader->history[i];
+        if (strcmp(history->path, path) == 0)
+        {
+            // same file, different process: start over
+            if (history->pid != pid)
+            {
+                memset(history, 0, sizeof(ReaderHistory));
+                strncpy(history->path, path, sizeof(history->path) - 1);
+                history->pid = pid;
+            }
+            return history;
+        }
+    }
+
+    if (reader->history_count == READER_MAX_PAGES)
+        return NULL;
+
+    ReaderHistory* history = &reader->history[reader->history_count++];
+    memset(history, 0, sizeof(ReaderHistory));
+    strncpy(history->path, path, sizeof(history->path) - 1);
+    history->pid = pid;
+    return history;
+}
+
+// asks every matching vpn to time one message of every 'sampling', zero stops timing
+bool reader_set_sampling(const char* interface, const uint32_t sampling)
+{
+    char pattern[64];
+    stats_path("*", interface ? interface : "*", pattern, sizeof(pattern));
+
+    glob_t found;
+    if (glob(pattern, 0, NULL, &found) != 0)
+    {
+        printf("no stats found in %s\n", pattern);
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < found.gl_pathc; i++)
+    {
+        int fd = open(found.gl_pathv[i], O_RDWR | O_CLOEXEC);
+        if (fd == -1)
+        {
+            print_errno(__func__, "error opening the stats file", errno);
+            ok = false;
+            continue;
+        }
+
+        struct stat info;
+        void* memory = MAP_FAILED;
+        if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(StatsPage))
+            memory = mmap(NULL, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        StatsPage* page = (StatsPage*)memory;
+        if (memory == MAP_FAILED || page->version != STATS_VERSION)
+        {
+            printf("%s: %s is not a stats file this version understands\n", __func__, found.gl_pathv[i]);
+            if (memory != MAP_FAILED)
+                munmap(memory, sizeof(StatsPage));
+            ok = false;
+            continue;
+        }
+
+        __atomic_store_n(&page->latency_sampling, sampling, __ATOMIC_RELAXED);
+        munmap(memory, sizeof(StatsPage));
+    }
+
+    globfree(&found);
+    return ok;
+}
+
+double reader_rate(const uint64_t current, const uint64_t previous, const double seconds)
+{
+    return (current >= previous && seconds > 0) ? (current - previous) / seconds : 0;
+}
+
+// percentiles of every stage since the vpn started, all the queues together
+void reader_show_latency(const StatsPage* page, const uint32_t queues)
+{
+    const uint32_t sampling = __atomic_load_n(&page->latency_sampling, __ATOMIC_RELAXED);
+    const double nanoseconds = page->ticks_per_second ? 1e9 / page->ticks_per_second : 1;
+
+    bool header = false;
+    for (uint32_t s = 0; s < LS_Count; s++)
+    {
+        uint64_t buckets[LATENCY_BUCKETS];
+        uint64_t count = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for (uint32_t q = 0; q < queues; q++)
+        {
+            const LatencyHistogram* histogram = &page->latency[q][s];
+            for (uint32_t b = 0; b < LATENCY_BUCKETS; b++)
+            {
+                const uint64_t value = __atomic_load_n(&histogram->buckets[b], __ATOMIC_RELAXED);
+                buckets[b] += value;
+                count += value;
+            }
+        }
+        if (count == 0)
+            continue;
+
+        if (!header)
+        {
+            if (sampling)
+                printf("  latency in ns, one message of every %u\n", sampling);
+            else
+                printf("  latency in ns, not sampling now\n");
+            printf("    %-20s %12s %10s %10s %10s\n", "", "samples", "p50", "p99", "p99.9");
+            header = true;
+        }
+        printf("    %-20s %12llu %10.0f %10.0f %10.0f\n", latency_stage_names[s], (unsigned long long)count,
+            latency_percentile(buckets, count, 0.5) * nanoseconds,
+            latency_percentile(buckets, count, 0.99) * nanoseconds,
+            latency_percentile(buckets, count, 0.999) * nanoseconds);
+    }
+}
+
+// 'print' false only takes the sample the next rates are computed from
+void reader_show_page(Reader* reader, const char* path, const double seconds, const bool print)
+{
+    const StatsPage* page = reader_map(path);
+    if (!page)
+        return;
+
+    ReaderHistory* history = reader_history(reader, path, page->pid);
+
+    uint64_t totals[SC_Count];
+    memset(totals, 0, sizeof(totals));
+    const uint32_t queues = page->queue_count < STATS_MAX_QUEUES ? page->queue_count : STATS_MAX_QUEUES;
+    for (uint32_t q = 0; q < queues; q++)
+    {
+        for (uint32_t c = 0; c < SC_Count; c++)
+            totals[c] += stats_get(&page->queues[q], (StatsCounter)c);
+    }
+
+    if (print)
+    {
+        const bool running = kill((pid_t)page->pid, 0) == 0 || errno == EPERM;
+        const uint64_t uptime = (uint64_t)time(NULL) - page->start_time;
+        char interface[sizeof(page->interface) + 1];
+        memcpy(interface, page->interface, sizeof(page->interface));
+        interface[sizeof(page->interface)] = '\0';
+
+        printf("%s: %s, pid %u%s, up %02u:%02u:%02u\n", interface, page->mode == VPNMode_Server ? "server" : "client",
+            page->pid, running ? "" : " (not running)",
+            (uint32_t)(uptime / 3600), (uint32_t)(uptime / 60 % 60), (uint32_t)(uptime % 60));
+
+        printf("    %-20s %16s %14s\n", "", "total", "per second");
+        for (uint32_t c = 0; c < SC_Count; c++)
+        {
+            const double rate = history ? reader_rate(totals[c], history->totals[c], seconds) : 0;
+            if (c == SC_BytesIn || c == SC_BytesOut)
+                printf("    %-20s %16llu %9.1f Mbit\n", stats_counter_names[c], (unsigned long long)totals[c], rate * 8 / 1e6);
+            else
+                printf("    %-20s %16llu %14.0f\n", stats_counter_names[c], (unsigned long long)totals[c], rate);
+        }
+    }
+
+    // slot 0 shows up only when some remote peer didn't get a slot
+    for (uint32_t slot = 0; slot < STATS_MAX_REMOTES; slot++)
+    {
+        const StatsRemote* remote = &page->remotes[slot];
+        if (slot > 0 && !__atomic_load_n(&remote->active, __ATOMIC_ACQUIRE))
+            continue;
+
+        uint64_t values[SC_Count];
+        for (uint32_t c = 0; c < SC_Count; c++)
+            values[c] = stats_get(&remote->counters, (StatsCounter)c);
+        if (slot == 0 && values[SC_PacketsIn] == 0 && values[SC_PacketsOut] == 0)
+            continue;
+
+        const uint64_t* previous = history ? history->remotes[slot] : values;
+        if (print)
+        {
+            char address[sizeof(remote->address) + 1];
+            char vpn_address[sizeof(remote->vpn_address) + 1];
+            memcpy(address, remote->address, sizeof(remote->address));
+            memcpy(vpn_address, remote->vpn_address, sizeof(remote->vpn_address));
+            address[sizeof(remote->address)] = '\0';
+            vpn_address[sizeof(remote->vpn_address)] = '\0';
+
+            if (slot == 0)
+                printf("  remote peers without a slot\n");
+            else
+                printf("  remote %u %s%s%s\n", remote->id, address, vpn_address[0] ? " as " : "", vpn_address);
+            printf("    in %.0f pps %.1f Mbit/s, out %.0f pps %.1f Mbit/s\n",
+                reader_rate(values[SC_PacketsIn], previous[SC_PacketsIn], seconds),
+                reader_rate(values[SC_BytesIn], previous[SC_BytesIn], seconds) * 8 / 1e6,
+                reader_rate(values[SC_PacketsOut], previous[SC_PacketsOut], seconds),
+                reader_rate(values[SC_BytesOut], previous[SC_BytesOut], seconds) * 8 / 1e6);
+            printf("    %llu packets in, %llu out, %llu checksum failures, %llu rejected, %llu handshakes\n",
+                (unsigned long long)values[SC_PacketsIn], (unsigned long long)values[SC_PacketsOut],
+                (unsigned long long)values[SC_ChecksumFailures], (unsigned long long)values[SC_Rejected],
+                (unsigned long long)values[SC_Handshakes]);
+        }
+
+        if (history)
+            memcpy(history->remotes[slot], values, sizeof(values));
+    }
+
+    if (print)
+        reader_show_latency(page, queues);
+
+    if (history)
+        memcpy(history->totals, totals, sizeof(totals));
+
+    munmap((void*)page, sizeof(StatsPage));
+    if (print)
+        printf("\n");
+}
+
+bool reader_show(Reader* reader, const char* interface, const bool clear, const bool print)
+{
+    char pattern[64];
+    stats_path("*", interface ? interface : "*", pattern, sizeof(pattern));
+
+    glob_t found;
+    if (glob(pattern, 0, NULL, &found) != 0)
+    {
+        printf("no stats found in %s\n", pattern);
+        return false;
+    }
+
+    const uint64_t now = get_current_timestamp();
+    const double seconds = reader->last_time ? (now - reader->last_time) / 1000.0 : 0;
+    reader->last_time = now;
+
+    if (clear)
+        printf("\033[H\033[J");
+    for (size_t i = 0; i < found.gl_pathc; i++)
+        reader_show_page(reader, found.gl_pathv[i], seconds, print);
+
+    globfree(&found);
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    const char* interface = NULL;
+    bool once = false;
+    int64_t sampling = -1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-1") == 0)
+            once = true;
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9')
+            sampling = strtoul(argv[++i], NULL, 10);
+        else if (argv[i][0] != '-' && !interface)
+            interface = argv[i];
+        else
+        {
+            printf("\nUsage: %s [<tunnel interface>] [-1] [-l <n>]\n", argv[0]);
+            printf("\tshows the counters of the vpn running on the interface (all of them by default) every second.\n");
+            printf("\t-1\tshow them once, after sampling for a second, and exit.\n");
+            printf("\t-l n\ttime the stages of one message of every n from now on, 0 stops timing.\n");
+            return -1;
+        }
+    }
+
+    if (sampling >= 0 && !reader_set_sampling(interface, (uint32_t)(sampling > UINT32_MAX ? UINT32_MAX : sampling)))
+        return -1;
+
+    Reader* reader = (Reader*)calloc(1, sizeof(Reader));
+    if (!reader)
+        return -1;
+
+    // the first sample only gives the totals, the rates need a second one
+    bool ok = reader_show(reader, interface, false, !once);
+    while(ok)
+    {
+        usleep(READER_INTERVAL * 1000);
+        ok = reader_show(reader, interface, !once, true);
+        if (once)
+            break;
+    }
+
+    free(reader);
+    return ok ? 0 : -1;
+}
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "common.h"
+
+// hierarchical timer wheel, so only the timers that expire are touched
+// the first level has a slot per tick (ms) and every level above covers the whole level below in each slot
+// timers far away wait in the upper levels and move down (cascade) as their time approaches
+// scheduling and cancelling are O(1), advancing costs one step per elapsed tick plus the expired timers
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4 // 64 ms, 4 s, 4.4 min and 4.6 h
+#define TIMER_WHEEL_RANGE (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer_node_t;
+typedef struct timer_node_t TimerNode;
+
+// embedded in whatever needs a timer, 'data' points back to it
+struct timer_node_t {
+    TimerNode* next;
+    TimerNode** pprev; // the pointer to this node, NULL while not scheduled
+    uint64_t expires;
+    void* data;
+};
+
+typedef struct {
+    uint64_t now; // last tick processed
+    uint32_t count; // scheduled timers
+    TimerNode* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel* wheel, const uint64_t now)
+{
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now = now;
+}
+
+bool timer_pending(const TimerNode* node)
+{
+    return node->pprev != NULL;
+}
+
+void timer_link(TimerNode** head, TimerNode* node)
+{
+    node->next = *head;
+    if (node->next)
+        node->next->pprev = &node->next;
+    node->pprev = head;
+    *head = node;
+}
+
+void timer_unlink(TimerNode* node)
+{
+    *node->pprev = node->next;
+    if (node->next)
+        node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+// the lowest level whose range covers the distance, in the slot of the tick it expires
+// 'first' is the earliest tick still to be processed, where the already expired ones go
+void timer_place(TimerWheel* wheel, TimerNode* node, const uint64_t first)
+{
+    uint64_t expires = node->expires > first ? node->expires : first;
+    if (expires - wheel->now >= TIMER_WHEEL_RANGE)
+        expires = wheel->now + TIMER_WHEEL_RANGE - 1; // checked again when it goes off
+
+    const uint64_t distance = expires - wheel->now;
+    uint32_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && distance >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+
+    const uint32_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer_link(&wheel->slots[level][slot], node);
+}
+
+void timer_cancel(TimerWheel* wheel, TimerNode* node)
+{
+    if (!timer_pending(node))
+        return;
+
+    timer_unlink(node);
+    wheel->count--;
+}
+
+// (re)schedules the node to expire at the given time
+void timer_schedule(TimerWheel* wheel, TimerNode* node, const uint64_t expires)
+{
+    timer_cancel(wheel, node);
+    node->expires = expires;
+    timer_place(wheel, node, wheel->now + 1);
+    wheel->count++;
+}
+
+// moves the timers expiring up to 'now' into the 'expired' list, which keeps them scheduled
+// so taking them out with timer_cancel() works even if the handler of another one cancels them first
+void timer_wheel_advance(TimerWheel* wheel, const uint64_t now, TimerNode** expired)
+{
+    // nothing can expire in between
+    if (wheel->count == 0 && now > wheel->now)
+        wheel->now = now;
+
+    while (wheel->now < now)
+    {
+        const uint64_t tick = ++wheel->now;
+
+        // from the top so the timers moving down can keep going in the same tick
+        for (uint32_t level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            const uint32_t shift = TIMER_WHEEL_BITS * level;
+            if ((tick & ((1ULL << shift) - 1)) != 0)
+                continue;
+
+            TimerNode** head = &wheel->slots[level][(tick >> shift) & TIMER_WHEEL_MASK];
+            while (*head)
+            {
+                TimerNode* node = *head;
+                timer_unlink(node);
+                timer_place(wheel, node, tick);
+            }
+        }
+
+        TimerNode** head = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+        while (*head)
+        {
+            TimerNode* node = *head;
+            timer_unlink(node);
+            timer_link(expired, node);
+        }
+    }
+}
\ No newline at end of file
@@ -1,450 +1,1326 @@
-#include "common.h"
-
-#include <linux/if.h>
-#include <linux/if_tun.h>
-#include <sys/ioctl.h>
-
-// tunnel wrapper to abstract TUN device management
-
-// mkdir /dev/net (if it doesn't exist already)
-// mknod /dev/net/tun c 10 200
-// chmod 0666 /dev/net/tun
-// modprobe tun
-
-typedef struct
-{
-   int fd;
-   int socket;
-   char if_name[IF_NAMESIZE];
-} Tunnel;
-
-bool check_tun_privileges()
-{
-   int fd = open("/dev/net/tun", O_RDWR);
-   bool ok = (fd > 0);
-   close(fd);
-   return ok;
-}
-
-int32_t allocate_tun_device(char* device_name)
-{
-   if (!device_name)
-      return -1;
-
-   int32_t tun_fd = open("/dev/net/tun", O_RDWR);
-   if (tun_fd < 0)
-   {
-      print_errno(__func__, "failed to open /dev/net/tun", errno);
-      return -1;
-   }
-
-   // IFF_TUN   - TUN device (no Ethernet headers)
-   // IFF_NO_PI - Do not provide packet information
-   struct ifreq request;
-   CLEAR(request);
-   request.ifr_flags = IFF_TUN | IFF_NO_PI;
-
-   // set custom name if specified
-   if( *device_name )
-   {
-      strncpy(request.ifr_name, device_name, IF_NAMESIZE-1);
-      request.ifr_name[IF_NAMESIZE-1] = '\0';
-   }
-
-   printf_debug("%s: requesting interface %s\n", __func__, request.ifr_name);
-   if ( ioctl(tun_fd, TUNSETIFF, (void*)&request) < 0 )
-   {
-      print_errno(__func__, "failed to setup interface", errno);
-      close(tun_fd);
-      return -1;
-   }
-
-   // copy back the assigned name
-   strcpy(device_name, request.ifr_name);
-   return tun_fd;
-}
-
-bool tunnel_is_valid(Tunnel* tunnel)
-{
-    return (tunnel && tunnel->fd != -1);
-}
-
-bool tunnel_open(Tunnel* tunnel, const char* name)
-{
-   if (!tunnel)
-      return false;
-
-   char device_name[IF_NAMESIZE];
-   CLEAR(device_name);
-   // custom name is optional
-   if (name && *name)
-      strncpy(device_name, name, IF_NAMESIZE-1);
-
-   // create or open an existing TUN device
-   int32_t fd = allocate_tun_device(device_name);
-   if (fd < 0)
-   {
-      printf("failed to create or open existing TUN device %s\n", name);
-      return false;
-   }
-
-   // mark the TUN descriptor as non-blocking
-   int32_t fd_flags = fcntl(fd, F_GETFL);
-	if (fd_flags < 0 || fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK)) 
-   {
-      printf("faileld to mark tun descriptor as non-blocking\n");
-      close(fd);
-	}
-
-   // TODO TUNSETSNDBUF
-
-   // the TUN device needs an associated socket to configure the addresses
-   int32_t s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-   if (s < 0)
-   {
-      printf("failed to create a socket\n");
-      close(fd);
-      return false;
-   }
-
-   // populate the tunnel with the final data
-   tunnel->fd = fd;
-   tunnel->socket = s;
-   strncpy(tunnel->if_name, device_name, IF_NAMESIZE-1);
-   tunnel->if_name[IF_NAMESIZE-1] = '\0';
-
-   return true;
-}
-
-void tunnel_close(Tunnel* tunnel)
-{
-   if (!tunnel)
-      return;
-
-   close(tunnel->fd);
-   tunnel->fd = -1;
-   close(tunnel->socket);
-   tunnel->socket = -1;
-   memset(tunnel->if_name, 0, IF_NAMESIZE);
-}
-
-bool tunnel_get_flags(Tunnel* tunnel, const bool from_socket, int16_t* flags)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-
-   if (from_socket && tunnel->socket == -1)
-      return false;
-
-   struct ifreq request; 
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-
-   int ret = ioctl(from_socket ? tunnel->socket : tunnel->fd, SIOCGIFFLAGS, (void*)&request);
-   if (ret == -1)
-      return false;
-
-   *flags = request.ifr_flags;
-   return true;
-}
-
-bool tunnel_set_flags(Tunnel* tunnel, const int16_t flags, const bool keep_current, const bool to_socket)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-
-   if (to_socket && tunnel->fd == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-
-   if (keep_current && !tunnel_get_flags(tunnel, to_socket, &request.ifr_flags))
-      return false;
-
-   // OR new flags to keep the old ones if set
-   request.ifr_flags |= flags;
-   int ret = ioctl(to_socket ? tunnel->socket : tunnel->fd, SIOCSIFFLAGS, (void*)&request);
-   if ( ret == -1)
-      return false;
-
-   return true;
-}
-
-bool tunnel_set_name(Tunnel* tunnel, const char* name)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   strncpy(request.ifr_name, name, IF_NAMESIZE-1);
-   request.ifr_name[IF_NAMESIZE-1] = '\0';
-
-   if (!tunnel_get_flags(tunnel, false, &request.ifr_flags))
-      return false;
-
-   return ioctl(tunnel->fd, TUNSETIFF, (void*)&request) == 0;
-}
-
-bool tunnel_get_local_address(Tunnel* tunnel, struct sockaddr_storage* address)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   if (tunnel->socket == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-   
-   if (ioctl(tunnel->socket, SIOCGIFADDR, (void*)&request) < 0)
-   {
-      printf_debug("%s: error getting local address\n", __func__ );
-      return false;
-   }
-
-   // copy the returned address to the output parameter
-   memcpy(address, &request.ifr_addr, sizeof(request.ifr_addr));
-
-   return true;
-}
-
-bool tunnel_set_local_address(Tunnel* tunnel, const struct sockaddr_storage* address)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-
-   if (tunnel->socket == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-   memcpy(&request.ifr_addr, address, sizeof(request.ifr_addr));
-
-   if (ioctl(tunnel->socket, SIOCSIFADDR, (void*)&request) < 0)
-   {
-      printf_debug("%s: error setting local address\n", __func__ );
-      return false;
-   }
-   return true;
-}
-
-bool tunnel_get_remote_address(Tunnel* tunnel, struct sockaddr_storage* address)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   if (tunnel->socket == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-   
-   if (ioctl(tunnel->socket, SIOCGIFDSTADDR, (void*)&request) < 0)
-   {
-      printf_debug("%s: error getting remote address\n", __func__ );
-      return false;
-   }
-
-   // copy the returned address to the output parameter
-   memcpy(address, &request.ifr_addr, sizeof(request.ifr_addr));
-
-   return true;
-}
-
-bool tunnel_set_remote_address(Tunnel* tunnel, const struct sockaddr_storage* address)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   if (tunnel->socket == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-   memcpy(&request.ifr_addr, address, sizeof(request.ifr_addr));
-
-   if (ioctl(tunnel->socket, SIOCSIFDSTADDR, (void*)&request) < 0)
-   {
-      printf_debug("%s: error setting remote address\n", __func__ );
-      return false;
-   }
-   return true;
-}
-
-bool tunnel_set_addresses(Tunnel* tunnel, const struct sockaddr_storage* address_block)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   if (address_block->ss_family != AF_INET)
-   {
-      printf("error: IPv6 not implemented\n");
-      return false;
-   }
-
-   struct sockaddr_storage address;
-   memcpy(&address, address_block, sizeof(address));
-
-   // modify the last octet to get two different ips
-   struct sockaddr_in* ipv4 = (struct sockaddr_in*)&address;
-   uint8_t* last_octet = ((uint8_t*)&ipv4->sin_addr.s_addr)+3;
-
-   if (*last_octet != 0)
-   {
-      printf("provided tunnel address is not a valid ip block\n");
-      return false;
-   }
-
-   bool ok = true;
-
-   char buffer[256];
-   address_to_string(&address, buffer, sizeof(buffer));
-   printf_debug("%s: block %s\n", __func__, buffer);
-
-   *last_octet = 2;
-   address_to_string(&address, buffer, sizeof(buffer));
-   printf_debug("%s: local %s\n", __func__, buffer);
-   ok = ok && tunnel_set_local_address(tunnel, &address);
-
-   *last_octet = 1;
-   address_to_string(&address, buffer, sizeof(buffer));
-   printf_debug("%s: remote %s\n", __func__, buffer);
-   ok = ok && tunnel_set_remote_address(tunnel, &address);
-   
-   return ok;
-}
-
-bool tunnel_set_network_mask(Tunnel* tunnel, const struct sockaddr_storage* mask)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   if (tunnel->socket == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-   memcpy(&request.ifr_netmask, mask, sizeof(request.ifr_netmask));
-
-   if (ioctl(tunnel->socket, SIOCSIFNETMASK, (void*)&request) < 0)
-   {
-      printf_debug("%s: error setting network mask\n", __func__ );
-      return false;
-   }
-   return true;
-}
-
-bool tunnel_get_mtu(Tunnel* tunnel, uint32_t* mtu)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   if (tunnel->socket == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-
-   int32_t ret = ioctl(tunnel->socket, SIOCGIFMTU, (void*)&request);
-   if (ret == -1)
-      return false;
-
-   *mtu = request.ifr_mtu;
-   return true;
-}
-
-bool tunnel_set_mtu(Tunnel* tunnel, const uint32_t mtu)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   if (tunnel->socket == -1)
-      return false;
-
-   struct ifreq request;
-   CLEAR(request);
-   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
-   request.ifr_mtu = mtu;
-
-   return ioctl(tunnel->socket, SIOCSIFMTU, (void*)&request) == 0;
-}
-
-bool tunnel_persist(Tunnel* tunnel, const bool on)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-
-   if (on)
-   {
-      // try set owner and group so it can be used without root privileges
-      ioctl(tunnel->fd, TUNSETOWNER, geteuid());
-      //ioctl(tunnel->fd, TUNSETGROUP, group);
-   }
-
-   return ioctl(tunnel->fd, TUNSETPERSIST, on) == 0;
-}
-
-bool tunnel_up(Tunnel* tunnel)
-{
-   return tunnel_set_flags(tunnel, IFF_UP | IFF_RUNNING, true, true);
-}
-
-bool tunnel_down(Tunnel* tunnel)
-{
-   int16_t flags = 0;
-   if (!tunnel_get_flags(tunnel, true, &flags))
-      return false;
-
-   flags &= ~(IFF_UP | IFF_RUNNING);
-   return tunnel_set_flags(tunnel, flags, false, true);
-}
-
-bool tunnel_read(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-      
-   ssize_t count = read(tunnel->fd, buffer, *length);
-   if (count >= 0)
-   {
-      *length = (uint32_t)count;
-      return true;
-   }
-
-   // non-blocking may return EAGAIN if data is not ready
-   int32_t error = errno;
-   if (error != EAGAIN)
-      print_errno(__func__, "error reading from tunnel", error);
-   
-   return false;
-}
-
-bool tunnel_write(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
-{
-   if (!tunnel_is_valid(tunnel))
-      return false;
-
-   ssize_t count = write(tunnel->fd, buffer, length);
-   
-   if (count >= 0)
-   {
-      assert(count == length);
-      return true;
-   }
-
-   // non-blocking may return EAGAIN
-   int32_t error = errno;
-   if (error != EAGAIN)
-      print_errno(__func__, "error writing to tunnel", error);
-
-   return false;
+#include "common.h"
+
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+// tunnel wrapper to abstract TUN device management
+// the packets can also come from and go to something else than a TUN device (the backend):
+// in-memory rings or a socketpair, with the other side in the same process, so the data path
+// can run without privileges for benchmarks and tests. there is no device to configure then,
+// the addresses, mtu and flags are just kept in the Tunnel
+
+// mkdir /dev/net (if it doesn't exist already)
+// mknod /dev/net/tun c 10 200
+// chmod 0666 /dev/net/tun
+// modprobe tun
+
+// offload mode (IFF_VNET_HDR) moves TCP super-packets of up to 64KB through the device
+#define TUNNEL_OFFLOAD_BUFFER_SIZE 65535
+#define TUNNEL_MAX_COALESCED 64
+#define TUNNEL_TCP_CWR 0x80
+
+#define TUNNEL_RING_SIZE (1 << 20) // bytes each way, power of two
+#define TUNNEL_RING_WRAP 0xFFFFFFFF // record length telling the rest of the ring is unused
+
+typedef enum
+{
+   TB_Tun = 0, // kernel TUN device
+   TB_Ring, // in-memory rings, fed and drained with tunnel_ring_inject() and tunnel_ring_collect()
+   TB_SocketPair, // unix socketpair, the other end is 'outside'
+   TB_Count
+} TunnelBackendType;
+
+// packets one way: single producer, single consumer, variable length records
+typedef struct
+{
+   uint64_t tail __attribute__((aligned(64))); // bytes written, only by the producer
+   int wake_fd; // eventfd signaled when the consumer waits for data
+   uint64_t head __attribute__((aligned(64))); // bytes read, only by the consumer
+   uint32_t waiting __attribute__((aligned(64))); // the consumer found it empty
+   uint8_t data[TUNNEL_RING_SIZE] __attribute__((aligned(64)));
+} TunnelRingSide;
+
+typedef struct
+{
+   TunnelRingSide inbound; // to be read by the peer
+   TunnelRingSide outbound; // written by the peer
+} TunnelRing;
+
+struct tunnel_backend_t;
+
+typedef struct
+{
+   int fd; // what the peer reads and writes (or waits on)
+   int socket;
+   char if_name[IF_NAMESIZE];
+
+   const struct tunnel_backend_t* backend;
+   int outside; // socketpair end of the other side
+   TunnelRing* ring;
+
+   // configuration of backends without a device
+   struct sockaddr_storage local_address;
+   struct sockaddr_storage remote_address;
+   struct sockaddr_storage netmask;
+   uint32_t mtu;
+   bool up;
+
+   bool multi_queue;
+
+   // offload mode state
+   bool offload;
+   // super-packet read from the device, handed out one segment per tunnel_read()
+   struct virtio_net_hdr read_header;
+   uint8_t* read_buffer;
+   uint32_t read_length;
+   uint32_t read_headers;
+   uint32_t read_offset;
+   uint32_t read_segment;
+   // consecutive TCP segments merged into a single write by tunnel_flush()
+   uint8_t* write_buffer;
+   uint32_t write_length;
+   uint32_t write_headers;
+   uint32_t write_segments;
+   uint32_t write_segment_size;
+   uint32_t write_next_seq;
+   bool write_closed;
+} Tunnel;
+
+typedef struct tunnel_backend_t
+{
+   const char* name;
+   bool device; // a kernel device, configured through ioctls
+   bool (*open)(Tunnel* tunnel, const char* name, const bool offload, const bool multi_queue);
+   bool (*open_queue)(Tunnel* queue, const Tunnel* tunnel);
+   void (*close)(Tunnel* tunnel); // only the descriptors and memory of the backend
+   bool (*read)(Tunnel* tunnel, uint8_t* buffer, uint32_t* length);
+   bool (*write)(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length);
+} TunnelBackend;
+
+bool check_tun_privileges()
+{
+   int fd = open("/dev/net/tun", O_RDWR);
+   bool ok = (fd > 0);
+   close(fd);
+   return ok;
+}
+
+int32_t allocate_tun_device(char* device_name, const bool offload, const bool multi_queue)
+{
+   if (!device_name)
+      return -1;
+
+   int32_t tun_fd = open("/dev/net/tun", O_RDWR);
+   if (tun_fd < 0)
+   {
+      print_errno(__func__, "failed to open /dev/net/tun", errno);
+      return -1;
+   }
+
+   // IFF_TUN   - TUN device (no Ethernet headers)
+   // IFF_NO_PI - Do not provide packet information
+   // IFF_VNET_HDR - Prepend a virtio header describing segmentation and checksums
+   // IFF_MULTI_QUEUE - Every open of the same device adds a queue with its own descriptor
+   struct ifreq request;
+   CLEAR(request);
+   request.ifr_flags = IFF_TUN | IFF_NO_PI | (offload ? IFF_VNET_HDR : 0) | (multi_queue ? IFF_MULTI_QUEUE : 0);
+
+   // set custom name if specified
+   if( *device_name )
+   {
+      strncpy(request.ifr_name, device_name, IF_NAMESIZE-1);
+      request.ifr_name[IF_NAMESIZE-1] = '\0';
+   }
+
+   printf_debug("%s: requesting interface %s\n", __func__, request.ifr_name);
+   if ( ioctl(tun_fd, TUNSETIFF, (void*)&request) < 0 )
+   {
+      print_errno(__func__, "failed to setup interface", errno);
+      close(tun_fd);
+      return -1;
+   }
+
+   if (offload)
+   {
+      int32_t header_size = sizeof(struct virtio_net_hdr);
+      if (ioctl(tun_fd, TUNSETVNETHDRSZ, &header_size) < 0)
+      {
+         print_errno(__func__, "failed to set the virtio header size", errno);
+         close(tun_fd);
+         return -1;
+      }
+
+      // let the kernel hand us unchecksummed TCP super-packets
+      uint32_t offloads = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+      if (ioctl(tun_fd, TUNSETOFFLOAD, offloads) < 0)
+      {
+         print_errno(__func__, "failed to enable offloads", errno);
+         close(tun_fd);
+         return -1;
+      }
+   }
+
+   // copy back the assigned name
+   strcpy(device_name, request.ifr_name);
+   return tun_fd;
+}
+
+bool tunnel_is_valid(Tunnel* tunnel)
+{
+    return (tunnel && tunnel->fd != -1);
+}
+
+// false for the backends keeping their configuration in the Tunnel
+bool tunnel_has_device(const Tunnel* tunnel)
+{
+   return tunnel->backend && tunnel->backend->device;
+}
+
+// prepares the descriptor of a new tunnel or queue, closing it on failure
+bool tunnel_setup_descriptor(Tunnel* tunnel, const int32_t fd, const bool offload)
+{
+   // mark the TUN descriptor as non-blocking
+   int32_t fd_flags = fcntl(fd, F_GETFL);
+   if (fd_flags < 0 || fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK)) 
+   {
+      printf("faileld to mark tun descriptor as non-blocking\n");
+      close(fd);
+      return false;
+   }
+
+   // TODO TUNSETSNDBUF
+
+   uint8_t* read_buffer = NULL;
+   uint8_t* write_buffer = NULL;
+   if (offload)
+   {
+      read_buffer = (uint8_t*)malloc(TUNNEL_OFFLOAD_BUFFER_SIZE);
+      write_buffer = (uint8_t*)malloc(TUNNEL_OFFLOAD_BUFFER_SIZE);
+      if (!read_buffer || !write_buffer)
+      {
+         free(read_buffer);
+         free(write_buffer);
+         close(fd);
+         return false;
+      }
+   }
+
+   tunnel->offload = offload;
+   tunnel->read_buffer = read_buffer;
+   tunnel->write_buffer = write_buffer;
+   tunnel->read_length = 0;
+   tunnel->write_length = 0;
+   tunnel->fd = fd;
+   return true;
+}
+
+bool tunnel_tun_open(Tunnel* tunnel, const char* name, bool offload, const bool multi_queue)
+{
+   char device_name[IF_NAMESIZE];
+   CLEAR(device_name);
+   // custom name is optional
+   if (name && *name)
+      strncpy(device_name, name, IF_NAMESIZE-1);
+
+   // create or open an existing TUN device
+   int32_t fd = allocate_tun_device(device_name, offload, multi_queue);
+   if (fd < 0 && offload)
+   {
+      printf("TUN offloads not available, falling back to plain packets\n");
+      offload = false;
+      fd = allocate_tun_device(device_name, offload, multi_queue);
+   }
+
+   if (fd < 0)
+   {
+      printf("failed to create or open existing TUN device %s\n", name);
+      return false;
+   }
+
+   // the TUN device needs an associated socket to configure the addresses
+   int32_t s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if (s < 0)
+   {
+      printf("failed to create a socket\n");
+      close(fd);
+      return false;
+   }
+
+   if (!tunnel_setup_descriptor(tunnel, fd, offload))
+   {
+      close(s);
+      return false;
+   }
+
+   // populate the tunnel with the final data
+   tunnel->multi_queue = multi_queue;
+   tunnel->socket = s;
+   strncpy(tunnel->if_name, device_name, IF_NAMESIZE-1);
+   tunnel->if_name[IF_NAMESIZE-1] = '\0';
+
+   return true;
+}
+
+// another descriptor of the same multi-queue device
+bool tunnel_tun_open_queue(Tunnel* queue, const Tunnel* tunnel)
+{
+   char device_name[IF_NAMESIZE];
+   memcpy(device_name, tunnel->if_name, IF_NAMESIZE);
+
+   int32_t fd = allocate_tun_device(device_name, tunnel->offload, true);
+   if (fd < 0)
+   {
+      printf("failed to attach a new queue to TUN device %s\n", tunnel->if_name);
+      return false;
+   }
+
+   if (!tunnel_setup_descriptor(queue, fd, tunnel->offload))
+      return false;
+
+   queue->multi_queue = true;
+   queue->socket = -1;
+   memcpy(queue->if_name, tunnel->if_name, IF_NAMESIZE);
+   return true;
+}
+
+void tunnel_tun_close(Tunnel* tunnel)
+{
+   close(tunnel->fd);
+   close(tunnel->socket);
+}
+
+// packets through a unix socketpair, which keeps their boundaries like the device
+bool tunnel_socketpair_open(Tunnel* tunnel, const char* name, const bool offload, const bool multi_queue)
+{
+   (void)offload;
+
+   int ends[2];
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, ends) == -1)
+   {
+      print_errno(__func__, "failed to create socketpair", errno);
+      return false;
+   }
+
+   tunnel->fd = ends[0];
+   tunnel->outside = ends[1];
+   tunnel->multi_queue = multi_queue;
+   strncpy(tunnel->if_name, (name && *name) ? name : "socketpair", IF_NAMESIZE-1);
+   return true;
+}
+
+// every queue is just another socketpair
+bool tunnel_socketpair_open_queue(Tunnel* queue, const Tunnel* tunnel)
+{
+   if (!tunnel_socketpair_open(queue, NULL, false, true))
+      return false;
+   memcpy(queue->if_name, tunnel->if_name, IF_NAMESIZE);
+   return true;
+}
+
+void tunnel_socketpair_close(Tunnel* tunnel)
+{
+   close(tunnel->fd);
+   close(tunnel->outside);
+}
+
+// appends a packet to the ring, false if it doesn't fit
+bool tunnel_ring_push(TunnelRingSide* side, const uint8_t* buffer, const uint32_t length)
+{
+   // 8 bytes of length and padding before the packet, records stay aligned
+   const uint32_t record = 8 + ((length + 7) & ~7u);
+   if (record > TUNNEL_RING_SIZE / 4)
+      return false;
+
+   uint64_t tail = side->tail;
+   uint32_t offset = (uint32_t)(tail & (TUNNEL_RING_SIZE - 1));
+   // records don't wrap around, the end is skipped instead
+   const uint32_t skip = (TUNNEL_RING_SIZE - offset < record) ? TUNNEL_RING_SIZE - offset : 0;
+
+   const uint64_t head = __atomic_load_n(&side->head, __ATOMIC_ACQUIRE);
+   if (TUNNEL_RING_SIZE - (tail - head) < skip + record)
+      return false;
+
+   if (skip > 0)
+   {
+      *(uint32_t*)(side->data + offset) = TUNNEL_RING_WRAP;
+      tail += skip;
+      offset = 0;
+   }
+
+   *(uint32_t*)(side->data + offset) = length;
+   memcpy(side->data + offset + 8, buffer, length);
+   __atomic_store_n(&side->tail, tail + record, __ATOMIC_RELEASE);
+
+   // either the consumer sees the packet or this sees it waiting
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&side->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&side->waiting, 0, __ATOMIC_RELAXED))
+   {
+      const uint64_t wakes = 1;
+      if (write(side->wake_fd, &wakes, sizeof(wakes)) == -1)
+         print_errno(__func__, "error signaling tunnel ring", errno);
+   }
+   return true;
+}
+
+// takes the oldest packet, truncated to the buffer like a device read
+// when empty the eventfd is left unsignaled until the next push, false then
+bool tunnel_ring_pop(TunnelRingSide* side, uint8_t* buffer, uint32_t* length)
+{
+   uint64_t head = side->head;
+   if (head == __atomic_load_n(&side->tail, __ATOMIC_ACQUIRE))
+   {
+      uint64_t wakes;
+      if (read(side->wake_fd, &wakes, sizeof(wakes)) == -1 && errno != EAGAIN)
+         print_errno(__func__, "error reading tunnel ring signal", errno);
+
+      __atomic_store_n(&side->waiting, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (head == __atomic_load_n(&side->tail, __ATOMIC_ACQUIRE))
+         return false;
+      __atomic_store_n(&side->waiting, 0, __ATOMIC_RELAXED);
+   }
+
+   uint32_t offset = (uint32_t)(head & (TUNNEL_RING_SIZE - 1));
+   uint32_t stored = *(uint32_t*)(side->data + offset);
+   if (stored == TUNNEL_RING_WRAP)
+   {
+      head += TUNNEL_RING_SIZE - offset;
+      offset = 0;
+      stored = *(uint32_t*)side->data;
+   }
+
+   const uint32_t copied = stored < *length ? stored : *length;
+   memcpy(buffer, side->data + offset + 8, copied);
+   *length = copied;
+   __atomic_store_n(&side->head, head + 8 + ((stored + 7) & ~7u), __ATOMIC_RELEASE);
+   return true;
+}
+
+bool tunnel_ring_open(Tunnel* tunnel, const char* name, const bool offload, const bool multi_queue)
+{
+   (void)offload;
+
+   void* memory = NULL;
+   if (posix_memalign(&memory, 64, sizeof(TunnelRing)) != 0)
+      return false;
+
+   TunnelRing* ring = (TunnelRing*)memory;
+   // both consumers start out waiting, they haven't looked yet
+   ring->inbound.tail = ring->inbound.head = 0;
+   ring->outbound.tail = ring->outbound.head = 0;
+   ring->inbound.waiting = ring->outbound.waiting = 1;
+   ring->inbound.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   ring->outbound.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (ring->inbound.wake_fd == -1 || ring->outbound.wake_fd == -1)
+   {
+      print_errno(__func__, "failed to create eventfd", errno);
+      if (ring->inbound.wake_fd != -1)
+         close(ring->inbound.wake_fd);
+      if (ring->outbound.wake_fd != -1)
+         close(ring->outbound.wake_fd);
+      free(ring);
+      return false;
+   }
+
+   // the peer waits for inbound packets like on a device descriptor
+   tunnel->ring = ring;
+   tunnel->fd = ring->inbound.wake_fd;
+   tunnel->multi_queue = multi_queue;
+   strncpy(tunnel->if_name, (name && *name) ? name : "ring", IF_NAMESIZE-1);
+   return true;
+}
+
+bool tunnel_ring_open_queue(Tunnel* queue, const Tunnel* tunnel)
+{
+   if (!tunnel_ring_open(queue, NULL, false, true))
+      return false;
+   memcpy(queue->if_name, tunnel->if_name, IF_NAMESIZE);
+   return true;
+}
+
+void tunnel_ring_close(Tunnel* tunnel)
+{
+   if (!tunnel->ring)
+      return;
+
+   close(tunnel->ring->inbound.wake_fd);
+   close(tunnel->ring->outbound.wake_fd);
+   free(tunnel->ring);
+   tunnel->ring = NULL;
+}
+
+bool tunnel_ring_read(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
+{
+   return tunnel_ring_pop(&tunnel->ring->inbound, buffer, length);
+}
+
+// a full ring drops the packet like a full device queue
+bool tunnel_ring_write(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
+{
+   return tunnel_ring_push(&tunnel->ring->outbound, buffer, length);
+}
+
+// the other side of a ring tunnel: hands a packet to the peer, false if the ring is full
+bool tunnel_ring_inject(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
+{
+   return tunnel->ring && tunnel_ring_push(&tunnel->ring->inbound, buffer, length);
+}
+
+// the other side of a ring tunnel: takes a packet written by the peer, false if there is none
+bool tunnel_ring_collect(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
+{
+   return tunnel->ring && tunnel_ring_pop(&tunnel->ring->outbound, buffer, length);
+}
+
+// becomes readable when tunnel_ring_collect() returned false and the peer wrote something since
+int tunnel_ring_collect_fd(Tunnel* tunnel)
+{
+   return tunnel->ring ? tunnel->ring->outbound.wake_fd : -1;
+}
+
+void tunnel_close(Tunnel* tunnel)
+{
+   if (!tunnel)
+      return;
+
+   if (tunnel->backend)
+      tunnel->backend->close(tunnel);
+   tunnel->backend = NULL;
+   tunnel->fd = -1;
+   tunnel->socket = -1;
+   tunnel->outside = -1;
+   memset(tunnel->if_name, 0, IF_NAMESIZE);
+
+   free(tunnel->read_buffer);
+   free(tunnel->write_buffer);
+   tunnel->read_buffer = NULL;
+   tunnel->write_buffer = NULL;
+   tunnel->offload = false;
+}
+
+bool tunnel_get_flags(Tunnel* tunnel, const bool from_socket, int16_t* flags)
+{
+   if (!tunnel_is_valid(tunnel) || !tunnel_has_device(tunnel))
+      return false;
+
+   if (from_socket && tunnel->socket == -1)
+      return false;
+
+   struct ifreq request; 
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+
+   int ret = ioctl(from_socket ? tunnel->socket : tunnel->fd, SIOCGIFFLAGS, (void*)&request);
+   if (ret == -1)
+      return false;
+
+   *flags = request.ifr_flags;
+   return true;
+}
+
+bool tunnel_set_flags(Tunnel* tunnel, const int16_t flags, const bool keep_current, const bool to_socket)
+{
+   if (!tunnel_is_valid(tunnel) || !tunnel_has_device(tunnel))
+      return false;
+
+   if (to_socket && tunnel->fd == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+
+   if (keep_current && !tunnel_get_flags(tunnel, to_socket, &request.ifr_flags))
+      return false;
+
+   // OR new flags to keep the old ones if set
+   request.ifr_flags |= flags;
+   int ret = ioctl(to_socket ? tunnel->socket : tunnel->fd, SIOCSIFFLAGS, (void*)&request);
+   if ( ret == -1)
+      return false;
+
+   return true;
+}
+
+bool tunnel_set_name(Tunnel* tunnel, const char* name)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   strncpy(request.ifr_name, name, IF_NAMESIZE-1);
+   request.ifr_name[IF_NAMESIZE-1] = '\0';
+
+   if (!tunnel_has_device(tunnel))
+   {
+      memcpy(tunnel->if_name, request.ifr_name, IF_NAMESIZE);
+      return true;
+   }
+
+   if (!tunnel_get_flags(tunnel, false, &request.ifr_flags))
+      return false;
+
+   return ioctl(tunnel->fd, TUNSETIFF, (void*)&request) == 0;
+}
+
+bool tunnel_get_local_address(Tunnel* tunnel, struct sockaddr_storage* address)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   if (!tunnel_has_device(tunnel))
+   {
+      *address = tunnel->local_address;
+      return true;
+   }
+      
+   if (tunnel->socket == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+   
+   if (ioctl(tunnel->socket, SIOCGIFADDR, (void*)&request) < 0)
+   {
+      printf_debug("%s: error getting local address\n", __func__ );
+      return false;
+   }
+
+   // copy the returned address to the output parameter
+   memcpy(address, &request.ifr_addr, sizeof(request.ifr_addr));
+
+   return true;
+}
+
+bool tunnel_set_local_address(Tunnel* tunnel, const struct sockaddr_storage* address)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   if (!tunnel_has_device(tunnel))
+   {
+      tunnel->local_address = *address;
+      return true;
+   }
+
+   if (tunnel->socket == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+   memcpy(&request.ifr_addr, address, sizeof(request.ifr_addr));
+
+   if (ioctl(tunnel->socket, SIOCSIFADDR, (void*)&request) < 0)
+   {
+      printf_debug("%s: error setting local address\n", __func__ );
+      return false;
+   }
+   return true;
+}
+
+bool tunnel_get_remote_address(Tunnel* tunnel, struct sockaddr_storage* address)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   if (!tunnel_has_device(tunnel))
+   {
+      *address = tunnel->remote_address;
+      return true;
+   }
+      
+   if (tunnel->socket == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+   
+   if (ioctl(tunnel->socket, SIOCGIFDSTADDR, (void*)&request) < 0)
+   {
+      printf_debug("%s: error getting remote address\n", __func__ );
+      return false;
+   }
+
+   // copy the returned address to the output parameter
+   memcpy(address, &request.ifr_addr, sizeof(request.ifr_addr));
+
+   return true;
+}
+
+bool tunnel_set_remote_address(Tunnel* tunnel, const struct sockaddr_storage* address)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   if (!tunnel_has_device(tunnel))
+   {
+      tunnel->remote_address = *address;
+      return true;
+   }
+      
+   if (tunnel->socket == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+   memcpy(&request.ifr_addr, address, sizeof(request.ifr_addr));
+
+   if (ioctl(tunnel->socket, SIOCSIFDSTADDR, (void*)&request) < 0)
+   {
+      printf_debug("%s: error setting remote address\n", __func__ );
+      return false;
+   }
+   return true;
+}
+
+bool tunnel_set_addresses(Tunnel* tunnel, const struct sockaddr_storage* address_block)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+      
+   if (address_block->ss_family != AF_INET)
+   {
+      printf("error: IPv6 not implemented\n");
+      return false;
+   }
+
+   struct sockaddr_storage address;
+   memcpy(&address, address_block, sizeof(address));
+
+   // modify the last octet to get two different ips
+   struct sockaddr_in* ipv4 = (struct sockaddr_in*)&address;
+   uint8_t* last_octet = ((uint8_t*)&ipv4->sin_addr.s_addr)+3;
+
+   if (*last_octet != 0)
+   {
+      printf("provided tunnel address is not a valid ip block\n");
+      return false;
+   }
+
+   bool ok = true;
+
+   char buffer[256];
+   address_to_string(&address, buffer, sizeof(buffer));
+   printf_debug("%s: block %s\n", __func__, buffer);
+
+   *last_octet = 2;
+   address_to_string(&address, buffer, sizeof(buffer));
+   printf_debug("%s: local %s\n", __func__, buffer);
+   ok = ok && tunnel_set_local_address(tunnel, &address);
+
+   *last_octet = 1;
+   address_to_string(&address, buffer, sizeof(buffer));
+   printf_debug("%s: remote %s\n", __func__, buffer);
+   ok = ok && tunnel_set_remote_address(tunnel, &address);
+   
+   return ok;
+}
+
+bool tunnel_set_network_mask(Tunnel* tunnel, const struct sockaddr_storage* mask)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   if (!tunnel_has_device(tunnel))
+   {
+      tunnel->netmask = *mask;
+      return true;
+   }
+      
+   if (tunnel->socket == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+   memcpy(&request.ifr_netmask, mask, sizeof(request.ifr_netmask));
+
+   if (ioctl(tunnel->socket, SIOCSIFNETMASK, (void*)&request) < 0)
+   {
+      printf_debug("%s: error setting network mask\n", __func__ );
+      return false;
+   }
+   return true;
+}
+
+bool tunnel_get_mtu(Tunnel* tunnel, uint32_t* mtu)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   if (!tunnel_has_device(tunnel))
+   {
+      *mtu = tunnel->mtu;
+      return true;
+   }
+      
+   if (tunnel->socket == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+
+   int32_t ret = ioctl(tunnel->socket, SIOCGIFMTU, (void*)&request);
+   if (ret == -1)
+      return false;
+
+   *mtu = request.ifr_mtu;
+   return true;
+}
+
+bool tunnel_set_mtu(Tunnel* tunnel, const uint32_t mtu)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   if (!tunnel_has_device(tunnel))
+   {
+      tunnel->mtu = mtu;
+      return true;
+   }
+      
+   if (tunnel->socket == -1)
+      return false;
+
+   struct ifreq request;
+   CLEAR(request);
+   memcpy(&request.ifr_name, tunnel->if_name, IF_NAMESIZE);
+   request.ifr_mtu = mtu;
+
+   return ioctl(tunnel->socket, SIOCSIFMTU, (void*)&request) == 0;
+}
+
+bool tunnel_persist(Tunnel* tunnel, const bool on)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+
+   // nothing outlives the process without a device
+   if (!tunnel_has_device(tunnel))
+      return !on;
+
+   if (on)
+   {
+      // try set owner and group so it can be used without root privileges
+      ioctl(tunnel->fd, TUNSETOWNER, geteuid());
+      //ioctl(tunnel->fd, TUNSETGROUP, group);
+   }
+
+   return ioctl(tunnel->fd, TUNSETPERSIST, on) == 0;
+}
+
+bool tunnel_up(Tunnel* tunnel)
+{
+   if (tunnel_is_valid(tunnel) && !tunnel_has_device(tunnel))
+   {
+      tunnel->up = true;
+      return true;
+   }
+   return tunnel_set_flags(tunnel, IFF_UP | IFF_RUNNING, true, true);
+}
+
+bool tunnel_down(Tunnel* tunnel)
+{
+   if (tunnel_is_valid(tunnel) && !tunnel_has_device(tunnel))
+   {
+      tunnel->up = false;
+      return true;
+   }
+
+   int16_t flags = 0;
+   if (!tunnel_get_flags(tunnel, true, &flags))
+      return false;
+
+   flags &= ~(IFF_UP | IFF_RUNNING);
+   return tunnel_set_flags(tunnel, flags, false, true);
+}
+
+// length of the IP header if the packet carries TCP right after it, zero otherwise
+uint32_t tunnel_tcp_offset(const uint8_t* packet, const uint32_t length)
+{
+   if (length < sizeof(struct iphdr))
+      return 0;
+
+   const struct iphdr* header4 = (const struct iphdr*)packet;
+   if (header4->version == 4)
+   {
+      const uint32_t ip_length = header4->ihl << 2;
+      if (header4->protocol != IPPROTO_TCP || length < ip_length + sizeof(struct tcphdr))
+         return 0;
+      return ip_length;
+   }
+
+   const struct ip6_hdr* header6 = (const struct ip6_hdr*)packet;
+   if (header4->version == 6 && length >= sizeof(struct ip6_hdr) + sizeof(struct tcphdr))
+      return header6->ip6_nxt == IPPROTO_TCP ? sizeof(struct ip6_hdr) : 0;
+
+   return 0;
+}
+
+// sum of the pseudo-header used in TCP checksums for both IP versions
+uint64_t tunnel_pseudo_header_sum(const uint8_t* packet, const uint32_t tcp_length)
+{
+   uint64_t sum = 0;
+   if ((packet[0] >> 4) == 4)
+      sum = checksum_add(sum, packet + offsetof(struct iphdr, saddr), 8);
+   else
+      sum = checksum_add(sum, packet + offsetof(struct ip6_hdr, ip6_src), 32);
+
+   return sum + IPPROTO_TCP + tcp_length;
+}
+
+// updates the IP lengths (and the IPv4 checksum) after resizing a TCP packet
+void tunnel_set_ip_length(uint8_t* packet, const uint32_t ip_length, const uint32_t length)
+{
+   if ((packet[0] >> 4) == 4)
+   {
+      struct iphdr* header4 = (struct iphdr*)packet;
+      header4->tot_len = htons(length);
+      header4->check = 0;
+      header4->check = htons(~checksum_fold(checksum_add(0, packet, ip_length)));
+   }
+   else
+   {
+      struct ip6_hdr* header6 = (struct ip6_hdr*)packet;
+      header6->ip6_plen = htons(length - ip_length);
+   }
+}
+
+// copies the next segment of the pending super-packet into the buffer
+bool tunnel_read_segment(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
+{
+   const uint8_t* packet = tunnel->read_buffer;
+   const uint32_t headers = tunnel->read_headers;
+   const uint32_t payload = tunnel->read_length - headers;
+
+   uint32_t size = payload - tunnel->read_offset;
+   if (size > tunnel->read_header.gso_size)
+      size = tunnel->read_header.gso_size;
+
+   // the kernel segments by the device mtu so this only happens with a misconfigured peer
+   if (headers + size > *length)
+   {
+      printf_debug("%s: segment too big for the buffer (%u > %u)\n", __func__, headers + size, *length);
+      tunnel->read_length = 0;
+      return false;
+   }
+
+   memcpy(buffer, packet, headers);
+   memcpy(buffer + headers, packet + headers + tunnel->read_offset, size);
+
+   const bool first = (tunnel->read_offset == 0);
+   const bool last = (tunnel->read_offset + size == payload);
+   const uint32_t ip_length = tunnel_tcp_offset(packet, tunnel->read_length);
+
+   if ((buffer[0] >> 4) == 4)
+   {
+      struct iphdr* header4 = (struct iphdr*)buffer;
+      header4->id = htons(ntohs(header4->id) + tunnel->read_segment);
+   }
+   tunnel_set_ip_length(buffer, ip_length, headers + size);
+
+   struct tcphdr* tcp = (struct tcphdr*)(buffer + ip_length);
+   tcp->seq = htonl(ntohl(tcp->seq) + tunnel->read_offset);
+   // only the last segment finishes or pushes, only the first signals congestion
+   if (!last)
+      tcp->th_flags &= ~(TH_FIN | TH_PUSH);
+   if (!first)
+      tcp->th_flags &= ~TUNNEL_TCP_CWR;
+
+   const uint32_t tcp_length = headers + size - ip_length;
+   tcp->check = 0;
+   uint64_t sum = tunnel_pseudo_header_sum(buffer, tcp_length);
+   sum = checksum_add(sum, buffer + ip_length, tcp_length);
+   tcp->check = htons(~checksum_fold(sum));
+
+   tunnel->read_offset += size;
+   tunnel->read_segment++;
+   if (last)
+      tunnel->read_length = 0;
+
+   *length = headers + size;
+   return true;
+}
+
+bool tunnel_read_offload(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
+{
+   // keep handing out segments of the last super-packet
+   if (tunnel->read_length > 0)
+      return tunnel_read_segment(tunnel, buffer, length);
+
+   struct iovec vectors[2];
+   vectors[0].iov_base = &tunnel->read_header;
+   vectors[0].iov_len = sizeof(tunnel->read_header);
+   vectors[1].iov_base = tunnel->read_buffer;
+   vectors[1].iov_len = TUNNEL_OFFLOAD_BUFFER_SIZE;
+
+   ssize_t count = readv(tunnel->fd, vectors, 2);
+   if (count < (ssize_t)sizeof(struct virtio_net_hdr))
+   {
+      int32_t error = errno;
+      if (count < 0 && error != EAGAIN)
+         print_errno(__func__, "error reading from tunnel", error);
+      return false;
+   }
+
+   const struct virtio_net_hdr* header = &tunnel->read_header;
+   const uint32_t packet_length = count - sizeof(struct virtio_net_hdr);
+
+   if (header->gso_type == VIRTIO_NET_HDR_GSO_TCPV4 || header->gso_type == VIRTIO_NET_HDR_GSO_TCPV6)
+   {
+      const uint32_t ip_length = tunnel_tcp_offset(tunnel->read_buffer, packet_length);
+      if (ip_length == 0 || header->gso_size == 0)
+         return false;
+
+      const struct tcphdr* tcp = (const struct tcphdr*)(tunnel->read_buffer + ip_length);
+      tunnel->read_headers = ip_length + (tcp->doff << 2);
+      if (tunnel->read_headers >= packet_length)
+         return false;
+
+      tunnel->read_length = packet_length;
+      tunnel->read_offset = 0;
+      tunnel->read_segment = 0;
+      return tunnel_read_segment(tunnel, buffer, length);
+   }
+
+   if (packet_length > *length)
+   {
+      printf_debug("%s: packet too big for the buffer (%u > %u)\n", __func__, packet_length, *length);
+      return false;
+   }
+
+   memcpy(buffer, tunnel->read_buffer, packet_length);
+
+   // the kernel left the checksum for us to complete
+   if (header->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+   {
+      const uint32_t field = header->csum_start + header->csum_offset;
+      if (field + sizeof(uint16_t) <= packet_length)
+      {
+         uint16_t checksum = ~checksum_fold(checksum_add(0, buffer + header->csum_start, packet_length - header->csum_start));
+         buffer[field] = checksum >> 8;
+         buffer[field + 1] = checksum & 0xFF;
+      }
+   }
+
+   *length = packet_length;
+   return true;
+}
+
+// segments of a super-packet still waiting to be read
+bool tunnel_has_pending(Tunnel* tunnel)
+{
+   return tunnel && tunnel->offload && tunnel->read_length > 0;
+}
+
+bool tunnel_write_packet(Tunnel* tunnel, const struct virtio_net_hdr* header, const uint8_t* buffer, const uint32_t length)
+{
+   struct iovec vectors[2];
+   vectors[0].iov_base = (void*)header;
+   vectors[0].iov_len = sizeof(struct virtio_net_hdr);
+   vectors[1].iov_base = (void*)buffer;
+   vectors[1].iov_len = length;
+
+   ssize_t count = writev(tunnel->fd, vectors, 2);
+   if (count >= 0)
+      return true;
+
+   // non-blocking may return EAGAIN
+   int32_t error = errno;
+   if (error != EAGAIN)
+      print_errno(__func__, "error writing to tunnel", error);
+
+   return false;
+}
+
+// writes the pending coalesced TCP segments as a single super-packet
+bool tunnel_flush(Tunnel* tunnel)
+{
+   if (!tunnel_is_valid(tunnel) || !tunnel->offload || tunnel->write_length == 0)
+      return true;
+
+   uint8_t* packet = tunnel->write_buffer;
+   struct virtio_net_hdr header;
+   CLEAR(header);
+
+   if (tunnel->write_segments > 1)
+   {
+      const uint32_t ip_length = tunnel_tcp_offset(packet, tunnel->write_length);
+      const uint32_t tcp_length = tunnel->write_length - ip_length;
+      tunnel_set_ip_length(packet, ip_length, tunnel->write_length);
+
+      // the kernel completes the checksum of every segment from the pseudo-header sum
+      struct tcphdr* tcp = (struct tcphdr*)(packet + ip_length);
+      tcp->check = htons(checksum_fold(tunnel_pseudo_header_sum(packet, tcp_length)));
+
+      header.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+      header.gso_type = (packet[0] >> 4) == 4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+      header.hdr_len = tunnel->write_headers;
+      header.gso_size = tunnel->write_segment_size;
+      header.csum_start = ip_length;
+      header.csum_offset = offsetof(struct tcphdr, check);
+   }
+
+   bool ok = tunnel_write_packet(tunnel, &header, packet, tunnel->write_length);
+   tunnel->write_length = 0;
+   tunnel->write_segments = 0;
+   return ok;
+}
+
+// the IP lengths cover the whole packet and the checksums verify, like the kernel GRO requires
+// a merged packet gets its checksums computed again and would hide a corrupted segment otherwise
+bool tunnel_segment_valid(const uint8_t* buffer, const uint32_t length, const uint32_t ip_length)
+{
+   if ((buffer[0] >> 4) == 4)
+   {
+      const struct iphdr* header4 = (const struct iphdr*)buffer;
+      if (ntohs(header4->tot_len) != length || checksum_fold(checksum_add(0, buffer, ip_length)) != 0xFFFF)
+         return false;
+   }
+   else if (ntohs(((const struct ip6_hdr*)buffer)->ip6_plen) != length - ip_length)
+      return false;
+
+   const uint32_t tcp_length = length - ip_length;
+   uint64_t sum = tunnel_pseudo_header_sum(buffer, tcp_length);
+   sum = checksum_add(sum, buffer + ip_length, tcp_length);
+   return checksum_fold(sum) == 0xFFFF;
+}
+
+// merges the TCP segment with the pending ones if it continues the same flow
+// returns false if the packet cannot be coalesced
+bool tunnel_coalesce(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
+{
+   const uint32_t ip_length = tunnel_tcp_offset(buffer, length);
+   if (ip_length == 0)
+      return false;
+
+   // fragments and IPv4 options are not worth the trouble
+   if ((buffer[0] >> 4) == 4)
+   {
+      const struct iphdr* header4 = (const struct iphdr*)buffer;
+      if (ip_length != sizeof(struct iphdr) || (ntohs(header4->frag_off) & 0x3FFF) != 0)
+         return false;
+   }
+
+   const struct tcphdr* tcp = (const struct tcphdr*)(buffer + ip_length);
+   const uint32_t headers = ip_length + (tcp->doff << 2);
+   if (headers >= length || (tcp->th_flags & ~(TH_ACK | TH_PUSH)) != 0 || !(tcp->th_flags & TH_ACK))
+      return false;
+
+   const uint32_t payload = length - headers;
+   const uint32_t seq = ntohl(tcp->seq);
+
+   if (tunnel->write_length > 0)
+   {
+      const uint8_t* pending = tunnel->write_buffer;
+      const struct tcphdr* pending_tcp = (const struct tcphdr*)(pending + ip_length);
+      const uint32_t addresses = (buffer[0] >> 4) == 4 ? offsetof(struct iphdr, saddr) : offsetof(struct ip6_hdr, ip6_src);
+      const uint32_t addresses_length = (buffer[0] >> 4) == 4 ? 8 : 32;
+
+      // the IP fields the merged segments share: tos and ttl, or traffic class, flow label and hop limit
+      bool same_ip = (buffer[0] >> 4) == 4
+         ? ((const struct iphdr*)pending)->tos == ((const struct iphdr*)buffer)->tos
+            && ((const struct iphdr*)pending)->ttl == ((const struct iphdr*)buffer)->ttl
+         : memcmp(pending, buffer, 4) == 0
+            && ((const struct ip6_hdr*)pending)->ip6_hlim == ((const struct ip6_hdr*)buffer)->ip6_hlim;
+
+      bool same_flow = !tunnel->write_closed
+         && tunnel->write_headers == headers
+         && pending[0] == buffer[0]
+         && same_ip
+         && memcmp(pending + addresses, buffer + addresses, addresses_length) == 0
+         // ports, ack, window and options have to match
+         && memcmp(pending_tcp, tcp, 4) == 0
+         && pending_tcp->ack_seq == tcp->ack_seq
+         && pending_tcp->window == tcp->window
+         && memcmp(pending + ip_length + sizeof(struct tcphdr), buffer + ip_length + sizeof(struct tcphdr), headers - ip_length - sizeof(struct tcphdr)) == 0;
+
+      bool fits = seq == tunnel->write_next_seq
+         && payload <= tunnel->write_segment_size
+         && tunnel->write_segments < TUNNEL_MAX_COALESCED
+         && tunnel->write_length + payload <= TUNNEL_OFFLOAD_BUFFER_SIZE;
+
+      if (!same_flow || !fits || !tunnel_segment_valid(buffer, length, ip_length))
+         return false;
+
+      memcpy(tunnel->write_buffer + tunnel->write_length, buffer + headers, payload);
+      tunnel->write_length += payload;
+      tunnel->write_segments++;
+      tunnel->write_next_seq = seq + payload;
+
+      // a shorter or pushed segment ends the run
+      if (payload < tunnel->write_segment_size || (tcp->th_flags & TH_PUSH))
+      {
+         struct tcphdr* merged = (struct tcphdr*)(tunnel->write_buffer + ip_length);
+         merged->th_flags |= (tcp->th_flags & TH_PUSH);
+         tunnel->write_closed = true;
+      }
+      return true;
+   }
+
+   // start a new run
+   if (!tunnel_segment_valid(buffer, length, ip_length))
+      return false;
+
+   memcpy(tunnel->write_buffer, buffer, length);
+   tunnel->write_length = length;
+   tunnel->write_headers = headers;
+   tunnel->write_segments = 1;
+   tunnel->write_segment_size = payload;
+   tunnel->write_next_seq = seq + payload;
+   tunnel->write_closed = (tcp->th_flags & TH_PUSH) != 0;
+   return true;
+}
+
+bool tunnel_write_offload(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
+{
+   if (tunnel_coalesce(tunnel, buffer, length))
+      return true;
+
+   // not part of the pending run, write that first to keep the order
+   if (tunnel->write_length > 0)
+   {
+      bool flushed = tunnel_flush(tunnel);
+      if (tunnel_coalesce(tunnel, buffer, length))
+         return flushed;
+   }
+
+   struct virtio_net_hdr header;
+   CLEAR(header);
+   return tunnel_write_packet(tunnel, &header, buffer, length);
+}
+
+// plain packets from a descriptor (device or socketpair)
+bool tunnel_fd_read(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
+{
+   ssize_t count = read(tunnel->fd, buffer, *length);
+   if (count >= 0)
+   {
+      *length = (uint32_t)count;
+      return true;
+   }
+
+   // non-blocking may return EAGAIN if data is not ready
+   int32_t error = errno;
+   if (error != EAGAIN)
+      print_errno(__func__, "error reading from tunnel", error);
+   
+   return false;
+}
+
+bool tunnel_fd_write(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
+{
+   ssize_t count = write(tunnel->fd, buffer, length);
+   
+   if (count >= 0)
+   {
+      assert(count == length);
+      return true;
+   }
+
+   // non-blocking may return EAGAIN
+   int32_t error = errno;
+   if (error != EAGAIN)
+      print_errno(__func__, "error writing to tunnel", error);
+
+   return false;
+}
+
+bool tunnel_tun_read(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
+{
+   if (tunnel->offload)
+      return tunnel_read_offload(tunnel, buffer, length);
+   return tunnel_fd_read(tunnel, buffer, length);
+}
+
+bool tunnel_tun_write(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
+{
+   if (tunnel->offload)
+      return tunnel_write_offload(tunnel, buffer, length);
+   return tunnel_fd_write(tunnel, buffer, length);
+}
+
+const TunnelBackend tunnel_backends[TB_Count] =
+{
+   { "tun", true, tunnel_tun_open, tunnel_tun_open_queue, tunnel_tun_close, tunnel_tun_read, tunnel_tun_write },
+   { "ring", false, tunnel_ring_open, tunnel_ring_open_queue, tunnel_ring_close, tunnel_ring_read, tunnel_ring_write },
+   { "socketpair", false, tunnel_socketpair_open, tunnel_socketpair_open_queue, tunnel_socketpair_close, tunnel_fd_read, tunnel_fd_write }
+};
+
+bool tunnel_backend_from_name(const char* name, TunnelBackendType* backend)
+{
+   for (uint32_t i = 0; i < TB_Count; i++)
+   {
+      if (strcmp(name, tunnel_backends[i].name) == 0)
+      {
+         *backend = (TunnelBackendType)i;
+         return true;
+      }
+   }
+   return false;
+}
+
+bool tunnel_open(Tunnel* tunnel, const TunnelBackendType backend, const char* name, const bool offload, const bool multi_queue)
+{
+   if (!tunnel || backend >= TB_Count)
+      return false;
+
+   tunnel->outside = -1;
+   tunnel->socket = -1;
+   tunnel->backend = &tunnel_backends[backend];
+   if (!tunnel->backend->open(tunnel, name, offload, multi_queue))
+   {
+      tunnel->backend = NULL;
+      tunnel->fd = -1;
+      return false;
+   }
+   tunnel->if_name[IF_NAMESIZE-1] = '\0';
+   return true;
+}
+
+// attaches another queue to a multi-queue tunnel
+// queues only move packets, the device is configured through the original tunnel
+bool tunnel_open_queue(Tunnel* queue, const Tunnel* tunnel)
+{
+   if (!queue || !tunnel || tunnel->fd == -1 || !tunnel->multi_queue)
+      return false;
+
+   queue->outside = -1;
+   queue->socket = -1;
+   queue->backend = tunnel->backend;
+   if (!queue->backend->open_queue(queue, tunnel))
+   {
+      queue->backend = NULL;
+      queue->fd = -1;
+      return false;
+   }
+   return true;
+}
+
+bool tunnel_read(Tunnel* tunnel, uint8_t* buffer, uint32_t* length)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+   return tunnel->backend->read(tunnel, buffer, length);
+}
+
+// in offload mode TCP segments may be held back to be coalesced, call tunnel_flush() afterwards
+bool tunnel_write(Tunnel* tunnel, const uint8_t* buffer, const uint32_t length)
+{
+   if (!tunnel_is_valid(tunnel))
+      return false;
+   return tunnel->backend->write(tunnel, buffer, length);
 }
\ No newline at end of file